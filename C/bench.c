@@ -0,0 +1,685 @@
+#include "bpTree.h"
+#include "hashtable.h"
+#include "stats.h"
+#include "tensor.h"
+#include "tensorMath.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Times one or more operations on every chosen storage type over the same
+// input, read from a file or generated, and prints one machine-readable
+// record per storage type, operation and mode pair. Diagnostics go to
+// stderr so stdout stays parseable.
+
+#define BENCH_MAX_PAIRS 32
+#define BENCH_VALUE_MAX 50 // generated values are integers in 1..this, like
+                           // generator.py
+
+static const char * storageNames[] = {
+    [probingHashtable] = "hashtable",   [BPlusTree] = "bptree",
+    [compressedSparseFiber] = "csf",    [sortedCOO] = "coo",
+    [swissHashtable] = "swiss",         [mortonBPlusTree] = "morton",
+    [concurrentHashtable] = "concurrent",
+};
+#define STORAGE_TYPES (sizeof(storageNames) / sizeof(*storageNames))
+
+enum benchOp {
+	opTrace,
+	opContract,
+	opSparseTrace,
+	opSparseContract,
+	opGet,
+	opSet,
+	opIterate,
+};
+
+static const char * opNames[] = {
+    [opTrace] = "trace",
+    [opContract] = "contract",
+    [opSparseTrace] = "sparse-trace",
+    [opSparseContract] = "sparse-contract",
+    [opGet] = "get",
+    [opSet] = "set",
+    [opIterate] = "iterate",
+};
+#define BENCH_OPS (sizeof(opNames) / sizeof(*opNames))
+
+typedef struct benchConfig {
+	const char * input; // if not set, the input is generated
+	tMode_t order;
+	tCoord_t * shape;
+	double density;
+	unsigned long long seed;
+	bool types[STORAGE_TYPES];
+	bool ops[BENCH_OPS];
+	tMode_t pairs[BENCH_MAX_PAIRS][2];
+	size_t pairCount;
+	unsigned int reps;
+	unsigned int warmup;
+	unsigned int threads;
+	bool csv;
+} benchConfig;
+
+// The input as plain COO, so every storage type is built from the same
+// entries in the same order
+typedef struct benchInput {
+	tMode_t order;
+	tCoord_t * shape;
+	size_t count;
+	tCoord_t * coords;
+	float * values;
+	tCoord_t * lookups; // every entry's coordinates, then the same shifted
+} benchInput;
+
+// What a run of one case measured
+typedef struct benchResult {
+	double * seconds; // each timed repetition
+	Stats stats;      // of the last repetition
+	size_t ops;       // per repetition
+	size_t outputCount;
+	size_t inputBytes;
+	size_t outputBytes;
+	long peakKB;   // highest resident size while running the case
+	long growthKB; // how far that is above the size before it
+} benchResult;
+
+static volatile float sink; // keeps lookups and sums from being dropped
+
+static void usage(const char * name) {
+	printf("USAGE:\n    %s [OPTIONS]\n\n", name);
+	printf("Input, one of:\n");
+	printf("    -i FILE       read FILE, text if it ends in .coo, else "
+	       "binary\n");
+	printf("    -s SHAPE      generate a tensor of SHAPE, like 10x10x10\n");
+	printf("    -d DENSITY    fraction of generated entries drawn (.05)\n");
+	printf("    -S SEED       seed for generating (1)\n\n");
+	printf("Benchmark:\n");
+	printf("    -t TYPES      comma-separated storage types, or all (all)\n");
+	printf("    -o OPS        comma-separated operations, or all (contract)\n");
+	printf("    -m PAIRS      mode pairs for trace and contraction, like "
+	       "0:1,1:2 (0:1)\n");
+	printf("    -r REPS       timed repetitions (10)\n");
+	printf("    -w WARMUP     untimed repetitions before them (1)\n");
+	printf("    -j THREADS    threads for trace and contract (1)\n");
+	printf("    -f FORMAT     json or csv (json)\n\n");
+	printf("Storage types:");
+	for (size_t i = 0; i < STORAGE_TYPES; i++)
+		printf(" %s", storageNames[i]);
+	printf("\nOperations:   ");
+	for (size_t i = 0; i < BENCH_OPS; i++)
+		printf(" %s", opNames[i]);
+	printf("\n");
+}
+
+// Marks each comma-separated name in list, or every one for "all".
+// Returns false for a name that isn't in names.
+static bool parseNames(const char * list, const char ** names, size_t count,
+                       bool * chosen) {
+	memset(chosen, 0, count * sizeof(bool));
+	while (*list) {
+		size_t length = strcspn(list, ",");
+		bool all = length == 3 && !strncmp(list, "all", 3);
+		bool found = all;
+		for (size_t i = 0; i < count; i++) {
+			if (all || (strlen(names[i]) == length &&
+			            !strncmp(list, names[i], length))) {
+				chosen[i] = true;
+				found = true;
+			}
+		}
+		if (!found) {
+			fprintf(stderr, "unknown name \"%.*s\"\n", (int)length, list);
+			return false;
+		}
+		list += length + (list[length] == ',');
+	}
+	return true;
+}
+
+static bool parseShape(const char * text, benchConfig * config) {
+	tMode_t order = 1;
+	for (const char * c = text; *c; c++)
+		order += *c == 'x';
+	config->shape = calloc(order, sizeof(tCoord_t));
+	if (!config->shape)
+		return false;
+	config->order = order;
+	for (tMode_t m = 0; m < order; m++) {
+		char * end;
+		unsigned long length = strtoul(text, &end, 10);
+		if (end == text || !length || length > (tCoord_t)-1 ||
+		    *end != (m + 1 < order ? 'x' : '\0')) {
+			fprintf(stderr, "bad shape \"%s\"\n", text);
+			return false;
+		}
+		config->shape[m] = length;
+		text = end + 1;
+	}
+	return true;
+}
+
+static bool parsePairs(const char * text, benchConfig * config) {
+	config->pairCount = 0;
+	while (*text) {
+		unsigned int a, b;
+		int used = 0;
+		if (config->pairCount == BENCH_MAX_PAIRS ||
+		    sscanf(text, "%u:%u%n", &a, &b, &used) != 2 ||
+		    (text[used] && text[used] != ',')) {
+			fprintf(stderr, "bad mode pairs \"%s\"\n", text);
+			return false;
+		}
+		config->pairs[config->pairCount][0] = a;
+		config->pairs[config->pairCount][1] = b;
+		config->pairCount++;
+		text += used + (text[used] == ',');
+	}
+	return config->pairCount;
+}
+
+static bool parseCount(const char * text, unsigned int * count, bool zero) {
+	char * end;
+	unsigned long n = strtoul(text, &end, 10);
+	if (end == text || *end || (!n && !zero) || n > 1000000000) {
+		fprintf(stderr, "bad count \"%s\"\n", text);
+		return false;
+	}
+	*count = n;
+	return true;
+}
+
+static bool parseArgs(int argc, char ** argv, benchConfig * config) {
+	*config = (benchConfig){.density = .05,
+	                        .seed = 1,
+	                        .pairs = {{0, 1}},
+	                        .pairCount = 1,
+	                        .reps = 10,
+	                        .warmup = 1,
+	                        .threads = 1};
+	for (size_t i = 0; i < STORAGE_TYPES; i++)
+		config->types[i] = true;
+	config->ops[opContract] = true;
+
+	int option;
+	while ((option = getopt(argc, argv, "i:s:d:S:t:o:m:r:w:j:f:h")) != -1) {
+		bool success = true;
+		char * end;
+		switch (option) {
+			case 'i':
+				config->input = optarg;
+				break;
+			case 's':
+				free(config->shape);
+				success = parseShape(optarg, config);
+				break;
+			case 'd':
+				config->density = strtod(optarg, &end);
+				success = end != optarg && !*end && config->density > 0 &&
+				          config->density <= 1;
+				if (!success)
+					fprintf(stderr, "bad density \"%s\"\n", optarg);
+				break;
+			case 'S':
+				config->seed = strtoull(optarg, &end, 0);
+				success = end != optarg && !*end;
+				if (!success)
+					fprintf(stderr, "bad seed \"%s\"\n", optarg);
+				break;
+			case 't':
+				success = parseNames(optarg, storageNames, STORAGE_TYPES,
+				                     config->types);
+				break;
+			case 'o':
+				success = parseNames(optarg, opNames, BENCH_OPS, config->ops);
+				break;
+			case 'm':
+				success = parsePairs(optarg, config);
+				break;
+			case 'r':
+				success = parseCount(optarg, &config->reps, false);
+				break;
+			case 'w':
+				success = parseCount(optarg, &config->warmup, true);
+				break;
+			case 'j':
+				success = parseCount(optarg, &config->threads, false);
+				break;
+			case 'f':
+				config->csv = !strcmp(optarg, "csv");
+				success = config->csv || !strcmp(optarg, "json");
+				if (!success)
+					fprintf(stderr, "bad format \"%s\"\n", optarg);
+				break;
+			default:
+				success = false;
+		}
+		if (!success)
+			return false;
+	}
+	if (optind != argc || !config->input == !config->shape) {
+		fprintf(stderr, "give exactly one of -i and -s\n");
+		return false;
+	}
+	return true;
+}
+
+static bool isText(const char * filename) {
+	size_t length = strlen(filename);
+	return length >= 4 && !strcmp(filename + length - 4, ".coo");
+}
+
+// xorshift64*, so a seed gives the same tensor everywhere
+static unsigned long long randomNext(unsigned long long * state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// Draws density of the shape's volume in random coordinates, like
+// generator.py, so repeated coordinates end up as a single entry
+static Tensor * generate(benchConfig * config) {
+	Tensor * T = tensorNew(sortedCOO, config->order, config->shape);
+	if (!T)
+		return 0;
+	double volume = 1;
+	for (tMode_t m = 0; m < config->order; m++)
+		volume *= config->shape[m];
+	size_t n = volume * config->density;
+	tCoord_t * coords = malloc((n + 1) * config->order * sizeof(tCoord_t));
+	float * values = malloc((n + 1) * sizeof(float));
+	if (!coords || !values) {
+		free(coords);
+		free(values);
+		tensorFree(T);
+		return 0;
+	}
+	unsigned long long state = config->seed ? config->seed : 1;
+	for (size_t i = 0; i < n; i++) {
+		for (tMode_t m = 0; m < config->order; m++)
+			coords[i * config->order + m] =
+			    randomNext(&state) % config->shape[m];
+		values[i] = 1 + randomNext(&state) % BENCH_VALUE_MAX;
+	}
+	bool success = tensorBuild(T, n, coords, values);
+	free(coords);
+	free(values);
+	if (!success) {
+		tensorFree(T);
+		return 0;
+	}
+	return T;
+}
+
+static void inputFree(benchInput * input) {
+	free(input->shape);
+	free(input->coords);
+	free(input->values);
+	free(input->lookups);
+}
+
+static bool inputLoad(benchConfig * config, benchInput * input) {
+	*input = (benchInput){0};
+	Tensor * T;
+	if (!config->input) {
+		T = generate(config);
+	} else if (isText(config->input)) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		T = tensorReadParallel(sortedCOO, config->input, cpus > 0 ? cpus : 1);
+	} else {
+		T = tensorReadBinary(sortedCOO, config->input);
+	}
+	if (!T)
+		return false;
+
+	tMode_t order = T->order;
+	size_t n = T->entryCount;
+	input->order = order;
+	input->shape = malloc(order * sizeof(tCoord_t));
+	input->coords = malloc((n + 1) * order * sizeof(tCoord_t));
+	input->values = malloc((n + 1) * sizeof(float));
+	input->lookups = malloc((2 * n + 1) * order * sizeof(tCoord_t));
+	if (!input->shape || !input->coords || !input->values || !input->lookups) {
+		tensorFree(T);
+		inputFree(input);
+		return false;
+	}
+	memcpy(input->shape, T->shape, order * sizeof(tCoord_t));
+
+	tensorIterator iter = tensorGetIterator(T);
+	void * context = iter.init(T);
+	for (tensorEntry item = iter.next(T, context); item.coords;
+	     item = iter.next(T, context)) {
+		memcpy(&input->coords[input->count * order], item.coords,
+		       order * sizeof(tCoord_t));
+		input->values[input->count++] = item.value;
+	}
+	iter.cleanup(context);
+	tensorFree(T);
+
+	// the shifted copies mostly miss, as in the demo's lookups
+	memcpy(input->lookups, input->coords, n * order * sizeof(tCoord_t));
+	memcpy(&input->lookups[n * order], input->coords,
+	       n * order * sizeof(tCoord_t));
+	tMode_t last = order - 1;
+	for (size_t i = n; i < 2 * n; i++) {
+		tCoord_t * coords = &input->lookups[i * order];
+		coords[last] = (coords[last] + 1) % input->shape[last];
+	}
+	return true;
+}
+
+// Resident sizes in KiB from /proc, falling back to getrusage, whose peak
+// can't be reset and so covers the whole run
+static long residentKB(const char * field) {
+	FILE * fp = fopen("/proc/self/status", "r");
+	if (fp) {
+		char line[256];
+		size_t length = strlen(field);
+		long kb = -1;
+		while (kb < 0 && fgets(line, sizeof(line), fp))
+			if (!strncmp(line, field, length) && line[length] == ':')
+				kb = strtol(line + length + 1, 0, 10);
+		fclose(fp);
+		if (kb >= 0)
+			return kb;
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+// lowers the peak resident size to the current one, where Linux allows it
+static void peakReset() {
+	FILE * fp = fopen("/proc/self/clear_refs", "w");
+	if (fp) {
+		fputs("5", fp);
+		fclose(fp);
+	}
+}
+
+// Whether the operation can run on this input with this mode pair.
+// Contractions are of the input with itself.
+static bool caseValid(benchInput * input, enum benchOp op, tMode_t * pair) {
+	bool trace = op == opTrace || op == opSparseTrace;
+	bool contract = op == opContract || op == opSparseContract;
+	if (!trace && !contract)
+		return true;
+	if (pair[0] >= input->order || pair[1] >= input->order) {
+		fprintf(stderr, "modes %u:%u out of range for order %u\n", pair[0],
+		        pair[1], input->order);
+		return false;
+	}
+	if (input->shape[pair[0]] != input->shape[pair[1]]) {
+		fprintf(stderr, "modes %u:%u have different lengths\n", pair[0],
+		        pair[1]);
+		return false;
+	}
+	if (trace && (pair[0] == pair[1] || input->order < 2)) {
+		fprintf(stderr, "trace needs two different modes\n");
+		return false;
+	}
+	return true;
+}
+
+// Runs the operation once on T. Anything it made is handed back in out,
+// to be measured and freed after the timing.
+static bool runOnce(benchConfig * config, benchInput * input, Tensor * T,
+                    enum benchOp op, tMode_t * pair, size_t * ops,
+                    Tensor ** out) {
+	tMode_t order = input->order;
+	float sum = 0;
+	*out = 0;
+	*ops = 1;
+	switch (op) {
+		case opTrace:
+			*out = tensorTraceParallel(T->type, T, pair[0], pair[1],
+			                           config->threads, true);
+			return *out;
+		case opContract:
+			*out = tensorContractParallel(T->type, T, T, pair[0], pair[1],
+			                              config->threads, true);
+			return *out;
+		case opSparseTrace:
+			*out = tensorTraceSparse(T->type, T, pair[0], pair[1]);
+			return *out;
+		case opSparseContract:
+			*out = tensorContractSparse(T->type, T, T, pair[0], pair[1]);
+			return *out;
+		case opGet:
+			for (size_t i = 0; i < 2 * input->count; i++)
+				sum += tensorGet(T, &input->lookups[i * order]);
+			*ops = 2 * input->count;
+			break;
+		case opSet:
+			*out = tensorNew(T->type, order, input->shape);
+			if (!*out)
+				return false;
+			for (size_t i = 0; i < input->count; i++)
+				if (!tensorSet(*out, &input->coords[i * order],
+				               input->values[i]))
+					return false;
+			*ops = input->count;
+			break;
+		case opIterate: {
+			tensorIterator iter = tensorGetIterator(T);
+			void * context = iter.init(T);
+			*ops = 0;
+			for (tensorEntry item = iter.next(T, context); item.coords;
+			     item = iter.next(T, context), ++*ops)
+				sum += item.value;
+			iter.cleanup(context);
+			break;
+		}
+	}
+	sink = sum;
+	return true;
+}
+
+static bool runCase(benchConfig * config, benchInput * input, Tensor * T,
+                    enum benchOp op, tMode_t * pair, benchResult * result) {
+	peakReset();
+	long base = residentKB("VmRSS");
+	for (unsigned int rep = 0; rep < config->warmup + config->reps; rep++) {
+		Tensor * out;
+		size_t ops;
+		statsProbe probe;
+		statsBegin(&probe);
+		bool success = runOnce(config, input, T, op, pair, &ops, &out);
+		Stats stats = statsEnd(&probe);
+		if (!success) {
+			tensorFree(out);
+			return false;
+		}
+		if (rep >= config->warmup) {
+			result->seconds[rep - config->warmup] = stats.seconds;
+			result->stats = stats;
+			result->ops = ops;
+			result->outputCount = out ? out->entryCount : 0;
+			result->outputBytes = out ? tensorSize(out) : 0;
+		}
+		tensorFree(out);
+	}
+	result->inputBytes = tensorSize(T);
+	result->peakKB = residentKB("VmHWM");
+	result->growthKB = result->peakKB > base ? result->peakKB - base : 0;
+	return true;
+}
+
+static int compareSeconds(const void * x, const void * y) {
+	double a = *(const double *)x;
+	double b = *(const double *)y;
+	return a < b ? -1 : a > b;
+}
+
+static void jsonString(const char * text) {
+	putchar('"');
+	for (; *text; text++) {
+		if (*text == '"' || *text == '\\')
+			printf("\\%c", *text);
+		else if ((unsigned char)*text < 0x20)
+			printf("\\u%04x", *text);
+		else
+			putchar(*text);
+	}
+	putchar('"');
+}
+
+static void printHeader(benchConfig * config, benchInput * input) {
+	if (config->csv) {
+		puts("storage,operation,mode_a,mode_b,threads,reps,median_s,p99_s,"
+		     "min_s,mean_s,ops,ops_per_s,nnz_per_s,input_nnz,output_nnz,"
+		     "input_bytes,output_bytes,peak_rss_kb,rss_growth_kb,mem,add,mul,"
+		     "cmp,node_changes,instructions,cache_misses");
+		return;
+	}
+	printf("{\n  \"input\": {\"source\": ");
+	if (config->input)
+		jsonString(config->input);
+	else
+		printf("\"generated\", \"density\": %.9g, \"seed\": %llu",
+		       config->density, config->seed);
+	printf(", \"order\": %u, \"shape\": [", input->order);
+	for (tMode_t m = 0; m < input->order; m++)
+		printf("%s%u", m ? ", " : "", input->shape[m]);
+	printf("], \"nnz\": %lu},\n", input->count);
+	printf("  \"config\": {\"reps\": %u, \"warmup\": %u, \"threads\": %u, "
+	       "\"bpt_order\": %i, \"ht_overprovision\": %.9g, \"key_bits\": "
+	       "%lu, \"stats\": %s, \"perf\": %s},\n",
+	       config->reps, config->warmup, config->threads, BPT_ORDER,
+	       (double)HT_OVERPROVISION, (unsigned long)TENSOR_KEY_BITS,
+#ifdef TENSOR_NO_STATS
+	       "false",
+#else
+	       "true",
+#endif
+#if defined(STATS_PERF) && defined(__linux__)
+	       "true");
+#else
+	       "false");
+#endif
+	printf("  \"results\": [");
+}
+
+static void printResult(benchConfig * config, benchInput * input,
+                        enum storageType type, enum benchOp op,
+                        tMode_t * pair, benchResult * result, bool first) {
+	size_t reps = config->reps;
+	double * seconds = result->seconds;
+	double mean = 0;
+	for (size_t i = 0; i < reps; i++)
+		mean += seconds[i] / reps;
+	qsort(seconds, reps, sizeof(double), compareSeconds);
+	double median = reps % 2 ? seconds[reps / 2]
+	                         : (seconds[reps / 2 - 1] + seconds[reps / 2]) / 2;
+	double p99 = seconds[(99 * reps + 99) / 100 - 1]; // nearest rank
+	double opsRate = median > 0 ? result->ops / median : 0;
+	double nnzRate = median > 0 ? input->count / median : 0;
+	Stats * stats = &result->stats;
+
+	if (config->csv) {
+		printf("%s,%s,", storageNames[type], opNames[op]);
+		if (pair)
+			printf("%u,%u,", pair[0], pair[1]);
+		else
+			printf(",,");
+		printf("%u,%u,%.9g,%.9g,%.9g,%.9g,%lu,%.9g,%.9g,%lu,%lu,%lu,%lu,%li,"
+		       "%li,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+		       config->threads, config->reps, median, p99, seconds[0], mean,
+		       result->ops, opsRate, nnzRate, input->count,
+		       result->outputCount, result->inputBytes, result->outputBytes,
+		       result->peakKB, result->growthKB, stats->mem, stats->add,
+		       stats->mul, stats->cmp, stats->nodeChanges,
+		       stats->instructions, stats->cacheMisses);
+		return;
+	}
+	printf("%s\n    {\"storage\": \"%s\", \"operation\": \"%s\", ",
+	       first ? "" : ",", storageNames[type], opNames[op]);
+	if (pair)
+		printf("\"modes\": [%u, %u], ", pair[0], pair[1]);
+	else
+		printf("\"modes\": null, ");
+	printf("\"threads\": %u, \"reps\": %u,\n", config->threads, config->reps);
+	printf("     \"median_s\": %.9g, \"p99_s\": %.9g, \"min_s\": %.9g, "
+	       "\"mean_s\": %.9g,\n",
+	       median, p99, seconds[0], mean);
+	printf("     \"ops\": %lu, \"ops_per_s\": %.9g, \"nnz_per_s\": %.9g,\n",
+	       result->ops, opsRate, nnzRate);
+	printf("     \"input_nnz\": %lu, \"output_nnz\": %lu, \"input_bytes\": "
+	       "%lu, \"output_bytes\": %lu,\n",
+	       input->count, result->outputCount, result->inputBytes,
+	       result->outputBytes);
+	printf("     \"peak_rss_kb\": %li, \"rss_growth_kb\": %li,\n",
+	       result->peakKB, result->growthKB);
+	printf("     \"stats\": {\"mem\": %lu, \"add\": %lu, \"mul\": %lu, "
+	       "\"cmp\": %lu, \"node_changes\": %lu, \"instructions\": %lu, "
+	       "\"cache_misses\": %lu}}",
+	       stats->mem, stats->add, stats->mul, stats->cmp, stats->nodeChanges,
+	       stats->instructions, stats->cacheMisses);
+}
+
+int main(int argc, char ** argv) {
+	benchConfig config;
+	if (!parseArgs(argc, argv, &config)) {
+		usage(argv[0]);
+		free(config.shape);
+		return 1;
+	}
+	benchInput input;
+	bool success = inputLoad(&config, &input);
+	free(config.shape);
+	if (!success) {
+		fprintf(stderr, "failed to load the input\n");
+		return 1;
+	}
+
+	benchResult result = {.seconds = malloc(config.reps * sizeof(double))};
+	if (!result.seconds) {
+		inputFree(&input);
+		return 1;
+	}
+	printHeader(&config, &input);
+	bool first = true;
+	int status = 0;
+	for (size_t type = 0; type < STORAGE_TYPES; type++) {
+		if (!config.types[type])
+			continue;
+		Tensor * T = tensorNew(type, input.order, input.shape);
+		if (!T || !tensorBuild(T, input.count, input.coords, input.values)) {
+			fprintf(stderr, "failed to build %s input\n", storageNames[type]);
+			tensorFree(T);
+			status = 1;
+			continue;
+		}
+		for (size_t op = 0; op < BENCH_OPS; op++) {
+			if (!config.ops[op])
+				continue;
+			bool modes = op == opTrace || op == opContract ||
+			             op == opSparseTrace || op == opSparseContract;
+			for (size_t p = 0; p < (modes ? config.pairCount : 1); p++) {
+				tMode_t * pair = modes ? config.pairs[p] : 0;
+				fprintf(stderr, "%s %s", storageNames[type], opNames[op]);
+				if (pair)
+					fprintf(stderr, " %u:%u", pair[0], pair[1]);
+				fputc('\n', stderr);
+				if (!caseValid(&input, op, pair) ||
+				    !runCase(&config, &input, T, op, pair, &result)) {
+					fprintf(stderr, "  failed\n");
+					status = 1;
+					continue;
+				}
+				printResult(&config, &input, type, op, pair, &result, first);
+				first = false;
+			}
+		}
+		tensorFree(T);
+	}
+	if (!config.csv)
+		printf("\n  ]\n}\n");
+
+	free(result.seconds);
+	inputFree(&input);
+	return status;
+}
@@ -3,38 +3,145 @@
 #include "tensor.h"
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
-typedef unsigned long long tKey_t;
+// Row-major keys keep each mode-0 slice together for prefix ranges.
+// Morton keys instead keep coordinates that are close in every mode in
+// nearby leaves, which helps lookups that walk any other mode.
+static tKey_t _Coords2Key(Tensor * T, tCoord_t * coords) {
+	if (T->type == mortonBPlusTree)
+		return tensorCoords2Morton(T, coords);
+	return tensorCoords2Key(T, coords);
+}
+
+static void _Key2Coords(Tensor * T, tCoord_t * coords, tKey_t key) {
+	if (T->type == mortonBPlusTree)
+		tensorMorton2Coords(T, coords, key);
+	else
+		tensorKey2Coords(T, coords, key);
+}
 
+// Keys come first so they start on the node's own cache line, and a
+// search only touches the key array until it knows which slot it needs.
+// The alignment pads the size to whole lines, so every node in a chunk
+// starts on one, not just the first.
 typedef struct bptNode {
-	bool isLeaf;
-	size_t childCount;
+	_Alignas(BPT_NODE_ALIGN) tKey_t keys[BPT_ORDER];
 	union {
-		// since we're storing sparse tensors, a zero float is considered empty
-		float values[BPT_ORDER];    // if isLeaf
-		void * children[BPT_ORDER]; // if !isLeaf
+		// zeros aren't stored, setting one deletes the entry instead
+		float values[BPT_ORDER];           // if isLeaf
+		struct bptNode * children[BPT_ORDER]; // if !isLeaf
 	};
-	tKey_t keys[BPT_ORDER]; // if isLeaf
+	struct bptNode * next; // right sibling if isLeaf, so scans skip the tree
+	unsigned short childCount;
+	bool isLeaf;
 } bptNode;
-const size_t _bptNodeSize = 2+(BPT_ORDER*(sizeof(tKey_t)+sizeof(float)));
+const size_t _bptNodeSize = sizeof(bptNode);
+
+// Nodes are carved out of chunks that double in size, so neighbouring
+// nodes tend to share pages and freeing the tree is one free per chunk.
+// Nodes released by merges are kept on a free list, linked through next.
+typedef struct bptPool {
+	bptNode ** chunks;
+	size_t chunkCount;
+	size_t chunkSlots; // length of the chunks array
+	size_t chunkSize;  // nodes in the newest chunk
+	size_t chunkUsed;  // nodes handed out from the newest chunk
+	size_t capacity;   // nodes in all chunks
+	size_t live;       // nodes currently in the tree
+	size_t freeCount;
+	bptNode * freeList;
+} bptPool;
+
+typedef struct bptTree {
+	bptNode * root;
+	bptPool pool;
+} bptTree;
+
+static bool _poolGrow(bptPool * pool, size_t size) {
+	if (pool->chunkCount == pool->chunkSlots) {
+		size_t slots = pool->chunkSlots ? 2 * pool->chunkSlots : 8;
+		bptNode ** chunks = realloc(pool->chunks, slots * sizeof(bptNode *));
+		if (!chunks)
+			return false;
+		pool->chunks = chunks;
+		pool->chunkSlots = slots;
+	}
+	void * chunk;
+	if (posix_memalign(&chunk, BPT_NODE_ALIGN, size * sizeof(bptNode)))
+		return false;
+	pool->chunks[pool->chunkCount++] = chunk;
+	pool->chunkSize = size;
+	pool->chunkUsed = 0;
+	pool->capacity += size;
+	return true;
+}
 
-static tKey_t _Coords2Key(Tensor * T, tCoord_t * coords) {
-	tKey_t key = 0;
-	for (tMode_t mode = 0; mode < T->order; mode++) {
-		key += (tKey_t)coords[(T->order - 1) - mode]
-		       << (mode * BPT_KEYGEN_FIELD_SIZE);
+// makes sure n more nodes can be handed out, in one chunk if it's new
+static bool _poolReserve(bptPool * pool, size_t n) {
+	size_t available = pool->freeCount + pool->chunkSize - pool->chunkUsed;
+	if (n <= available)
+		return true;
+	return _poolGrow(pool, n - pool->freeCount);
+}
+
+// zeroed node starting on a cache line boundary
+static bptNode * _nodeNew(bptPool * pool, bool isLeaf) {
+	bptNode * node = pool->freeList;
+	if (node) {
+		pool->freeList = node->next;
+		pool->freeCount--;
+	} else {
+		size_t size = pool->chunkSize ? 2 * pool->chunkSize : BPT_POOL_MIN_CHUNK;
+		if (size > BPT_POOL_MAX_CHUNK)
+			size = BPT_POOL_MAX_CHUNK;
+		if (pool->chunkUsed == pool->chunkSize && !_poolGrow(pool, size))
+			return NULL;
+		node = &pool->chunks[pool->chunkCount - 1][pool->chunkUsed++];
 	}
-	return key;
+	memset(node, 0, sizeof(bptNode));
+	node->isLeaf = isLeaf;
+	pool->live++;
+	return node;
 }
 
-static void _Key2Coords(Tensor * T, tCoord_t * coords, tKey_t key) {
-	tCoord_t mask = ~0;
-	mask <<= (sizeof(mask) * 8) - BPT_KEYGEN_FIELD_SIZE;
-	mask >>= (sizeof(mask) * 8) - BPT_KEYGEN_FIELD_SIZE;
-	for (tMode_t mode = 0; mode < T->order; mode++) {
-		coords[(T->order - 1) - mode] =
-		    (key >> (mode * BPT_KEYGEN_FIELD_SIZE)) & mask;
+static void _nodeRelease(bptPool * pool, bptNode * node) {
+	node->next = pool->freeList;
+	pool->freeList = node;
+	pool->freeCount++;
+	pool->live--;
+}
+
+// Branchless binary search: the number of keys[0..n) that are < key.
+// The loop runs log2(n) times whatever the keys are, and each step is a
+// conditional move rather than a branch the CPU could mispredict.
+static size_t _lowerBound(const tKey_t * keys, size_t n, tKey_t key) {
+	if (!n)
+		return 0;
+	const tKey_t * base = keys;
+	while (n > 1) {
+		size_t half = n / 2;
+		STATS_COUNT(cmp, 1);
+		base = (base[half] < key) ? base + half : base;
+		n -= half;
 	}
+	STATS_COUNT(cmp, 1);
+	return (base - keys) + (*base < key);
+}
+
+// same as _lowerBound, but counts the keys that are <= key
+static size_t _upperBound(const tKey_t * keys, size_t n, tKey_t key) {
+	if (!n)
+		return 0;
+	const tKey_t * base = keys;
+	while (n > 1) {
+		size_t half = n / 2;
+		STATS_COUNT(cmp, 1);
+		base = (base[half] <= key) ? base + half : base;
+		n -= half;
+	}
+	STATS_COUNT(cmp, 1);
+	return (base - keys) + (*base <= key);
 }
 
 static void _printKey(Tensor * T, tKey_t key) {
@@ -45,43 +152,106 @@ static void _printKey(Tensor * T, tKey_t key) {
 }
 
 void * bptNew() {
-	bptNode * root = calloc(sizeof(bptNode), 1);
-	root->isLeaf = true;
-	statsGlobal.mem++;
-	return root;
+	bptTree * tree = calloc(1, sizeof(bptTree));
+	if (!tree)
+		return NULL;
+	tree->root = _nodeNew(&tree->pool, true);
+	if (!tree->root) {
+		free(tree);
+		return NULL;
+	}
+	STATS_COUNT(mem, 1);
+	return tree;
 }
 
-// Recursive B+ Tree free
-void _freeNode(bptNode * n) {
+// Recursively hands a subtree back to the pool
+static void _releaseTree(bptPool * pool, bptNode * n) {
 	if (!n)
 		return;
-	statsGlobal.mem++;
+	STATS_COUNT(mem, 1);
 	if (!n->isLeaf)
-		for (size_t i = 0; i < BPT_ORDER; i++)
-			_freeNode(n->children[i]);
-	free(n);
+		for (size_t i = 0; i < n->childCount; i++)
+			_releaseTree(pool, n->children[i]);
+	_nodeRelease(pool, n);
 }
 
-// Start recursive free from the root
+// Every node lives in the pool, so there's no need to walk the tree
 void bptFree(Tensor * T) {
 	if (!T || !T->values)
 		return;
-	bptNode * root = T->values;
-	_freeNode(root);
+	bptTree * tree = T->values;
+	for (size_t i = 0; i < tree->pool.chunkCount; i++)
+		free(tree->pool.chunks[i]);
+	free(tree->pool.chunks);
+	free(tree);
+	T->values = 0;
+}
+
+bptPoolStats bptGetPoolStats(Tensor * T) {
+	if (!T || !T->values)
+		return (bptPoolStats){0};
+	bptTree * tree = T->values;
+	return (bptPoolStats){.chunks = tree->pool.chunkCount,
+	                      .capacity = tree->pool.capacity,
+	                      .live = tree->pool.live,
+	                      .free = tree->pool.freeCount,
+	                      .slack = _bptNodeSize *
+	                               (tree->pool.capacity - tree->pool.live)};
+}
+
+// Copies a subtree into new nodes from pool, which has room for them,
+// linking the copied leaves left to right after *prevLeaf
+static bptNode * _copyTree(bptPool * pool, bptNode * n, bptNode ** prevLeaf) {
+	bptNode * copy = _nodeNew(pool, n->isLeaf);
+	STATS_COUNT(mem, 2); // fetch node, store copy
+	memcpy(copy, n, sizeof(bptNode));
+	if (n->isLeaf) {
+		copy->next = NULL;
+		if (*prevLeaf)
+			(*prevLeaf)->next = copy;
+		*prevLeaf = copy;
+	} else {
+		for (size_t i = 0; i < n->childCount; i++)
+			copy->children[i] = _copyTree(pool, n->children[i], prevLeaf);
+	}
+	return copy;
+}
+
+// Free nodes stay in their chunks, so after enough deletions the pool is
+// mostly empty. Moving the tree into one chunk of just its size lets the
+// old chunks be freed, and costs one copy per live node.
+static void _poolCompact(bptTree * tree) {
+	bptPool * pool = &tree->pool;
+	if (pool->freeCount <= pool->live || pool->freeCount < BPT_POOL_MIN_CHUNK)
+		return;
+	bptPool packed = {0};
+	size_t size = pool->live > BPT_POOL_MIN_CHUNK ? pool->live
+	                                              : BPT_POOL_MIN_CHUNK;
+	if (!_poolGrow(&packed, size))
+		return; // the old pool still works
+	bptNode * prevLeaf = NULL;
+	bptNode * root = _copyTree(&packed, tree->root, &prevLeaf);
+	for (size_t i = 0; i < pool->chunkCount; i++)
+		free(pool->chunks[i]);
+	free(pool->chunks);
+	tree->pool = packed;
+	tree->root = root;
 }
 
 // Split leaf node into two nodes, and add new value to one of them.
 // Returns a new leaf node that's a sibling of the one you pass in.
-bptNode * _splitLeaf(bptNode * node, tKey_t key, float value, size_t idx) {
+bptNode * _splitLeaf(bptPool * pool, bptNode * node, tKey_t key, float value,
+                     size_t idx) {
 	const size_t half = BPT_ORDER / 2; // assume BPT_ORDER is even
-	bptNode * newNode = calloc(sizeof(bptNode), 1);
+	bptNode * newNode = _nodeNew(pool, true);
 	newNode->childCount = half;
-	newNode->isLeaf = true;
 	node->childCount = half;
+	newNode->next = node->next;
+	node->next = newNode;
 
-	statsGlobal.mem += 3; // read old node, write both new ones
-	statsGlobal.add += 1; // child count increment
-	statsGlobal.cmp += 1; // index comparison
+	STATS_COUNT(mem, 3); // read old node, write both new ones
+	STATS_COUNT(add, 1); // child count increment
+	STATS_COUNT(cmp, 1); // index comparison
 
 	// behavior depends on if insertion point is in old or new node
 	if (idx < half) {
@@ -136,15 +306,16 @@ bptNode * _splitLeaf(bptNode * node, tKey_t key, float value, size_t idx) {
 
 // Split internal node into two nodes, and add new child to one of them.
 // Returns a new internal node that's a sibling of the node you pass in.
-bptNode * _splitInternal(bptNode * node, bptNode * newChild, size_t idx) {
+bptNode * _splitInternal(bptPool * pool, bptNode * node, bptNode * newChild,
+                         size_t idx) {
 	const size_t half = BPT_ORDER / 2; // assume BPT_ORDER is even
-	bptNode * newNode = calloc(sizeof(bptNode), 1);
+	bptNode * newNode = _nodeNew(pool, false);
 	newNode->childCount = half;
 	node->childCount = half;
 
-	statsGlobal.mem += 3; // read old node, write two new ones
-	statsGlobal.add += 1; // child count increment
-	statsGlobal.cmp += 1; // index comparison
+	STATS_COUNT(mem, 3); // read old node, write two new ones
+	STATS_COUNT(add, 1); // child count increment
+	STATS_COUNT(cmp, 1); // index comparison
 
 	// behavior depends on if insertion point is in old or new node
 	if (idx < half) {
@@ -197,35 +368,36 @@ bptNode * _splitInternal(bptNode * node, bptNode * newChild, size_t idx) {
 	}
 }
 
+// Index of the child of an internal node whose interval holds key.
+// keys[0] is the subtree minimum, so anything below keys[1] (including
+// keys smaller than everything in the tree) goes to the first child.
+static size_t _route(bptNode * node, tKey_t key) {
+	return _upperBound(&node->keys[1], node->childCount - 1, key);
+}
+
 // Recursive B+ Tree insertion function.
 // Returns NULL or a pointer to a new sibling node if there's a split.
 // todo: remove Tensor argument
 bptNode * _insert(Tensor * T, bptNode * node, tKey_t key, float value) {
 	if (!node)
 		return NULL;
-	statsGlobal.mem += 2; // get the node we'll interact with then store it
+	bptTree * tree = T->values;
+	STATS_COUNT(mem, 2); // get the node we'll interact with then store it
 	if (node->isLeaf) {
-		// todo: binary search
-		size_t insertIdx = node->childCount;
-		for (size_t i = 0; i < node->childCount; i++) {
-			statsGlobal.cmp++; // key check
-			if (key == node->keys[i]) {
-				// update existing value instead of inserting
-				statsGlobal.mem++; // save new value
-
-				node->values[i] = value;
-				return NULL;
-			}
-			if (key < node->keys[i]) {
-				insertIdx = i;
-				break;
-			}
+		size_t insertIdx = _lowerBound(node->keys, node->childCount, key);
+		STATS_COUNT(cmp, 1); // key check
+		if (insertIdx < node->childCount && key == node->keys[insertIdx]) {
+			// update existing value instead of inserting
+			STATS_COUNT(mem, 1); // save new value
+
+			node->values[insertIdx] = value;
+			return NULL;
 		}
 
 		T->entryCount++;
-		statsGlobal.cmp++; // count check
+		STATS_COUNT(cmp, 1); // count check
 		if (node->childCount == BPT_ORDER) {
-			return _splitLeaf(node, key, value, insertIdx);
+			return _splitLeaf(&tree->pool, node, key, value, insertIdx);
 		}
 
 		// else shift children to add new entry
@@ -246,15 +418,11 @@ bptNode * _insert(Tensor * T, bptNode * node, tKey_t key, float value) {
 		node->childCount++;
 		return NULL;
 	} else { // internal node
-		// todo: binary search
-		size_t insertIdx;
-		for (insertIdx = 0; insertIdx < node->childCount - 1; insertIdx++)
-			if (key <= node->keys[insertIdx + 1])
-				break;
+		size_t insertIdx = _route(node, key);
 		bptNode * newChild = _insert(T, node->children[insertIdx], key, value);
 
 		if (!newChild) {
-			statsGlobal.cmp++;
+			STATS_COUNT(cmp, 1);
 			if (!insertIdx) {
 				bptNode * firstChild = node->children[0];
 				node->keys[0] = firstChild->keys[0];
@@ -262,22 +430,22 @@ bptNode * _insert(Tensor * T, bptNode * node, tKey_t key, float value) {
 			return NULL;
 		}
 
-		statsGlobal.mem++; // look at first child
+		STATS_COUNT(mem, 1); // look at first child
 		tKey_t newInterval = newChild->keys[0];
 
 		// adjust shift point depending on new sort order
 		bptNode * oldFirstChild = node->children[insertIdx];
 		tKey_t oldInterval = oldFirstChild->keys[0];
 
-		statsGlobal.cmp++; // interval check
+		STATS_COUNT(cmp, 1); // interval check
 		bool swap = (newInterval > oldInterval);
 		if (swap)
 			insertIdx++;
 
 		// if too many children then we need to split and tell our parent
-		statsGlobal.cmp++; // child count check
+		STATS_COUNT(cmp, 1); // child count check
 		if (node->childCount == BPT_ORDER)
-			return _splitInternal(node, newChild, insertIdx);
+			return _splitInternal(&tree->pool, node, newChild, insertIdx);
 
 		// else shift children to add new entry
 		for (size_t i = node->childCount - 1; i > insertIdx; i--) {
@@ -295,13 +463,112 @@ bptNode * _insert(Tensor * T, bptNode * node, tKey_t key, float value) {
 		node->children[insertIdx] = newChild;
 		node->keys[insertIdx] = newChild->keys[0];
 		node->childCount++;
-		statsGlobal.add++; // increment child count
-		statsGlobal.mem++; // store new child
+		STATS_COUNT(add, 1); // increment child count
+		STATS_COUNT(mem, 1); // store new child
 
 		return NULL; // no new siblings for parent to be aware of
 	}
 }
 
+// Moves n entries (or children) of src, starting at from, to dst at to.
+static void _moveEntries(bptNode * dst, size_t to, bptNode * src,
+                         size_t from, size_t n) {
+	memmove(&dst->keys[to], &src->keys[from], n * sizeof(tKey_t));
+	if (src->isLeaf)
+		memmove(&dst->values[to], &src->values[from], n * sizeof(float));
+	else
+		memmove(&dst->children[to], &src->children[from],
+		        n * sizeof(bptNode *));
+}
+
+// Child i of node has fallen below half full. Take an entry from a
+// sibling that can spare one, or else merge the two into the left one.
+static void _rebalance(bptPool * pool, bptNode * node, size_t i) {
+	const size_t half = BPT_ORDER / 2;
+	size_t li = i ? i - 1 : i; // left of the pair
+	bptNode * left = node->children[li];
+	bptNode * right = node->children[li + 1];
+	STATS_COUNT(mem, 2); // fetch both siblings
+
+	STATS_COUNT(cmp, 1);
+	if (li == i && right->childCount > half) {
+		// borrow the first entry of the right sibling
+		_moveEntries(left, left->childCount, right, 0, 1);
+		_moveEntries(right, 0, right, 1, right->childCount - 1);
+		left->childCount++;
+		right->childCount--;
+	} else if (li != i && left->childCount > half) {
+		// borrow the last entry of the left sibling
+		_moveEntries(right, 1, right, 0, right->childCount);
+		_moveEntries(right, 0, left, left->childCount - 1, 1);
+		left->childCount--;
+		right->childCount++;
+	} else {
+		// both fit in one node, so right goes into left
+		_moveEntries(left, left->childCount, right, 0, right->childCount);
+		left->childCount += right->childCount;
+		if (left->isLeaf)
+			left->next = right->next;
+		_nodeRelease(pool, right);
+		_moveEntries(node, li + 1, node, li + 2, node->childCount - li - 2);
+		node->childCount--;
+		node->children[node->childCount] = NULL;
+		node->keys[li] = left->keys[0];
+		STATS_COUNT(mem, 1); // store merged node
+		return;
+	}
+	STATS_COUNT(mem, 2); // store both siblings
+	node->keys[li] = left->keys[0];
+	node->keys[li + 1] = right->keys[0];
+}
+
+// Recursive B+ Tree deletion.
+// Returns true if node is now under half full and needs rebalancing.
+static bool _delete(Tensor * T, bptNode * node, tKey_t key) {
+	STATS_COUNT(mem, 1); // fetch node
+	if (node->isLeaf) {
+		size_t i = _lowerBound(node->keys, node->childCount, key);
+		STATS_COUNT(cmp, 1);
+		if (i == node->childCount || node->keys[i] != key)
+			return false; // already absent
+		_moveEntries(node, i, node, i + 1, node->childCount - i - 1);
+		node->childCount--;
+		T->entryCount--;
+		STATS_COUNT(mem, 1); // store node
+		return node->childCount < BPT_ORDER / 2;
+	}
+
+	size_t i = _route(node, key);
+	bptNode * child = node->children[i];
+	bool underflow = _delete(T, child, key);
+	// the child's minimum may have been the deleted key
+	if (child->childCount)
+		node->keys[i] = child->keys[0];
+	STATS_COUNT(cmp, 1);
+	if (underflow && node->childCount > 1)
+		_rebalance(&((bptTree *)T->values)->pool, node, i);
+	return node->childCount < BPT_ORDER / 2;
+}
+
+bool bptDelete(Tensor * T, tCoord_t * coords) {
+	if (!T || !T->values || !coords)
+		return false;
+	bptTree * tree = T->values;
+	STATS_COUNT(mem, 1); // get root node
+	_delete(T, tree->root, _Coords2Key(T, coords));
+
+	// the root may only have one child left, which then becomes the root
+	bptNode * root = tree->root;
+	while (!root->isLeaf && root->childCount == 1) {
+		tree->root = root->children[0];
+		_nodeRelease(&tree->pool, root);
+		root = tree->root;
+		STATS_COUNT(mem, 1); // store new root
+	}
+	_poolCompact(tree);
+	return true;
+}
+
 // Start insertion from the root. Also handles root splitting.
 bool bptSet(Tensor * T, tCoord_t * coords, float value) {
 	if (!T || !T->values || !coords)
@@ -315,15 +582,16 @@ bool bptSet(Tensor * T, tCoord_t * coords, float value) {
 	    ;
 	*/
 
-	statsGlobal.mem++; // get root node
-	bptNode * root = T->values;
+	bptTree * tree = T->values;
+	STATS_COUNT(mem, 1); // get root node
+	bptNode * root = tree->root;
 	tKey_t key = _Coords2Key(T, coords);
 	bptNode * rootSibling = _insert(T, root, key, value);
 
 	bool store_new_root = false;
 
 	// todo: is this actually needed?
-	statsGlobal.cmp++;
+	STATS_COUNT(cmp, 1);
 	if (key < root->keys[0]) {
 		store_new_root = true;
 		root->keys[0] = key;
@@ -331,60 +599,253 @@ bool bptSet(Tensor * T, tCoord_t * coords, float value) {
 
 	if (rootSibling) {
 		// root node split during insertion, so integrate new node
-		bptNode * newRoot = calloc(sizeof(bptNode), 1);
-		newRoot->isLeaf = false;
+		bptNode * newRoot = _nodeNew(&tree->pool, false);
+		if (!newRoot)
+			return false;
 		newRoot->childCount = 2;
 		newRoot->children[0] = root;
 		newRoot->children[1] = rootSibling;
 		newRoot->keys[0] = root->keys[0];
 		newRoot->keys[1] = rootSibling->keys[0];
-		T->values = newRoot;
+		tree->root = newRoot;
 		store_new_root = true;
 	}
 	// bptPrintAll(T);
 	if (store_new_root)
-		statsGlobal.mem++; // something needed to be updated
+		STATS_COUNT(mem, 1); // something needed to be updated
 	return true;            // insertion success
 };
 
+typedef struct bptSortItem {
+	tKey_t key;
+	size_t pos;
+} bptSortItem;
+
+static int _bptSortCompare(const void * x, const void * y) {
+	const bptSortItem * a = x;
+	const bptSortItem * b = y;
+	STATS_COUNT(cmp, 1);
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+	return a->pos < b->pos ? -1 : a->pos > b->pos;
+}
+
+// how many nodes hold count entries (or children) at the fill factor
+static size_t _levelNodes(size_t count) {
+	const size_t half = BPT_ORDER / 2;
+	size_t perNode = BPT_ORDER * BPT_FILL_FACTOR;
+	if (perNode < half)
+		perNode = half;
+	if (perNode > BPT_ORDER)
+		perNode = BPT_ORDER;
+	size_t nodes = (count + perNode - 1) / perNode;
+	// every node but the root keeps at least half, like after a split,
+	// which deletion relies on
+	if (nodes > 1 && count / nodes < half)
+		nodes = count / half;
+	return nodes;
+}
+
+// Makes the parents of nodes[0..count), splitting the children evenly
+// so no parent ends up nearly empty. Frees everything on failure.
+static bptNode ** _buildParents(bptPool * pool, bptNode ** nodes,
+                                size_t count, size_t * parentCount) {
+	size_t parents = _levelNodes(count);
+	bptNode ** level = malloc(parents * sizeof(bptNode *));
+	size_t next = 0;
+	for (size_t i = 0; level && i < parents; i++) {
+		size_t take = (count - next) / (parents - i);
+		bptNode * node = _nodeNew(pool, false);
+		if (!node) {
+			for (size_t j = 0; j < i; j++)
+				_releaseTree(pool, level[j]);
+			free(level);
+			level = NULL;
+			break;
+		}
+		for (size_t j = 0; j < take; j++) {
+			node->children[j] = nodes[next + j];
+			node->keys[j] = nodes[next + j]->keys[0];
+		}
+		node->childCount = take;
+		STATS_COUNT(mem, 1); // store new node
+		next += take;
+		level[i] = node;
+	}
+	if (!level)
+		for (; next < count; next++)
+			_releaseTree(pool, nodes[next]);
+	free(nodes);
+	*parentCount = parents;
+	return level;
+}
+
+bool bptBuild(Tensor * T, size_t n, tCoord_t * coords, float * values) {
+	if (!T || !T->values || (n && (!coords || !values)))
+		return false;
+	if (T->entryCount)
+		return false;
+	bptTree * tree = T->values;
+
+	bptSortItem * items = malloc((n + 1) * sizeof(bptSortItem));
+	if (!items)
+		return false;
+	bool sorted = true;
+	for (size_t i = 0; i < n; i++) {
+		items[i].key = _Coords2Key(T, &coords[i * T->order]);
+		items[i].pos = i;
+		STATS_COUNT(cmp, 1);
+		if (i && items[i].key < items[i - 1].key)
+			sorted = false;
+	}
+	// output of other operations often arrives in order already
+	if (!sorted)
+		qsort(items, n, sizeof(bptSortItem), _bptSortCompare);
+
+	// keep only the last of each run of equal keys, unless it's zero
+	size_t unique = 0;
+	for (size_t i = 0; i < n; i++) {
+		STATS_COUNT(cmp, 1);
+		if (i + 1 < n && items[i].key == items[i + 1].key)
+			continue;
+		if (values[items[i].pos])
+			items[unique++] = items[i];
+	}
+	if (!unique) {
+		free(items);
+		return true;
+	}
+
+	// the whole tree's size is known, so get its nodes in one piece
+	size_t nodes = 0;
+	for (size_t c = unique; c > 1 || !nodes; c = _levelNodes(c))
+		nodes += _levelNodes(c);
+	if (!_poolReserve(&tree->pool, nodes)) {
+		free(items);
+		return false;
+	}
+
+	// packed leaves, chained left to right
+	size_t count = _levelNodes(unique);
+	bptNode ** level = malloc(count * sizeof(bptNode *));
+	if (!level) {
+		free(items);
+		return false;
+	}
+	size_t next = 0;
+	for (size_t i = 0; i < count; i++) {
+		size_t take = (unique - next) / (count - i);
+		bptNode * leaf = _nodeNew(&tree->pool, true);
+		if (!leaf) {
+			for (size_t j = 0; j < i; j++)
+				_releaseTree(&tree->pool, level[j]);
+			free(level);
+			free(items);
+			return false;
+		}
+		for (size_t j = 0; j < take; j++) {
+			leaf->keys[j] = items[next + j].key;
+			leaf->values[j] = values[items[next + j].pos];
+		}
+		leaf->childCount = take;
+		STATS_COUNT(mem, 1); // store new leaf
+		next += take;
+		if (i)
+			level[i - 1]->next = leaf;
+		level[i] = leaf;
+	}
+	free(items);
+
+	// then each internal level over the one below it
+	while (count > 1) {
+		level = _buildParents(&tree->pool, level, count, &count);
+		if (!level)
+			return false;
+	}
+
+	_releaseTree(&tree->pool, tree->root);
+	tree->root = level[0];
+	free(level);
+	T->entryCount = unique;
+	return true;
+}
+
 // todo: remove tensor argument since it's only for passing to debug print
-float _search(Tensor * T, bptNode * node, tKey_t key) {
+#ifndef TENSOR_NO_STATS
+// the node each level of the last lookup on this thread reached
+static _Thread_local const bptNode * _lastPath[BPT_MAX_DEPTH];
+#endif
+
+// Counts the lookup reaching node at level as a node change unless the
+// last lookup reached it too, as it would still be in cache. Row-major and
+// Morton keys cost the same fetches, but differ in how often they repeat.
+static void _touch(const bptNode * node, unsigned int level) {
+#ifndef TENSOR_NO_STATS
+	if (level < BPT_MAX_DEPTH && _lastPath[level] != node) {
+		_lastPath[level] = node;
+		STATS_COUNT(nodeChanges, 1);
+	}
+#endif
+}
+
+float _search(Tensor * T, bptNode * node, tKey_t key, unsigned int level) {
 	if (!node)
 		return 0;
+	_touch(node, level);
 	if (node->isLeaf) {
-		// todo: make this a binary search
-		for (size_t i = 0; i < node->childCount; i++) {
-			statsGlobal.cmp++;
-			if (node->keys[i] == key)
-				return node->values[i];
-			if (node->keys[i] > key)
-				break;
-		}
+		size_t i = _lowerBound(node->keys, node->childCount, key);
+		STATS_COUNT(cmp, 1);
+		if (i < node->childCount && node->keys[i] == key)
+			return node->values[i];
 		return 0;
 	} else { // node is internal
-		// todo: make this a binary search
-		for (size_t i = 1; i < node->childCount; i++) {
-			statsGlobal.cmp++;
-			if (key < node->keys[i]) {
-				statsGlobal.mem++; // fetch child
-				return _search(T, node->children[i - 1], key);
-			}
-		}
-		//  if it's not in the other children, it might be in the last one
-		statsGlobal.mem++; // fetch child
-		return _search(T, node->children[node->childCount - 1], key);
+		STATS_COUNT(mem, 1); // fetch child
+		return _search(T, node->children[_route(node, key)], key, level + 1);
 	}
 }
 float bptGet(Tensor * T, tCoord_t * coords) {
 	if (!T || !T->values || !coords)
 		return 0;
 
-	statsGlobal.mem++; // get root
-	bptNode * root = T->values;
+	STATS_COUNT(mem, 1); // get root
+	bptNode * root = ((bptTree *)T->values)->root;
 	tKey_t key = _Coords2Key(T, coords);
-	return _search(T, root, key);
+	return _search(T, root, key, 0);
 };
 
+// Level-synchronous search: every key in a block descends one level
+// before any goes further, and each child is prefetched as soon as it's
+// chosen, so the misses for a whole level are in flight together.
+// All leaves are at the same depth, so the block stays in step.
+void bptGetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values) {
+	if (!T || !T->values || !coords || !values)
+		return;
+	bptNode * root = ((bptTree *)T->values)->root;
+	tKey_t keys[BPT_BATCH];
+	bptNode * nodes[BPT_BATCH];
+	for (size_t start = 0; start < n; start += BPT_BATCH) {
+		size_t count = n - start < BPT_BATCH ? n - start : BPT_BATCH;
+		for (size_t i = 0; i < count; i++) {
+			STATS_COUNT(mem, 1); // get root
+			keys[i] = _Coords2Key(T, &coords[(start + i) * T->order]);
+			nodes[i] = root;
+		}
+		unsigned int level = 0;
+		while (!nodes[0]->isLeaf) {
+			for (size_t i = 0; i < count; i++) {
+				_touch(nodes[i], level);
+				STATS_COUNT(mem, 1); // fetch child
+				nodes[i] = nodes[i]->children[_route(nodes[i], keys[i])];
+				__builtin_prefetch(nodes[i]);
+				__builtin_prefetch(nodes[i]->keys);
+			}
+			level++;
+		}
+		for (size_t i = 0; i < count; i++)
+			values[start + i] = _search(T, nodes[i], keys[i], level);
+	}
+}
+
 void _print(Tensor * T, bptNode * node, uint depth) {
 	for (uint i = 0; i < depth; i++)
 		putchar('\t');
@@ -393,7 +854,7 @@ void _print(Tensor * T, bptNode * node, uint depth) {
 		putchar('\n');
 		return;
 	}
-	printf(", cnt=%lu\n", node->childCount);
+	printf(", cnt=%u\n", node->childCount);
 
 	if (node->isLeaf) {
 		for (size_t i = 0; i < BPT_ORDER; i++) {
@@ -421,8 +882,9 @@ void _print(Tensor * T, bptNode * node, uint depth) {
 }
 
 void bptPrintAll(Tensor * T) {
-	bptNode * root = T->values;
-	printf("raw B+ Tree (%p->%p) contents:\n", T, T->values);
+	bptTree * tree = T->values;
+	bptNode * root = tree ? tree->root : NULL;
+	printf("raw B+ Tree (%p->%p) contents:\n", T, (void *)root);
 	if (!root) {
 		printf("\tThere's no root!\n");
 		return;
@@ -431,41 +893,23 @@ void bptPrintAll(Tensor * T) {
 	putchar('\n');
 }
 
-// todo: consider making the iterator stack a flat array
-// instead of a linked list. Decreases pointer chasing.
-// How to tell appropriate length of list??
-// There's no way to see the maximum tree depth right now.
-typedef struct bptIterRecord {
-	size_t childIdx;
-	struct bptIterRecord * parent; // this linked list is a stack
-	struct bptNode * node;         // don't traverse B+ tree
-} bptIterRecord;
+// Leaves are chained left to right, so a scan only needs its position
 typedef struct bptContext {
-	bptIterRecord * stack;
+	bptNode * leaf;
+	size_t childIdx;
 	tCoord_t * coords;
+	bool bounded; // stop at the first key > end
+	tKey_t end;
 } bptContext;
 
-
-static size_t _bptNodeCount(bptNode * node) {
-	if (node->isLeaf)
-		return 1;
-
-	size_t sum = 1; // count yourself
-
-	// plus all the children
-	for (int i = 0; i < node->childCount; i++)
-		sum += _bptNodeCount(node->children[i]);
-	return sum;
-}
-
+// only the live nodes, the pool's free and unused ones are its slack
 size_t bptSize(Tensor * T) {
-	bptNode * root = T->values;
-	return _bptNodeSize * _bptNodeCount(root);
+	bptTree * tree = T->values;
+	return _bptNodeSize * tree->pool.live;
 }
 
 
 void * bptIteratorInit(Tensor * T) {
-	// bptPrintAll(T);
 	if (!T || !T->values)
 		return NULL;
 	bptContext * ctx = calloc(sizeof(bptContext), 1);
@@ -476,29 +920,50 @@ void * bptIteratorInit(Tensor * T) {
 		free(ctx);
 		return NULL;
 	}
-	ctx->stack = calloc(sizeof(bptIterRecord), 1);
-	if (!ctx->stack) {
-		free(ctx->coords);
+
+	// traverse to the first leaf node
+	bptNode * node = ((bptTree *)T->values)->root;
+	STATS_COUNT(mem, 1); // fetch root
+	while (!node->isLeaf) {
+		STATS_COUNT(mem, 1); // fetch next node
+		node = node->children[0];
+	}
+	ctx->leaf = node;
+	return ctx;
+}
+
+// Mode 0 is packed into the highest bits, so every entry sharing the
+// first p coordinates falls in one key interval: seek to its start and
+// let bptIteratorNext stop at its end.
+void * bptIteratorInitPrefix(Tensor * T, tCoord_t * prefix, tMode_t p) {
+	if (!T || !T->values || (p && !prefix) || p > T->order ||
+	    T->type == mortonBPlusTree)
+		return NULL;
+	bptContext * ctx = calloc(sizeof(bptContext), 1);
+	if (!ctx)
+		return NULL;
+	ctx->coords = calloc(sizeof(tCoord_t), T->order + 1);
+	if (!ctx->coords) {
 		free(ctx);
 		return NULL;
 	}
 
-	ctx->stack->node = T->values;
-	// traverse to the first leaf node
-	bptIterRecord * top = ctx->stack;
-	statsGlobal.mem++; // fetch root
-	while (!top->node->isLeaf) {
-		bptIterRecord * newTop = calloc(sizeof(bptIterRecord), 1);
-		if (!newTop) {
-			bptIteratorCleanup(ctx);
-			return NULL;
-		}
-		statsGlobal.mem++; // fetch next node
-		newTop->node = top->node->children[0];
-		newTop->parent = top;
-		top = newTop;
+	for (tMode_t m = 0; m < p; m++)
+		ctx->coords[m] = prefix[m];
+	tKey_t start = _Coords2Key(T, ctx->coords);
+	if (p) {
+		ctx->bounded = true;
+		ctx->end = start | tensorKeyMask(T, p); // inclusive, it may be the max
+	}
+
+	bptNode * node = ((bptTree *)T->values)->root;
+	STATS_COUNT(mem, 1); // fetch root
+	while (!node->isLeaf) {
+		STATS_COUNT(mem, 1); // fetch next node
+		node = node->children[_route(node, start)];
 	}
-	ctx->stack = top;
+	ctx->leaf = node;
+	ctx->childIdx = _lowerBound(node->keys, node->childCount, start);
 	return ctx;
 }
 
@@ -506,65 +971,33 @@ void bptIteratorCleanup(void * context) {
 	bptContext * ctx = context;
 	if (!ctx)
 		return;
-
-	// free the whole context stack from the tail in
-	bptIterRecord * top = ctx->stack;
-	while (top->parent) {
-		ctx->stack = top->parent;
-		free(top);
-		top = ctx->stack;
-	}
-	free(ctx->stack);
 	free(ctx->coords);
 	free(ctx);
 }
 
 tensorEntry bptIteratorNext(Tensor * T, void * context) {
 	bptContext * ctx = context;
-	bptIterRecord * top = ctx->stack;
-	// have we run out of values in this node yet?
-	statsGlobal.cmp++;
-	if (top->childIdx < top->node->childCount) {
-		// more values here, so just increment and return
-
-		// once we hit a leaf, return it
-		_Key2Coords(T, ctx->coords, top->node->keys[top->childIdx]);
-		float val = top->node->values[top->childIdx];
-		statsGlobal.add++;
-		top->childIdx++;
-		return (tensorEntry){.coords = ctx->coords, .value = val};
-	}
-
-	// pop and free as needed until we can increment childIdx
-	statsGlobal.cmp++;
-	while (top->childIdx == top->node->childCount - (!top->node->isLeaf)) {
-		// are we done iterating?
-		if (!top->parent)
-			return (tensorEntry){0};
-
-		top = top->parent;
-		free(ctx->stack);
-		ctx->stack = top;
-		statsGlobal.cmp++; // while condition
-	}
-
-	// increment childIdx
-	statsGlobal.add++;
-	top->childIdx++;
+	if (!ctx)
+		return (tensorEntry){0};
 
-	// traverse to the next leaf
-	while (!top->node->isLeaf) {
-		bptIterRecord * newTop = calloc(sizeof(bptIterRecord), 1);
-		statsGlobal.mem++; // fetch child
-		newTop->node = top->node->children[top->childIdx];
-		newTop->parent = top;
-		top = newTop;
+	// move along the chain past this leaf (and any empty ones)
+	STATS_COUNT(cmp, 1);
+	while (ctx->childIdx == ctx->leaf->childCount) {
+		if (!ctx->leaf->next)
+			return (tensorEntry){0};
+		STATS_COUNT(mem, 1); // fetch sibling
+		ctx->leaf = ctx->leaf->next;
+		ctx->childIdx = 0;
+		STATS_COUNT(cmp, 1); // while condition
 	}
-	ctx->stack = top;
 
-	// first entry of new leaf, and point to next entry
-	_Key2Coords(T, ctx->coords, top->node->keys[top->childIdx]);
-	float val = top->node->values[top->childIdx];
-	top->childIdx++;
+	tKey_t key = ctx->leaf->keys[ctx->childIdx];
+	STATS_COUNT(cmp, 1);
+	if (ctx->bounded && key > ctx->end)
+		return (tensorEntry){0};
+	_Key2Coords(T, ctx->coords, key);
+	float val = ctx->leaf->values[ctx->childIdx];
+	STATS_COUNT(add, 1);
+	ctx->childIdx++;
 	return (tensorEntry){.coords = ctx->coords, .value = val};
 }
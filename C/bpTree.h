@@ -7,20 +7,58 @@
 #define BPT_ORDER 8
 #endif
 
-#define BPT_KEYGEN_FIELD_SIZE 16 // up to order-4 without conflict
-//#define BPT_KEYGEN_FIELD_SIZE 8 // up to order-8, but modes have max len 256
+#ifndef BPT_FILL_FACTOR
+// share of each node bptBuild fills, lower leaves room for later inserts
+// (at least half, so deletion can rely on it)
+#define BPT_FILL_FACTOR 1.0
+#endif
+
+#define BPT_NODE_ALIGN 64 // nodes start on a cache line
+
+#define BPT_BATCH 16 // lookups descending together in bptGetBatch
+
+#define BPT_MAX_DEPTH 32 // levels whose last node lookups keep track of
+
+// nodes come from chunks owned by the tree, each twice the last
+#define BPT_POOL_MIN_CHUNK 16
+#define BPT_POOL_MAX_CHUNK 65536
 
 void * bptNew();
 void bptFree(Tensor * T);
 
+// node counts for the tree's pool, capacity - live - free is never used yet
+typedef struct bptPoolStats {
+	size_t chunks;
+	size_t capacity; // nodes in all chunks
+	size_t live;     // nodes in the tree
+	size_t free;     // released nodes waiting for reuse
+	size_t slack;    // bytes held beyond the live nodes, left out of bptSize
+} bptPoolStats;
+bptPoolStats bptGetPoolStats(Tensor * T);
+
+// bptBuild fills an empty tree bottom-up from n COO entries in any order.
+// Later duplicates of the same coordinates overwrite earlier ones, and
+// coordinates whose last value is zero are left out.
+bool bptBuild(Tensor * T, size_t n, tCoord_t * coords, float * values);
+
 bool bptSet(Tensor * T, tCoord_t * key, float value);
 float bptGet(Tensor * T, tCoord_t * key);
+// Removes the entry, merging nodes that drop below half full. Once more
+// nodes are free than live, the tree moves into a packed pool and the
+// old chunks go back to the allocator.
+bool bptDelete(Tensor * T, tCoord_t * key);
+// n lookups at once, n * order coords like tensorBuild
+void bptGetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values);
 
 void bptPrintAll(Tensor * T); // only for debug
 
+// bytes of the nodes in the tree, see bptGetPoolStats for the rest
 size_t bptSize(Tensor * T);
 
 void * bptIteratorInit(Tensor * T);
+// iterates only the entries whose first p coordinates equal prefix,
+// which only row-major keys keep together
+void * bptIteratorInitPrefix(Tensor * T, tCoord_t * prefix, tMode_t p);
 void bptIteratorCleanup(void * context);
 tensorEntry bptIteratorNext(Tensor * T, void * context);
 
@@ -0,0 +1,377 @@
+#include "chashtable.h"
+#include "stats.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef tKey_t chtKey_t;
+const size_t _chteSize = sizeof(float) + sizeof(chtKey_t);
+
+// Empty slots hold this key. Only a shape that fills every key bit can
+// produce it, and that one entry is kept beside the table.
+#define CHT_EMPTY_KEY (~(chtKey_t)0)
+
+// Keys are only ever written once per rehash, from empty to their final
+// value, so a probe that has seen a key can trust it from then on.
+typedef struct chtShard {
+	unsigned long calls; // in flight on the threads counted here
+	char pad[CHT_LINE - sizeof(unsigned long)];
+} chtShard;
+
+typedef struct Chashtable {
+	pthread_mutex_t lock; // held while growing
+	bool growing;         // set while growing, so new calls wait for lock
+	chtShard shards[CHT_SHARDS];
+	size_t capacity;
+	size_t claimed; // slots with a key, whether or not their value is zero
+	chtKey_t * keys;
+	float * values;
+	float emptyKeyValue;
+} Chashtable;
+
+// Murmur3 finalizer, same as the probing hashtable
+static size_t _hash(chtKey_t key) {
+	STATS_COUNT(mul, 2); // counting hash as MUL
+	unsigned long long h = key;
+#ifdef TENSOR_WIDE_KEYS
+	h ^= key >> 64;
+#endif
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static bool _slotsNew(Chashtable * ht, size_t capacity) {
+	ht->keys = malloc(capacity * sizeof(chtKey_t));
+	ht->values = calloc(capacity, sizeof(float));
+	if (!ht->keys || !ht->values) {
+		free(ht->keys);
+		free(ht->values);
+		return false;
+	}
+	for (size_t i = 0; i < capacity; i++)
+		ht->keys[i] = CHT_EMPTY_KEY;
+	ht->capacity = capacity;
+	return true;
+}
+
+// Each thread counts its calls on one shard, picked on its first call
+static _Thread_local unsigned int _shard = 0; // 1 + index, 0 if not yet
+static unsigned int _shardsTaken = 0;
+
+// Counts a call in flight, first waiting out a rehash that has started.
+// Returns the counter for _leave.
+static unsigned long * _enter(Chashtable * ht) {
+	if (!_shard)
+		_shard = 1 + __atomic_fetch_add(&_shardsTaken, 1, __ATOMIC_RELAXED) %
+		                 CHT_SHARDS;
+	unsigned long * calls = &ht->shards[_shard - 1].calls;
+	while (true) {
+		// either this sees growing set, or _grow sees this count
+		__atomic_add_fetch(calls, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&ht->growing, __ATOMIC_SEQ_CST))
+			return calls;
+		__atomic_sub_fetch(calls, 1, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&ht->lock); // held until the rehash is done
+		pthread_mutex_unlock(&ht->lock);
+	}
+}
+
+static void _leave(unsigned long * calls) {
+	__atomic_sub_fetch(calls, 1, __ATOMIC_RELEASE);
+}
+
+void * chtNew() {
+	Chashtable * ht = calloc(1, sizeof(Chashtable));
+	if (!ht)
+		return 0;
+	if (pthread_mutex_init(&ht->lock, 0)) {
+		free(ht);
+		return 0;
+	}
+	if (!_slotsNew(ht, CHT_INITIAL_CAPACITY)) {
+		pthread_mutex_destroy(&ht->lock);
+		free(ht);
+		return 0;
+	}
+	return ht;
+}
+
+void chtFree(Tensor * T) {
+	if (!T || !T->values)
+		return;
+	Chashtable * ht = T->values;
+	pthread_mutex_destroy(&ht->lock);
+	free(ht->keys);
+	free(ht->values);
+	T->values = 0;
+	free(ht);
+}
+
+// Returns the value of key's slot, or NULL if it has none. With claim set
+// an empty slot is taken for it instead, unless that would put the table
+// over its load, in which case NULL means it has to grow first.
+static float * _slot(Chashtable * ht, chtKey_t key, bool claim) {
+	if (key == CHT_EMPTY_KEY)
+		return &ht->emptyKeyValue;
+	size_t mask = ht->capacity - 1;
+	size_t i = _hash(key) & mask;
+	while (true) {
+		STATS_COUNT(mem, 1);
+		STATS_COUNT(cmp, 1);
+		chtKey_t k = __atomic_load_n(&ht->keys[i], __ATOMIC_ACQUIRE);
+		if (k == key)
+			return &ht->values[i];
+		STATS_COUNT(cmp, 1);
+		if (k == CHT_EMPTY_KEY) {
+			if (!claim)
+				return 0;
+			size_t claimed = __atomic_add_fetch(&ht->claimed, 1, __ATOMIC_RELAXED);
+			if (claimed * CHT_OVERPROVISION > ht->capacity) {
+				__atomic_sub_fetch(&ht->claimed, 1, __ATOMIC_RELAXED);
+				return 0;
+			}
+			STATS_COUNT(mem, 1); // claim the slot
+			if (__atomic_compare_exchange_n(&ht->keys[i], &k, key, false,
+			                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				return &ht->values[i];
+			// another thread got there first, and k is now its key
+			__atomic_sub_fetch(&ht->claimed, 1, __ATOMIC_RELAXED);
+			if (k == key)
+				return &ht->values[i];
+		}
+		STATS_COUNT(add, 1);
+		i = (i + 1) & mask;
+	}
+}
+
+// Moves every nonzero entry into a new table of the given capacity.
+// Only called while growing, with no other calls in flight.
+static bool _rehash(Chashtable * ht, size_t capacity) {
+	chtKey_t * keys = ht->keys;
+	float * values = ht->values;
+	size_t oldCapacity = ht->capacity;
+	if (!_slotsNew(ht, capacity)) {
+		ht->keys = keys;
+		ht->values = values;
+		return false;
+	}
+	ht->claimed = 0;
+	for (size_t i = 0; i < oldCapacity; i++) {
+		STATS_COUNT(mem, 1);
+		STATS_COUNT(cmp, 1);
+		if (keys[i] == CHT_EMPTY_KEY || !values[i])
+			continue;
+		size_t j = _hash(keys[i]) & (capacity - 1);
+		while (ht->keys[j] != CHT_EMPTY_KEY) {
+			STATS_COUNT(mem, 1);
+			STATS_COUNT(add, 1);
+			j = (j + 1) & (capacity - 1);
+		}
+		STATS_COUNT(mem, 1);
+		ht->keys[j] = keys[i];
+		ht->values[j] = values[i];
+		ht->claimed++;
+	}
+	free(keys);
+	free(values);
+	return true;
+}
+
+// Makes room for count more claimed slots. Zeroed entries are dropped on
+// the way, so the table may even end up smaller.
+static bool _grow(Chashtable * ht, size_t count) {
+	pthread_mutex_lock(&ht->lock);
+	__atomic_store_n(&ht->growing, true, __ATOMIC_SEQ_CST);
+	for (size_t s = 0; s < CHT_SHARDS; s++)
+		while (__atomic_load_n(&ht->shards[s].calls, __ATOMIC_ACQUIRE))
+			sched_yield();
+	bool success = true;
+	// some other thread may already have grown it
+	if ((ht->claimed + count) * CHT_OVERPROVISION > ht->capacity) {
+		size_t live = 0;
+		for (size_t i = 0; i < ht->capacity; i++)
+			if (ht->keys[i] != CHT_EMPTY_KEY && ht->values[i])
+				live++;
+		size_t capacity = CHT_INITIAL_CAPACITY;
+		while (capacity < (live + count) * CHT_OVERPROVISION * 2)
+			capacity *= 2;
+		success = _rehash(ht, capacity);
+	}
+	__atomic_store_n(&ht->growing, false, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&ht->lock);
+	return success;
+}
+
+bool chtReserve(Tensor * T, size_t count) {
+	if (!T || !T->values)
+		return false;
+	Chashtable * ht = T->values;
+	unsigned long * calls = _enter(ht);
+	bool roomy = count * CHT_OVERPROVISION <= ht->capacity;
+	_leave(calls);
+	return roomy || _grow(ht, count);
+}
+
+// keeps the tensor's entry count in step with zero and nonzero values
+static void _count(Tensor * T, float old, float value) {
+	if (!old && value)
+		__atomic_add_fetch(&T->entryCount, 1, __ATOMIC_RELAXED);
+	else if (old && !value)
+		__atomic_sub_fetch(&T->entryCount, 1, __ATOMIC_RELAXED);
+}
+
+static bool _update(Tensor * T, tCoord_t * coords, float value, bool add) {
+	Chashtable * ht = T->values;
+	chtKey_t key = tensorCoords2Key(T, coords);
+	while (true) {
+		unsigned long * calls = _enter(ht);
+		float * slot = _slot(ht, key, true);
+		if (slot) {
+			float old;
+			float new = value;
+			if (add) {
+				__atomic_load(slot, &old, __ATOMIC_RELAXED);
+				do {
+					STATS_COUNT(add, 1);
+					new = old + value;
+				} while (!__atomic_compare_exchange(slot, &old, &new, true,
+				                                    __ATOMIC_RELAXED,
+				                                    __ATOMIC_RELAXED));
+			} else {
+				__atomic_exchange(slot, &new, &old, __ATOMIC_RELAXED);
+			}
+			STATS_COUNT(mem, 1); // store value
+			_count(T, old, new);
+			_leave(calls);
+			return true;
+		}
+		_leave(calls);
+		if (!_grow(ht, 1))
+			return false;
+	}
+}
+
+bool chtSet(Tensor * T, tCoord_t * coords, float value) {
+	if (!T || !T->values || !coords)
+		return false;
+	if (!value)
+		return chtDelete(T, coords);
+	return _update(T, coords, value, false);
+}
+
+bool chtAdd(Tensor * T, tCoord_t * coords, float value) {
+	if (!T || !T->values || !coords)
+		return false;
+	if (!value)
+		return true;
+	return _update(T, coords, value, true);
+}
+
+float chtGet(Tensor * T, tCoord_t * coords) {
+	if (!T || !T->values || !coords)
+		return 0;
+	Chashtable * ht = T->values;
+	float value = 0;
+	unsigned long * calls = _enter(ht);
+	float * slot = _slot(ht, tensorCoords2Key(T, coords), false);
+	if (slot)
+		__atomic_load(slot, &value, __ATOMIC_RELAXED);
+	_leave(calls);
+	return value;
+}
+
+// The key keeps its slot, since moving keys would race with probes
+bool chtDelete(Tensor * T, tCoord_t * coords) {
+	if (!T || !T->values || !coords)
+		return false;
+	Chashtable * ht = T->values;
+	unsigned long * calls = _enter(ht);
+	float * slot = _slot(ht, tensorCoords2Key(T, coords), false);
+	if (slot) {
+		float old;
+		float zero = 0;
+		__atomic_exchange(slot, &zero, &old, __ATOMIC_RELAXED);
+		STATS_COUNT(mem, 1); // store value
+		_count(T, old, 0);
+	}
+	_leave(calls);
+	return true;
+}
+
+void chtPrintAll(Tensor * T) {
+	Chashtable * ht = T->values;
+	printf("Concurrent hashtable:\n");
+	if (!ht || !ht->keys) {
+		printf("  <invalid>\n");
+		return;
+	}
+	for (size_t i = 0; i < ht->capacity; i++) {
+		printf("  [%lu] ", i);
+		if (ht->keys[i] == CHT_EMPTY_KEY)
+			printf("<invalid>\n");
+		else
+			printf("%llu: %f\n", (unsigned long long)ht->keys[i],
+			       ht->values[i]);
+	}
+	if (ht->emptyKeyValue)
+		printf("  [side] %llu: %f\n", (unsigned long long)CHT_EMPTY_KEY,
+		       ht->emptyKeyValue);
+}
+
+size_t chtSize(Tensor * T) {
+	Chashtable * ht = T->values;
+	return _chteSize * ht->capacity;
+}
+
+typedef struct chtContext {
+	size_t i;
+	tCoord_t * coords;
+} chtContext;
+
+void * chtIteratorInit(Tensor * T) {
+	chtContext * ctx = calloc(sizeof(chtContext), 1);
+	if (!ctx)
+		return 0;
+	ctx->coords = calloc(sizeof(tCoord_t), T->order + 1);
+	if (!ctx->coords) {
+		free(ctx);
+		return 0;
+	}
+	return ctx;
+}
+
+void chtIteratorCleanup(void * context) {
+	chtContext * ctx = context;
+	if (ctx)
+		free(ctx->coords);
+	free(ctx);
+}
+
+// slots in order, then the side entry, skipping anything zeroed
+tensorEntry chtIteratorNext(Tensor * T, void * context) {
+	if (!T || !T->values || !context)
+		return (tensorEntry){0};
+	Chashtable * ht = T->values;
+	chtContext * ctx = context;
+
+	for (; ctx->i < ht->capacity; ctx->i++) {
+		STATS_COUNT(mem, 1);
+		STATS_COUNT(cmp, 1);
+		if (ht->keys[ctx->i] == CHT_EMPTY_KEY || !ht->values[ctx->i])
+			continue;
+		STATS_COUNT(add, 1);
+		tensorKey2Coords(T, ctx->coords, ht->keys[ctx->i]);
+		float value = ht->values[ctx->i++];
+		return (tensorEntry){.coords = ctx->coords, .value = value};
+	}
+	if (ctx->i++ == ht->capacity && ht->emptyKeyValue) {
+		tensorKey2Coords(T, ctx->coords, CHT_EMPTY_KEY);
+		return (tensorEntry){.coords = ctx->coords, .value = ht->emptyKeyValue};
+	}
+	return (tensorEntry){0};
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "tensor.h"
+#include <stddef.h>
+
+// Linear probing hashtable that many threads can write at once. Slots are
+// claimed with a compare-and-swap on the key and values change with
+// atomic swaps, so inserts and accumulation never block each other. Only
+// growing the table takes a lock. Other calls just count themselves in
+// flight on a cache line of their thread's own, which growing waits to
+// drain, and only wait for the lock if a rehash has started.
+// A slot whose value is zero is an absent entry, so deleting just zeroes
+// it and the key stays claimed until the next rehash.
+// Iterating, printing and sizing expect no writers at the same time.
+
+#ifndef CHT_OVERPROVISION
+#define CHT_OVERPROVISION 2.0 // = minimum capacity / claimed slots
+#endif
+
+#define CHT_INITIAL_CAPACITY 16 // must be a power of two
+
+#ifndef CHT_SHARDS
+#define CHT_SHARDS 64 // counters for calls in flight, threads beyond share
+#endif
+#define CHT_LINE 64   // bytes between counters, so none share a cache line
+
+void * chtNew();
+void chtFree(Tensor * T);
+// grow ahead of time to hold count entries without rehashing
+bool chtReserve(Tensor * T, size_t count);
+
+bool chtSet(Tensor * T, tCoord_t * coords, float value);
+// atomically adds value to the entry, creating it if it's missing
+bool chtAdd(Tensor * T, tCoord_t * coords, float value);
+float chtGet(Tensor * T, tCoord_t * coords);
+bool chtDelete(Tensor * T, tCoord_t * coords);
+
+void chtPrintAll(Tensor * T); // only for debug
+
+size_t chtSize(Tensor * T);
+
+void * chtIteratorInit(Tensor * T);
+void chtIteratorCleanup(void * context);
+tensorEntry chtIteratorNext(Tensor * T, void * context);
+
+const static tensorIterator chtIterator = {.init = chtIteratorInit,
+                                           .next = chtIteratorNext,
+                                           .cleanup = chtIteratorCleanup};
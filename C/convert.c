@@ -0,0 +1,37 @@
+#include "tensor.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Converts between the text .coo format and the binary format. Files whose
+// name ends in .coo are text, anything else is binary, and binary output
+// is always sorted so it can be mapped.
+
+static bool isText(const char * filename) {
+	size_t length = strlen(filename);
+	return length >= 4 && !strcmp(filename + length - 4, ".coo");
+}
+
+int main(int argc, char ** argv) {
+	if (argc != 3) {
+		printf("USAGE:\n    %s INPUT OUTPUT\n\n", argv[0]);
+		printf("Files ending in .coo are text, others are binary.\n");
+		return 1;
+	}
+	const char * input = argv[1];
+	const char * output = argv[2];
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	Tensor * T = isText(input)
+	                 ? tensorReadParallel(sortedCOO, input, cpus > 0 ? cpus : 1)
+	                 : tensorReadBinary(sortedCOO, input);
+	if (!T)
+		return 1;
+
+	bool success = isText(output) ? tensorWrite(T, output, true)
+	                              : tensorWriteBinary(T, output, true);
+	if (success)
+		printf("%lu entries written to \"%s\"\n", T->entryCount, output);
+	tensorFree(T);
+	return !success;
+}
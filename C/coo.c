@@ -0,0 +1,325 @@
+#include "coo.h"
+#include "stats.h"
+#include "tensor.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+typedef tKey_t cooKey_t;
+
+typedef struct COO {
+	size_t count;
+	size_t capacity;
+	cooKey_t * keys; // sorted ascending
+	float * values;  // parallel to keys
+	void * map;      // if set, keys and values point into it, read-only
+	size_t mapSize;
+} COO;
+
+void * cooNew() {
+	COO * coo = calloc(1, sizeof(COO));
+	STATS_COUNT(mem, 1);
+	return coo;
+}
+
+void cooFree(Tensor * T) {
+	if (!T || !T->values)
+		return;
+	COO * coo = T->values;
+	if (coo->map) {
+		munmap(coo->map, coo->mapSize);
+	} else {
+		free(coo->keys);
+		free(coo->values);
+	}
+	T->values = 0;
+	free(coo);
+}
+
+static bool _reserve(COO * coo, size_t needed) {
+	if (needed <= coo->capacity)
+		return true;
+	size_t capacity = coo->capacity ? coo->capacity : 16;
+	while (capacity < needed)
+		capacity *= 2;
+	cooKey_t * keys = realloc(coo->keys, capacity * sizeof(cooKey_t));
+	if (!keys)
+		return false;
+	coo->keys = keys;
+	float * values = realloc(coo->values, capacity * sizeof(float));
+	if (!values)
+		return false;
+	coo->values = values;
+	coo->capacity = capacity;
+	return true;
+}
+
+// index of the first key that's >= key
+static size_t _lowerBound(COO * coo, cooKey_t key) {
+	size_t lo = 0;
+	size_t hi = coo->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		STATS_COUNT(mem, 1);
+		STATS_COUNT(cmp, 1);
+		if (coo->keys[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+float cooGet(Tensor * T, tCoord_t * coords) {
+	if (!T || !T->values || !coords)
+		return 0;
+	COO * coo = T->values;
+	cooKey_t key = tensorCoords2Key(T, coords);
+	size_t i = _lowerBound(coo, key);
+	STATS_COUNT(cmp, 1);
+	if (i == coo->count || coo->keys[i] != key)
+		return 0;
+	STATS_COUNT(mem, 1);
+	return coo->values[i];
+}
+
+static bool _writable(COO * coo) {
+	if (coo->map)
+		printf("sorted COO mapped from a file is read-only\n");
+	return !coo->map;
+}
+
+bool cooSet(Tensor * T, tCoord_t * coords, float value) {
+	if (!T || !T->values || !coords)
+		return false;
+	COO * coo = T->values;
+	if (!_writable(coo))
+		return false;
+	cooKey_t key = tensorCoords2Key(T, coords);
+	size_t i = _lowerBound(coo, key);
+	STATS_COUNT(cmp, 1);
+	if (i < coo->count && coo->keys[i] == key) {
+		STATS_COUNT(mem, 1);
+		coo->values[i] = value;
+		return true;
+	}
+
+	if (!_reserve(coo, coo->count + 1))
+		return false;
+	size_t after = coo->count - i;
+	memmove(&coo->keys[i + 1], &coo->keys[i], after * sizeof(cooKey_t));
+	memmove(&coo->values[i + 1], &coo->values[i], after * sizeof(float));
+	STATS_COUNT(mem, after + 1);
+	coo->keys[i] = key;
+	coo->values[i] = value;
+	coo->count++;
+	T->entryCount++;
+	return true;
+}
+
+bool cooDelete(Tensor * T, tCoord_t * coords) {
+	if (!T || !T->values || !coords)
+		return false;
+	COO * coo = T->values;
+	if (!_writable(coo))
+		return false;
+	cooKey_t key = tensorCoords2Key(T, coords);
+	size_t i = _lowerBound(coo, key);
+	STATS_COUNT(cmp, 1);
+	if (i == coo->count || coo->keys[i] != key)
+		return true; // already absent
+
+	size_t after = coo->count - i - 1;
+	memmove(&coo->keys[i], &coo->keys[i + 1], after * sizeof(cooKey_t));
+	memmove(&coo->values[i], &coo->values[i + 1], after * sizeof(float));
+	STATS_COUNT(mem, after + 1);
+	coo->count--;
+	T->entryCount--;
+
+	// hand memory back once it's mostly unused
+	if (coo->capacity > 16 && coo->count * COO_SHRINK_RATIO < coo->capacity) {
+		size_t capacity = coo->capacity / 2;
+		cooKey_t * keys = realloc(coo->keys, capacity * sizeof(cooKey_t));
+		if (keys)
+			coo->keys = keys;
+		float * values = realloc(coo->values, capacity * sizeof(float));
+		if (values)
+			coo->values = values;
+		if (keys && values)
+			coo->capacity = capacity;
+	}
+	return true;
+}
+
+typedef struct cooSortItem {
+	cooKey_t key;
+	size_t pos;
+} cooSortItem;
+
+static int _cooSortCompare(const void * x, const void * y) {
+	const cooSortItem * a = x;
+	const cooSortItem * b = y;
+	STATS_COUNT(cmp, 1);
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+	return a->pos < b->pos ? -1 : a->pos > b->pos;
+}
+
+bool cooBuild(Tensor * T, size_t n, tCoord_t * coords, float * values) {
+	if (!T || !T->values || (n && (!coords || !values)))
+		return false;
+	COO * coo = T->values;
+	if (T->entryCount || !_writable(coo))
+		return false;
+
+	cooSortItem * items = malloc((n + 1) * sizeof(cooSortItem));
+	if (!items)
+		return false;
+	for (size_t i = 0; i < n; i++) {
+		items[i].key = tensorCoords2Key(T, &coords[i * T->order]);
+		items[i].pos = i;
+	}
+	qsort(items, n, sizeof(cooSortItem), _cooSortCompare);
+
+	// keep only the last of each run of equal keys, unless it's zero
+	size_t unique = 0;
+	for (size_t i = 0; i < n; i++) {
+		STATS_COUNT(cmp, 1);
+		if (i + 1 < n && items[i].key == items[i + 1].key)
+			continue;
+		if (values[items[i].pos])
+			items[unique++] = items[i];
+	}
+
+	if (!_reserve(coo, unique)) {
+		free(items);
+		return false;
+	}
+	for (size_t i = 0; i < unique; i++) {
+		coo->keys[i] = items[i].key;
+		coo->values[i] = values[items[i].pos];
+	}
+	STATS_COUNT(mem, unique);
+	free(items);
+
+	// exact fit, nothing else is expected to be inserted
+	if (unique && unique < coo->capacity) {
+		cooKey_t * keys = realloc(coo->keys, unique * sizeof(cooKey_t));
+		if (keys)
+			coo->keys = keys;
+		float * vals = realloc(coo->values, unique * sizeof(float));
+		if (vals)
+			coo->values = vals;
+		if (keys && vals)
+			coo->capacity = unique;
+	}
+	coo->count = unique;
+	T->entryCount = unique;
+	return true;
+}
+
+bool cooAttach(Tensor * T, size_t n, tKey_t * keys, float * values,
+               void * map, size_t mapSize) {
+	if (!T || !T->values || (n && (!keys || !values)))
+		return false;
+	COO * coo = T->values;
+	if (T->entryCount || !_writable(coo))
+		return false;
+	free(coo->keys);
+	free(coo->values);
+	coo->keys = keys;
+	coo->values = values;
+	coo->count = n;
+	coo->capacity = n;
+	coo->map = map;
+	coo->mapSize = mapSize;
+	T->entryCount = n;
+	return true;
+}
+
+bool cooIsMapped(Tensor * T) {
+	COO * coo = T->values;
+	return coo && coo->map;
+}
+
+void cooPrintAll(Tensor * T) {
+	COO * coo = T->values;
+	printf("raw sorted COO (%p->%p) contents:\n", T, T->values);
+	if (!coo) {
+		printf("\t<invalid>\n");
+		return;
+	}
+	for (size_t i = 0; i < coo->count; i++)
+		printf("  [%lu] %llu: %f\n", i, (unsigned long long)coo->keys[i],
+		       coo->values[i]);
+}
+
+size_t cooSize(Tensor * T) {
+	COO * coo = T->values;
+	return (sizeof(cooKey_t) + sizeof(float)) * coo->capacity;
+}
+
+typedef struct cooContext {
+	size_t i;
+	size_t end; // stop before this index
+	tCoord_t * coords;
+} cooContext;
+
+void * cooIteratorInit(Tensor * T) {
+	cooContext * ctx = calloc(sizeof(cooContext), 1);
+	if (!ctx)
+		return 0;
+	ctx->coords = calloc(sizeof(tCoord_t), T->order + 1);
+	if (!ctx->coords) {
+		free(ctx);
+		return 0;
+	}
+	ctx->end = SIZE_MAX;
+	return ctx;
+}
+
+// Keys sort by mode 0 first, so entries sharing the first p coordinates
+// are one contiguous run found with two binary searches.
+void * cooIteratorInitPrefix(Tensor * T, tCoord_t * prefix, tMode_t p) {
+	if (!T || !T->values || (p && !prefix) || p > T->order)
+		return 0;
+	COO * coo = T->values;
+	cooContext * ctx = cooIteratorInit(T);
+	if (!ctx)
+		return 0;
+	for (tMode_t m = 0; m < p; m++)
+		ctx->coords[m] = prefix[m];
+	cooKey_t start = tensorCoords2Key(T, ctx->coords);
+	ctx->i = _lowerBound(coo, start);
+	// the run ends after its last possible key, which may be the largest
+	cooKey_t last = start | tensorKeyMask(T, p);
+	if (p && last != ~(cooKey_t)0)
+		ctx->end = _lowerBound(coo, last + 1);
+	return ctx;
+}
+
+void cooIteratorCleanup(void * context) {
+	cooContext * ctx = context;
+	if (ctx)
+		free(ctx->coords);
+	free(ctx);
+}
+
+tensorEntry cooIteratorNext(Tensor * T, void * context) {
+	if (!T || !T->values || !context)
+		return (tensorEntry){0};
+	COO * coo = T->values;
+	cooContext * ctx = context;
+
+	STATS_COUNT(cmp, 1);
+	if (ctx->i >= coo->count || ctx->i >= ctx->end)
+		return (tensorEntry){0};
+	STATS_COUNT(mem, 1);
+	STATS_COUNT(add, 1);
+	tensorKey2Coords(T, ctx->coords, coo->keys[ctx->i]);
+	float value = coo->values[ctx->i];
+	ctx->i++;
+	return (tensorEntry){.coords = ctx->coords, .value = value};
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "tensor.h"
+#include <stddef.h>
+
+// Sorted coordinate list: packed keys and their values in two contiguous
+// arrays, ordered by key. Meant for tensors that are loaded once with
+// cooBuild and then mostly read.
+
+#define COO_SHRINK_RATIO 4 // halve capacity once it's this much too big
+
+void * cooNew();
+void cooFree(Tensor * T);
+
+// cooBuild fills an empty tensor from n COO entries in any order.
+// Later duplicates of the same coordinates overwrite earlier ones, and
+// coordinates whose last value is zero are left out.
+bool cooBuild(Tensor * T, size_t n, tCoord_t * coords, float * values);
+
+// cooAttach makes an empty tensor use n keys sorted strictly ascending
+// and their nonzero values in place, without copying. They have to lie in
+// map, which is unmapped when the tensor is freed, and the tensor is
+// read-only from then on.
+bool cooAttach(Tensor * T, size_t n, tKey_t * keys, float * values,
+               void * map, size_t mapSize);
+bool cooIsMapped(Tensor * T);
+
+// inserting a new entry shifts everything after it, so it's O(nnz)
+bool cooSet(Tensor * T, tCoord_t * coords, float value);
+float cooGet(Tensor * T, tCoord_t * coords);
+// removing an entry shifts everything after it back, also O(nnz)
+bool cooDelete(Tensor * T, tCoord_t * coords);
+
+void cooPrintAll(Tensor * T); // only for debug
+
+size_t cooSize(Tensor * T);
+
+void * cooIteratorInit(Tensor * T);
+// iterates only the entries whose first p coordinates equal prefix
+void * cooIteratorInitPrefix(Tensor * T, tCoord_t * prefix, tMode_t p);
+void cooIteratorCleanup(void * context);
+tensorEntry cooIteratorNext(Tensor * T, void * context);
+
+const static tensorIterator cooIterator = {.init = cooIteratorInit,
+                                           .next = cooIteratorNext,
+                                           .cleanup = cooIteratorCleanup};
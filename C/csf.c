@@ -0,0 +1,561 @@
+#include "csf.h"
+#include "stats.h"
+#include "tensor.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+
+// index of a node within its level, so each level holds at most 4G nodes
+typedef unsigned int csfIdx_t;
+
+typedef struct csfLevel {
+	size_t count;    // nodes in this level
+	size_t capacity; // allocated nodes (ptr has one more)
+	tCoord_t * ids;  // coordinate of each node along this level's mode
+	csfIdx_t * ptr;  // children of node i are [ptr[i], ptr[i+1]) one level
+	                 // down. NULL for the leaf level
+} csfLevel;
+
+typedef struct CSF {
+	tMode_t order;
+	csfLevel * levels;
+	float * values; // parallel to the ids of the leaf level
+	size_t valueCount;
+	size_t valueCapacity;
+} CSF;
+
+void * csfNew(tMode_t order) {
+	CSF * csf = calloc(1, sizeof(CSF));
+	if (!csf)
+		return 0;
+	csf->order = order;
+	csf->levels = calloc(order + 1, sizeof(csfLevel));
+	if (!csf->levels) {
+		free(csf);
+		return 0;
+	}
+	// keep the end pointer valid so empty levels can be searched
+	for (tMode_t l = 0; l + 1 < order; l++) {
+		csf->levels[l].ptr = calloc(1, sizeof(csfIdx_t));
+		if (!csf->levels[l].ptr) {
+			for (tMode_t i = 0; i < l; i++)
+				free(csf->levels[i].ptr);
+			free(csf->levels);
+			free(csf);
+			return 0;
+		}
+	}
+	STATS_COUNT(mem, 1);
+	return csf;
+}
+
+void csfFree(Tensor * T) {
+	if (!T || !T->values)
+		return;
+	CSF * csf = T->values;
+	for (tMode_t l = 0; l < csf->order; l++) {
+		free(csf->levels[l].ids);
+		free(csf->levels[l].ptr);
+	}
+	free(csf->levels);
+	free(csf->values);
+	T->values = 0;
+	free(csf);
+}
+
+// make room for at least `needed` nodes in level l
+static bool _reserveLevel(CSF * csf, tMode_t l, size_t needed) {
+	csfLevel * level = &csf->levels[l];
+	if (needed <= level->capacity)
+		return true;
+	if (needed >= UINT_MAX)
+		return false;
+	size_t capacity = level->capacity ? level->capacity : 4;
+	while (capacity < needed)
+		capacity *= 2;
+
+	tCoord_t * ids = realloc(level->ids, capacity * sizeof(tCoord_t));
+	if (!ids)
+		return false;
+	level->ids = ids;
+	if (l + 1 < csf->order) {
+		csfIdx_t * ptr =
+		    realloc(level->ptr, (capacity + 1) * sizeof(csfIdx_t));
+		if (!ptr)
+			return false;
+		level->ptr = ptr;
+	}
+	level->capacity = capacity;
+	return true;
+}
+
+// give back what the worst-case reservation in csfBuild didn't use
+static void _shrinkLevel(CSF * csf, tMode_t l) {
+	csfLevel * level = &csf->levels[l];
+	size_t capacity = level->count ? level->count : 1;
+	tCoord_t * ids = realloc(level->ids, capacity * sizeof(tCoord_t));
+	if (ids)
+		level->ids = ids;
+	if (l + 1 < csf->order) {
+		csfIdx_t * ptr =
+		    realloc(level->ptr, (capacity + 1) * sizeof(csfIdx_t));
+		if (!ptr)
+			return;
+		level->ptr = ptr;
+	}
+	if (ids)
+		level->capacity = capacity;
+}
+
+static bool _reserveValues(CSF * csf, size_t needed) {
+	if (needed <= csf->valueCapacity)
+		return true;
+	size_t capacity = csf->valueCapacity ? csf->valueCapacity : 4;
+	while (capacity < needed)
+		capacity *= 2;
+	float * values = realloc(csf->values, capacity * sizeof(float));
+	if (!values)
+		return false;
+	csf->values = values;
+	csf->valueCapacity = capacity;
+	return true;
+}
+
+// index of the first id in [lo, hi) that's >= coord
+static size_t _lowerBound(csfLevel * level, size_t lo, size_t hi,
+                          tCoord_t coord) {
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		STATS_COUNT(mem, 1);
+		STATS_COUNT(cmp, 1);
+		if (level->ids[mid] < coord)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+float csfGet(Tensor * T, tCoord_t * coords) {
+	if (!T || !T->values || !coords)
+		return 0;
+	CSF * csf = T->values;
+	if (!csf->order)
+		return csf->valueCount ? csf->values[0] : 0;
+
+	size_t lo = 0;
+	size_t hi = csf->levels[0].count;
+	for (tMode_t l = 0; l < csf->order; l++) {
+		csfLevel * level = &csf->levels[l];
+		size_t pos = _lowerBound(level, lo, hi, coords[l]);
+		STATS_COUNT(cmp, 1);
+		if (pos == hi || level->ids[pos] != coords[l])
+			return 0;
+		if (l == csf->order - 1) {
+			STATS_COUNT(mem, 1);
+			return csf->values[pos];
+		}
+		STATS_COUNT(mem, 1); // fetch child range
+		lo = level->ptr[pos];
+		hi = level->ptr[pos + 1];
+	}
+	return 0;
+}
+
+// Inserting a node means shifting everything after it in its level, so
+// this is O(nnz). Use csfBuild for anything more than a few entries.
+bool csfSet(Tensor * T, tCoord_t * coords, float value) {
+	if (!T || !T->values || !coords)
+		return false;
+	CSF * csf = T->values;
+	if (!csf->order) {
+		if (!_reserveValues(csf, 1))
+			return false;
+		if (!csf->valueCount)
+			T->entryCount++;
+		csf->valueCount = 1;
+		csf->values[0] = value;
+		STATS_COUNT(mem, 1);
+		return true;
+	}
+
+	// find the first level where the path doesn't exist yet
+	size_t lo = 0;
+	size_t hi = csf->levels[0].count;
+	size_t parent = 0;
+	tMode_t l;
+	size_t pos = 0;
+	for (l = 0; l < csf->order; l++) {
+		csfLevel * level = &csf->levels[l];
+		pos = _lowerBound(level, lo, hi, coords[l]);
+		STATS_COUNT(cmp, 1);
+		if (pos == hi || level->ids[pos] != coords[l])
+			break;
+		if (l == csf->order - 1) {
+			STATS_COUNT(mem, 1); // overwrite existing value
+			csf->values[pos] = value;
+			return true;
+		}
+		parent = pos;
+		lo = level->ptr[pos];
+		hi = level->ptr[pos + 1];
+	}
+
+	// reserve everything first so a failed allocation leaves no half path
+	for (tMode_t j = l; j < csf->order; j++)
+		if (!_reserveLevel(csf, j, csf->levels[j].count + 1))
+			return false;
+	if (!_reserveValues(csf, csf->valueCount + 1))
+		return false;
+
+	// the parent gains a child, so later siblings' children move over one
+	if (l > 0) {
+		csfLevel * up = &csf->levels[l - 1];
+		for (size_t i = parent + 1; i <= up->count; i++)
+			up->ptr[i]++;
+		STATS_COUNT(add, up->count - parent);
+	}
+
+	// then add a chain of single-child nodes down to the leaf
+	for (tMode_t j = l; j < csf->order; j++) {
+		csfLevel * level = &csf->levels[j];
+		size_t after = level->count - pos;
+		memmove(&level->ids[pos + 1], &level->ids[pos],
+		        after * sizeof(tCoord_t));
+		level->ids[pos] = coords[j];
+		STATS_COUNT(mem, after + 1);
+
+		if (j == csf->order - 1) {
+			memmove(&csf->values[pos + 1], &csf->values[pos],
+			        after * sizeof(float));
+			csf->values[pos] = value;
+			csf->valueCount++;
+			level->count++;
+			break;
+		}
+
+		// new node's only child goes where its successor's children start
+		size_t child = level->ptr[pos];
+		memmove(&level->ptr[pos + 1], &level->ptr[pos],
+		        (after + 1) * sizeof(csfIdx_t));
+		for (size_t i = pos + 1; i <= level->count + 1; i++)
+			level->ptr[i]++;
+		STATS_COUNT(add, after + 1);
+		level->count++;
+		pos = child;
+	}
+	T->entryCount++;
+	return true;
+}
+
+// Removing a leaf shifts everything after it in its level, and so does
+// removing each ancestor it leaves childless, so this is O(nnz) too.
+bool csfDelete(Tensor * T, tCoord_t * coords) {
+	if (!T || !T->values || !coords)
+		return false;
+	CSF * csf = T->values;
+	if (!csf->order) {
+		if (csf->valueCount)
+			T->entryCount--;
+		csf->valueCount = 0;
+		return true;
+	}
+
+	size_t * path = malloc(csf->order * sizeof(size_t));
+	if (!path)
+		return false;
+	size_t lo = 0;
+	size_t hi = csf->levels[0].count;
+	for (tMode_t l = 0; l < csf->order; l++) {
+		csfLevel * level = &csf->levels[l];
+		path[l] = _lowerBound(level, lo, hi, coords[l]);
+		STATS_COUNT(cmp, 1);
+		if (path[l] == hi || level->ids[path[l]] != coords[l]) {
+			free(path);
+			return true; // already absent
+		}
+		if (l + 1 < csf->order) {
+			STATS_COUNT(mem, 1); // fetch child range
+			lo = level->ptr[path[l]];
+			hi = level->ptr[path[l] + 1];
+		}
+	}
+
+	for (tMode_t l = csf->order - 1;; l--) {
+		csfLevel * level = &csf->levels[l];
+		size_t pos = path[l];
+		size_t after = level->count - pos - 1;
+		memmove(&level->ids[pos], &level->ids[pos + 1],
+		        after * sizeof(tCoord_t));
+		if (l == csf->order - 1) {
+			memmove(&csf->values[pos], &csf->values[pos + 1],
+			        after * sizeof(float));
+			csf->valueCount--;
+		} else {
+			// the node has no children left, so ptr[pos] == ptr[pos + 1]
+			memmove(&level->ptr[pos + 1], &level->ptr[pos + 2],
+			        after * sizeof(csfIdx_t));
+		}
+		STATS_COUNT(mem, after + 1);
+		level->count--;
+		if (l == 0)
+			break;
+
+		// the parent loses a child, so later siblings' children move back
+		csfLevel * up = &csf->levels[l - 1];
+		for (size_t i = path[l - 1] + 1; i <= up->count; i++)
+			up->ptr[i]--;
+		STATS_COUNT(add, up->count - path[l - 1]);
+		STATS_COUNT(cmp, 1);
+		if (up->ptr[path[l - 1]] != up->ptr[path[l - 1] + 1])
+			break; // it still has others
+	}
+	free(path);
+	T->entryCount--;
+
+	// hand memory back once a level is mostly unused
+	for (tMode_t l = 0; l < csf->order; l++)
+		if (csf->levels[l].count * CSF_SHRINK_RATIO < csf->levels[l].capacity)
+			_shrinkLevel(csf, l);
+	if (csf->valueCount * CSF_SHRINK_RATIO < csf->valueCapacity) {
+		size_t capacity = csf->valueCount ? csf->valueCount : 1;
+		float * values = realloc(csf->values, capacity * sizeof(float));
+		if (values) {
+			csf->values = values;
+			csf->valueCapacity = capacity;
+		}
+	}
+	return true;
+}
+
+typedef struct csfSortItem {
+	tCoord_t * coords;
+	size_t pos;
+	tMode_t order;
+} csfSortItem;
+
+// lexicographic by coordinates, then by input position
+static int _csfSortCompare(const void * x, const void * y) {
+	const csfSortItem * a = x;
+	const csfSortItem * b = y;
+	for (tMode_t m = 0; m < a->order; m++) {
+		STATS_COUNT(cmp, 1);
+		if (a->coords[m] != b->coords[m])
+			return a->coords[m] < b->coords[m] ? -1 : 1;
+	}
+	return a->pos < b->pos ? -1 : a->pos > b->pos;
+}
+
+bool csfBuild(Tensor * T, size_t n, tCoord_t * coords, float * values) {
+	if (!T || !T->values || (n && (!coords || !values)))
+		return false;
+	CSF * csf = T->values;
+	if (T->entryCount)
+		return false;
+	if (!csf->order) {
+		return n && values[n - 1] ? csfSet(T, coords, values[n - 1]) : true;
+	}
+
+	csfSortItem * items = malloc((n + 1) * sizeof(csfSortItem));
+	if (!items)
+		return false;
+	for (size_t i = 0; i < n; i++)
+		items[i] = (csfSortItem){
+		    .coords = &coords[i * csf->order], .pos = i, .order = csf->order};
+	qsort(items, n, sizeof(csfSortItem), _csfSortCompare);
+
+	// drop all but the last of each run of equal coordinates, and that
+	// too if it's zero
+	size_t unique = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (i + 1 < n &&
+		    !memcmp(items[i].coords, items[i + 1].coords,
+		            csf->order * sizeof(tCoord_t)))
+			continue;
+		if (values[items[i].pos])
+			items[unique++] = items[i];
+	}
+
+	// worst case is no shared prefixes at all
+	for (tMode_t l = 0; l < csf->order; l++) {
+		if (!_reserveLevel(csf, l, unique)) {
+			free(items);
+			return false;
+		}
+	}
+	if (!_reserveValues(csf, unique)) {
+		free(items);
+		return false;
+	}
+
+	// append one entry at a time, starting at the first differing level
+	for (size_t i = 0; i < unique; i++) {
+		tMode_t diverge = 0;
+		if (i) {
+			while (items[i].coords[diverge] == items[i - 1].coords[diverge])
+				diverge++;
+			STATS_COUNT(cmp, diverge + 1);
+		}
+		for (tMode_t l = diverge; l < csf->order; l++) {
+			csfLevel * level = &csf->levels[l];
+			level->ids[level->count] = items[i].coords[l];
+			if (l + 1 < csf->order)
+				level->ptr[level->count] = csf->levels[l + 1].count;
+			level->count++;
+			STATS_COUNT(mem, 1);
+		}
+		csf->values[csf->valueCount++] = values[items[i].pos];
+	}
+	for (tMode_t l = 0; l + 1 < csf->order; l++)
+		csf->levels[l].ptr[csf->levels[l].count] = csf->levels[l + 1].count;
+	for (tMode_t l = 0; l < csf->order; l++)
+		_shrinkLevel(csf, l);
+
+	T->entryCount = unique;
+	free(items);
+	return true;
+}
+
+void csfPrintAll(Tensor * T) {
+	CSF * csf = T->values;
+	printf("raw CSF (%p->%p) contents:\n", T, T->values);
+	if (!csf) {
+		printf("\t<invalid>\n");
+		return;
+	}
+	for (tMode_t l = 0; l < csf->order; l++) {
+		csfLevel * level = &csf->levels[l];
+		printf("  level %u (%lu nodes):\n", l, level->count);
+		for (size_t i = 0; i < level->count; i++) {
+			printf("    [%lu] %u", i, level->ids[i]);
+			if (level->ptr)
+				printf(" -> [%u, %u)", level->ptr[i], level->ptr[i + 1]);
+			else
+				printf(" = %f", csf->values[i]);
+			putchar('\n');
+		}
+	}
+}
+
+size_t csfSize(Tensor * T) {
+	CSF * csf = T->values;
+	size_t size = sizeof(float) * csf->valueCapacity;
+	for (tMode_t l = 0; l < csf->order; l++) {
+		size += sizeof(tCoord_t) * csf->levels[l].capacity;
+		if (csf->levels[l].ptr)
+			size += sizeof(csfIdx_t) * (csf->levels[l].capacity + 1);
+	}
+	return size;
+}
+
+typedef struct csfContext {
+	size_t * pos; // current node in each level
+	size_t end;   // stop before this leaf
+	tCoord_t * coords;
+	bool started;
+} csfContext;
+
+void * csfIteratorInit(Tensor * T) {
+	if (!T || !T->values)
+		return NULL;
+	csfContext * ctx = calloc(sizeof(csfContext), 1);
+	if (!ctx)
+		return NULL;
+	ctx->pos = calloc(sizeof(size_t), T->order + 1);
+	ctx->coords = calloc(sizeof(tCoord_t), T->order + 1);
+	if (!ctx->pos || !ctx->coords) {
+		csfIteratorCleanup(ctx);
+		return NULL;
+	}
+	ctx->end = SIZE_MAX;
+	return ctx;
+}
+
+// Entries sharing the first p coordinates are the leaves under a single
+// node p levels down, so find that node and start at its first leaf.
+void * csfIteratorInitPrefix(Tensor * T, tCoord_t * prefix, tMode_t p) {
+	if (!T || !T->values || (p && !prefix) || p > T->order)
+		return NULL;
+	CSF * csf = T->values;
+	csfContext * ctx = csfIteratorInit(T);
+	if (!ctx || !p)
+		return ctx;
+
+	size_t lo = 0;
+	size_t hi = csf->levels[0].count;
+	for (tMode_t l = 0; l < csf->order; l++) {
+		csfLevel * level = &csf->levels[l];
+		if (l < p) {
+			size_t pos = _lowerBound(level, lo, hi, prefix[l]);
+			STATS_COUNT(cmp, 1);
+			if (pos == hi || level->ids[pos] != prefix[l]) {
+				ctx->end = 0; // nothing matches
+				return ctx;
+			}
+			lo = pos;
+			hi = pos + 1;
+		}
+		ctx->pos[l] = lo;
+		if (l < csf->order - 1) {
+			STATS_COUNT(mem, 1); // fetch child range
+			size_t first = level->ptr[lo];
+			hi = level->ptr[hi];
+			lo = first;
+		}
+	}
+	ctx->end = hi;
+	return ctx;
+}
+
+void csfIteratorCleanup(void * context) {
+	csfContext * ctx = context;
+	if (!ctx)
+		return;
+	free(ctx->pos);
+	free(ctx->coords);
+	free(ctx);
+}
+
+// Walks the leaf level in order, moving each ancestor along whenever the
+// leaf runs past the end of its children.
+tensorEntry csfIteratorNext(Tensor * T, void * context) {
+	csfContext * ctx = context;
+	if (!ctx || !T || !T->values)
+		return (tensorEntry){0};
+	CSF * csf = T->values;
+
+	if (!csf->order) {
+		if (ctx->started || !csf->valueCount)
+			return (tensorEntry){0};
+		ctx->started = true;
+		return (tensorEntry){.coords = ctx->coords, .value = csf->values[0]};
+	}
+
+	tMode_t leaf = csf->order - 1;
+	if (ctx->started) {
+		STATS_COUNT(add, 1);
+		ctx->pos[leaf]++;
+	}
+	ctx->started = true;
+	STATS_COUNT(cmp, 1);
+	if (ctx->pos[leaf] >= csf->levels[leaf].count ||
+	    ctx->pos[leaf] >= ctx->end)
+		return (tensorEntry){0};
+
+	for (tMode_t l = leaf; l > 0; l--) {
+		csfLevel * up = &csf->levels[l - 1];
+		STATS_COUNT(cmp, 1);
+		while (ctx->pos[l] >= up->ptr[ctx->pos[l - 1] + 1]) {
+			STATS_COUNT(add, 1);
+			ctx->pos[l - 1]++;
+		}
+	}
+	for (tMode_t l = 0; l < csf->order; l++) {
+		STATS_COUNT(mem, 1);
+		ctx->coords[l] = csf->levels[l].ids[ctx->pos[l]];
+	}
+	return (tensorEntry){.coords = ctx->coords,
+	                     .value = csf->values[ctx->pos[leaf]]};
+}
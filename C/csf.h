@@ -0,0 +1,35 @@
+#pragma once
+#include "tensor.h"
+#include <stddef.h>
+
+// Compressed Sparse Fiber: one level per mode, each holding the sorted
+// coordinates of its fibers and pointers to their children in the next
+// level. Entries sharing a coordinate prefix share the nodes for it.
+
+#define CSF_SHRINK_RATIO 4 // shrink a level once it's this much too big
+
+void * csfNew(tMode_t order);
+void csfFree(Tensor * T);
+
+// csfBuild fills an empty tensor from n COO entries in any order.
+// Later duplicates of the same coordinates overwrite earlier ones, and
+// coordinates whose last value is zero are left out.
+bool csfBuild(Tensor * T, size_t n, tCoord_t * coords, float * values);
+
+bool csfSet(Tensor * T, tCoord_t * coords, float value);
+float csfGet(Tensor * T, tCoord_t * coords);
+bool csfDelete(Tensor * T, tCoord_t * coords);
+
+void csfPrintAll(Tensor * T); // only for debug
+
+size_t csfSize(Tensor * T);
+
+void * csfIteratorInit(Tensor * T);
+// iterates only the entries whose first p coordinates equal prefix
+void * csfIteratorInitPrefix(Tensor * T, tCoord_t * prefix, tMode_t p);
+void csfIteratorCleanup(void * context);
+tensorEntry csfIteratorNext(Tensor * T, void * context);
+
+const static tensorIterator csfIterator = {.init = csfIteratorInit,
+                                           .next = csfIteratorNext,
+                                           .cleanup = csfIteratorCleanup};
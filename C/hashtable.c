@@ -2,48 +2,85 @@
 #include "stats.h"
 #include <stddef.h>
 
-size_t ht_capacity;
-
-typedef unsigned long long htKey_t;
-typedef struct htEntry {
-	bool valid;
-	htKey_t key;
-	float value;
-} htEntry;
+typedef tKey_t htKey_t;
 const size_t _hteSize = sizeof(float) + sizeof(htKey_t);
 
-typedef struct Hashtable {
+// Empty slots hold this key instead of carrying a valid flag. Only a shape
+// that fills every key bit can produce it, and that one entry is kept
+// beside the table.
+#define HT_EMPTY_KEY (~(htKey_t)0)
+
+// Keys and values live in separate arrays, so probing only touches keys
+// (8 per cache line). Capacity is a power of two.
+typedef struct htSlots {
 	size_t capacity;
-	htEntry * table;
+	htKey_t * keys;
+	float * values;
+} htSlots;
+
+// While resizing, entries move from old to table a few slots per insert
+// or delete instead of all at once. Old slots below `migrated` have moved;
+// every key lives either in table or in an unmigrated old slot. Deleting
+// an unmigrated entry only zeroes its value, since zeros are never stored.
+typedef struct Hashtable {
+	htSlots table;
+	htSlots old;
+	size_t migrated;
+	bool hasEmptyKey;
+	float emptyKeyValue;
 } Hashtable;
 
-static htKey_t _Coords2Key(Tensor * T, tCoord_t * coords) {
-	htKey_t key = 0;
-	for (tMode_t mode = 0; mode < T->order; mode++) {
-		key += (htKey_t)coords[(T->order - 1) - mode]
-		       << (mode * HT_KEYGEN_FIELD_SIZE);
-	}
-	return key;
+// Murmur3 finalizer. Packed keys differ mostly in their low field, so
+// the mix spreads every bit of the key across the slot index.
+static size_t _hash(htKey_t key) {
+	STATS_COUNT(mul, 2); // counting hash as MUL
+	unsigned long long h = key;
+#ifdef TENSOR_WIDE_KEYS
+	h ^= key >> 64;
+#endif
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// how far the key in slot i is from the slot it hashes to
+static size_t _distance(htSlots * t, size_t i) {
+	STATS_COUNT(add, 1);
+	return (i - _hash(t->keys[i])) & (t->capacity - 1);
 }
 
-static void _Key2Coords(Tensor * T, tCoord_t * coords, htKey_t key) {
-	tCoord_t mask = ~0;
-	mask <<= (sizeof(mask) * 8) - HT_KEYGEN_FIELD_SIZE;
-	mask >>= (sizeof(mask) * 8) - HT_KEYGEN_FIELD_SIZE;
-	for (tMode_t mode = 0; mode < T->order; mode++) {
-		coords[(T->order - 1) - mode] =
-		    (key >> (mode * HT_KEYGEN_FIELD_SIZE)) & mask;
+static bool _slotsNew(htSlots * t, size_t capacity) {
+	t->keys = malloc(capacity * sizeof(htKey_t));
+	t->values = malloc(capacity * sizeof(float));
+	if (!t->keys || !t->values) {
+		free(t->keys);
+		free(t->values);
+		*t = (htSlots){0};
+		return false;
 	}
+	for (size_t i = 0; i < capacity; i++)
+		t->keys[i] = HT_EMPTY_KEY;
+	t->capacity = capacity;
+	return true;
+}
+
+static void _slotsFree(htSlots * t) {
+	free(t->keys);
+	free(t->values);
+	*t = (htSlots){0};
 }
 
 void * htNew() {
 	Hashtable * ht = calloc(1, sizeof(Hashtable));
 	if (!ht)
 		return 0;
-
-	size_t capacity = ht_capacity * HT_OVERPROVISION;
-	ht->table = calloc(capacity, sizeof(htEntry));
-	ht->capacity = ht->table ? capacity : 0;
+	if (!_slotsNew(&ht->table, HT_INITIAL_CAPACITY)) {
+		free(ht);
+		return 0;
+	}
 	return ht;
 }
 
@@ -51,13 +88,235 @@ void htFree(Tensor * T) {
 	if (!T || !T->values)
 		return;
 	Hashtable * ht = T->values;
-	free(ht->table);
-	ht->table = 0;
-	ht->capacity = 0;
+	_slotsFree(&ht->table);
+	_slotsFree(&ht->old);
 	T->values = 0;
 	free(ht);
 }
 
+// Robin Hood lookup: keys are ordered by distance from their home slot,
+// so the search stops as soon as it passes a key closer to home than it.
+// Returns the slot holding key, or the capacity if it's absent.
+static size_t _find(htSlots * t, htKey_t key, size_t hash) {
+	size_t mask = t->capacity - 1;
+	size_t i = hash & mask;
+	for (size_t dist = 0;; dist++) {
+		STATS_COUNT(mem, 1);
+		STATS_COUNT(cmp, 1);
+		if (t->keys[i] == key)
+			return i;
+		STATS_COUNT(cmp, 2);
+		if (t->keys[i] == HT_EMPTY_KEY || _distance(t, i) < dist)
+			return t->capacity;
+		STATS_COUNT(add, 1);
+		i = (i + 1) & mask;
+	}
+}
+
+// Robin Hood insertion of a key that isn't in the table yet: whenever the
+// new entry is further from home than the resident one, they swap.
+// The load factor is kept below 1, so there's always an empty slot.
+static void _insert(htSlots * t, htKey_t key, float value) {
+	size_t mask = t->capacity - 1;
+	size_t i = _hash(key) & mask;
+	for (size_t dist = 0;; dist++) {
+		STATS_COUNT(mem, 1);
+		STATS_COUNT(cmp, 1);
+		if (t->keys[i] == HT_EMPTY_KEY) {
+			t->keys[i] = key;
+			t->values[i] = value;
+			STATS_COUNT(mem, 1);
+			return;
+		}
+		size_t residentDist = _distance(t, i);
+		STATS_COUNT(cmp, 1);
+		if (residentDist < dist) {
+			htKey_t k = t->keys[i];
+			float v = t->values[i];
+			t->keys[i] = key;
+			t->values[i] = value;
+			key = k;
+			value = v;
+			dist = residentDist;
+			STATS_COUNT(mem, 1);
+		}
+		STATS_COUNT(add, 1);
+		i = (i + 1) & mask;
+	}
+}
+
+// move up to `slots` old slots over to the new table
+static void _migrate(Hashtable * ht, size_t slots) {
+	if (!ht->old.keys)
+		return;
+	size_t end = ht->migrated + slots;
+	if (end > ht->old.capacity)
+		end = ht->old.capacity;
+	for (; ht->migrated < end; ht->migrated++) {
+		STATS_COUNT(mem, 1);
+		htKey_t key = ht->old.keys[ht->migrated];
+		float value = ht->old.values[ht->migrated];
+		STATS_COUNT(cmp, 1);
+		if (key != HT_EMPTY_KEY && value != 0) // zero if deleted meanwhile
+			_insert(&ht->table, key, value);
+	}
+	STATS_COUNT(cmp, 1);
+	if (ht->migrated == ht->old.capacity) {
+		_slotsFree(&ht->old);
+		ht->migrated = 0;
+	}
+}
+
+// Start moving everything into a table of `capacity` slots (a power of
+// two, bigger or smaller). Only one migration runs at a time, so finish
+// any earlier one.
+static bool _resize(Hashtable * ht, size_t capacity) {
+	_migrate(ht, ht->old.capacity);
+	htSlots table;
+	if (!_slotsNew(&table, capacity))
+		return false;
+	ht->old = ht->table;
+	ht->migrated = 0;
+	ht->table = table;
+	return true;
+}
+
+// finds the slot of an unmigrated entry in the old table, or NULL
+static float * _findOld(Hashtable * ht, htKey_t key, size_t hash) {
+	if (!ht->old.keys)
+		return 0;
+	size_t i = _find(&ht->old, key, hash);
+	STATS_COUNT(cmp, 1);
+	if (i == ht->old.capacity || i < ht->migrated || ht->old.values[i] == 0)
+		return 0;
+	return &ht->old.values[i];
+}
+
+bool htReserve(Tensor * T, size_t count) {
+	if (!T || !T->values)
+		return false;
+	Hashtable * ht = T->values;
+	size_t capacity = ht->table.capacity;
+	while (count * HT_OVERPROVISION > capacity)
+		capacity *= 2;
+	if (capacity == ht->table.capacity)
+		return true;
+	if (!_resize(ht, capacity))
+		return false;
+	_migrate(ht, ht->old.capacity);
+	return true;
+}
+
+// htSet for a key whose hash is already known
+static bool _set(Tensor * T, htKey_t key, size_t hash, float value) {
+	Hashtable * ht = T->values;
+	STATS_COUNT(cmp, 1);
+	if (key == HT_EMPTY_KEY) {
+		if (!ht->hasEmptyKey)
+			T->entryCount++;
+		ht->hasEmptyKey = true;
+		ht->emptyKeyValue = value;
+		return true;
+	}
+
+	_migrate(ht, HT_MIGRATE_STEP);
+	size_t i = _find(&ht->table, key, hash);
+	if (i != ht->table.capacity) {
+		ht->table.values[i] = value;
+		STATS_COUNT(mem, 1); // store new value
+		return true;
+	}
+	float * old = _findOld(ht, key, hash);
+	if (old) {
+		*old = value;
+		STATS_COUNT(mem, 1); // store new value
+		return true;
+	}
+
+	// it's a new key, so make sure the load factor stays in bounds
+	STATS_COUNT(mul, 1);
+	STATS_COUNT(cmp, 1);
+	if ((T->entryCount + 1) * HT_OVERPROVISION > ht->table.capacity) {
+		if (!_resize(ht, 2 * ht->table.capacity))
+			return false;
+		_migrate(ht, HT_MIGRATE_STEP);
+	}
+	_insert(&ht->table, key, value);
+	T->entryCount++;
+	return true;
+}
+
+// Backward-shift deletion: entries after the hole move back one slot
+// until one is already home or the run ends, which keeps the Robin Hood
+// ordering intact without tombstones.
+static void _erase(htSlots * t, size_t i) {
+	size_t mask = t->capacity - 1;
+	size_t next = (i + 1) & mask;
+	STATS_COUNT(mem, 1);
+	STATS_COUNT(cmp, 2);
+	while (t->keys[next] != HT_EMPTY_KEY && _distance(t, next) > 0) {
+		t->keys[i] = t->keys[next];
+		t->values[i] = t->values[next];
+		STATS_COUNT(mem, 2);
+		STATS_COUNT(add, 1);
+		i = next;
+		next = (next + 1) & mask;
+		STATS_COUNT(cmp, 2);
+	}
+	t->keys[i] = HT_EMPTY_KEY;
+	STATS_COUNT(mem, 1);
+}
+
+// removes key if it's there, and shrinks the table once it's mostly empty
+static bool _delete(Tensor * T, htKey_t key, size_t hash) {
+	Hashtable * ht = T->values;
+	STATS_COUNT(cmp, 1);
+	if (key == HT_EMPTY_KEY) {
+		if (ht->hasEmptyKey)
+			T->entryCount--;
+		ht->hasEmptyKey = false;
+		return true;
+	}
+
+	_migrate(ht, HT_MIGRATE_STEP);
+	size_t i = _find(&ht->table, key, hash);
+	if (i != ht->table.capacity) {
+		_erase(&ht->table, i);
+	} else {
+		// shifting entries in the old table could move them below the
+		// migrated mark, so an unmigrated entry is zeroed in place
+		float * old = _findOld(ht, key, hash);
+		if (!old)
+			return true;
+		*old = 0;
+		STATS_COUNT(mem, 1);
+	}
+	T->entryCount--;
+
+	STATS_COUNT(mul, 1);
+	STATS_COUNT(cmp, 1);
+	if (ht->table.capacity > HT_INITIAL_CAPACITY &&
+	    T->entryCount * HT_OVERPROVISION * HT_SHRINK_RATIO <
+	        ht->table.capacity)
+		return _resize(ht, ht->table.capacity / 2);
+	return true;
+}
+
+// htGet for a key whose hash is already known
+static float _get(Hashtable * ht, htKey_t key, size_t hash) {
+	STATS_COUNT(cmp, 1);
+	if (key == HT_EMPTY_KEY)
+		return ht->hasEmptyKey ? ht->emptyKeyValue : 0;
+
+	size_t i = _find(&ht->table, key, hash);
+	if (i != ht->table.capacity) {
+		STATS_COUNT(mem, 1);
+		return ht->table.values[i];
+	}
+	float * old = _findOld(ht, key, hash);
+	return old ? *old : 0;
+}
+
 // makes a new entry or modifies existing one
 bool htSet(Tensor * T, tCoord_t * coords, float value) {
 	if (!T)
@@ -67,40 +326,22 @@ bool htSet(Tensor * T, tCoord_t * coords, float value) {
 	if (!coords)
 		return false;
 	Hashtable * ht = T->values;
-	if (!ht->table || !ht->capacity)
+	if (!ht->table.keys)
 		return false;
-	htKey_t key = _Coords2Key(T, coords);
-
-	statsGlobal.mul++; // counting hash as MUL
-	size_t i = key % ht->capacity;
-	size_t init_i = i;
-	statsGlobal.mem++;
-	while (ht->table[i].valid) {
-		if (i != init_i) // don't double-count the first access
-			statsGlobal.mem++;
-
-		// check if overwriting
-		if (ht->table[i].key == key) {
-			T->entryCount--;
-			break;
-		}
-
-		// increment but loop around the end
-		statsGlobal.add++;
-		statsGlobal.cmp++;
-		i = (i + 1) % ht->capacity;
+	htKey_t key = tensorCoords2Key(T, coords);
+	if (value == 0)
+		return _delete(T, key, _hash(key));
+	return _set(T, key, _hash(key), value);
+}
 
-		// check if we just circled around the parking lot
-		statsGlobal.cmp++;
-		if (i == init_i)
-			return false;
-	}
-	ht->table[i].valid = true;
-	ht->table[i].key = key;
-	ht->table[i].value = value;
-	T->entryCount++;
-	statsGlobal.mem++; // store new value
-	return true;
+bool htDelete(Tensor * T, tCoord_t * coords) {
+	if (!T || !T->values || !coords)
+		return false;
+	Hashtable * ht = T->values;
+	if (!ht->table.keys)
+		return false;
+	htKey_t key = tensorCoords2Key(T, coords);
+	return _delete(T, key, _hash(key));
 }
 
 // returns 0 in too many cases. Not sure if that's okay
@@ -108,62 +349,96 @@ float htGet(Tensor * T, tCoord_t * coords) {
 	if (!T || !T->values || !coords)
 		return 0;
 	Hashtable * ht = T->values;
-	if (!ht->table)
-		return 0;
-	htKey_t key = _Coords2Key(T, coords);
-
-	statsGlobal.mul++; // counting hash as mul
-	size_t i = key % ht->capacity;
-	statsGlobal.mem++;
-	if (!ht->table[i].valid)
+	if (!ht->table.keys)
 		return 0;
+	htKey_t key = tensorCoords2Key(T, coords);
+	return _get(ht, key, _hash(key));
+}
 
-	size_t init_i = i;
-	statsGlobal.cmp++;
-	while (ht->table[i].key != key) {
-		if (i != init_i) // don't double-count the first access
-			statsGlobal.mem++;
-
-		if (!ht->table[i].valid)
-			return 0;
+// Hash a block of keys and prefetch their home slots before resolving
+// any of them, so the cache misses overlap instead of queueing up.
+static void _prefetchBlock(Tensor * T, tCoord_t * coords, size_t n,
+                           htKey_t * keys, size_t * hashes) {
+	Hashtable * ht = T->values;
+	size_t mask = ht->table.capacity - 1;
+	for (size_t i = 0; i < n; i++) {
+		keys[i] = tensorCoords2Key(T, &coords[i * T->order]);
+		hashes[i] = _hash(keys[i]);
+		__builtin_prefetch(&ht->table.keys[hashes[i] & mask]);
+		__builtin_prefetch(&ht->table.values[hashes[i] & mask]);
+	}
+}
 
-		// increment but loop around the end
-		statsGlobal.add++;
-		statsGlobal.cmp++;
-		i = (i + 1) % ht->capacity;
+void htGetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values) {
+	if (!T || !T->values || !coords || !values)
+		return;
+	Hashtable * ht = T->values;
+	htKey_t keys[HT_BATCH];
+	size_t hashes[HT_BATCH];
+	for (size_t start = 0; start < n; start += HT_BATCH) {
+		size_t count = n - start < HT_BATCH ? n - start : HT_BATCH;
+		_prefetchBlock(T, &coords[start * T->order], count, keys, hashes);
+		for (size_t i = 0; i < count; i++)
+			values[start + i] = _get(ht, keys[i], hashes[i]);
+	}
+}
 
-		// check if we just circled around the parking lot
-		statsGlobal.cmp++;
-		if (i == init_i)
-			return 0;
+bool htSetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values) {
+	if (!T || !T->values || (n && (!coords || !values)))
+		return false;
+	htKey_t keys[HT_BATCH];
+	size_t hashes[HT_BATCH];
+	for (size_t start = 0; start < n; start += HT_BATCH) {
+		size_t count = n - start < HT_BATCH ? n - start : HT_BATCH;
+		_prefetchBlock(T, &coords[start * T->order], count, keys, hashes);
+		for (size_t i = 0; i < count; i++) {
+			float value = values[start + i];
+			if (value == 0 ? !_delete(T, keys[i], hashes[i])
+			               : !_set(T, keys[i], hashes[i], value))
+				return false;
+		}
 	}
-	return ht->table[i].value;
+	return true;
 }
 
 #include <stdio.h>
-void htePrint(htEntry hte) {
-	if (!hte.valid)
-		printf("<invalid>\n");
-	else
-		printf("%llu: %f\n", hte.key, hte.value);
+static void _slotsPrint(htSlots * t, size_t from) {
+	for (size_t i = from; i < t->capacity; i++) {
+		printf("  [%lu] ", i);
+		if (t->keys[i] == HT_EMPTY_KEY)
+			printf("<invalid>\n");
+		else
+			printf("%llu: %f\n", (unsigned long long)t->keys[i],
+			       t->values[i]);
+	}
 }
 
 void htPrintAll(void * ptr) {
 	Hashtable * ht = ptr;
 	printf("Hashtable:\n");
-	if (!ht->table) {
+	if (!ht->table.keys) {
 		printf("  <invalid>\n");
 		return;
 	}
-	for (size_t i = 0; i < ht->capacity; i++) {
-		printf("  [%lu] ", i);
-		htePrint(ht->table[i]);
-	}
+	_slotsPrint(&ht->table, 0);
+	if (ht->hasEmptyKey)
+		printf("  [side] %llu: %f\n", (unsigned long long)HT_EMPTY_KEY,
+		       ht->emptyKeyValue);
+	if (!ht->old.keys)
+		return;
+	printf("  migrating from (%lu of %lu moved):\n", ht->migrated,
+	       ht->old.capacity);
+	_slotsPrint(&ht->old, ht->migrated);
 }
 
 size_t htSize(Tensor * T) {
 	Hashtable * ht = T->values;
-	return _hteSize * ht->capacity;
+	return _hteSize * (ht->table.capacity + ht->old.capacity);
+}
+
+size_t htCapacity(Tensor * T) {
+	Hashtable * ht = T->values;
+	return ht->table.capacity;
 }
 
 typedef struct htContext {
@@ -175,7 +450,7 @@ void * htIteratorInit(Tensor * T) {
 	htContext * ctx = calloc(sizeof(htContext), 1);
 	if (!ctx)
 		return 0;
-	ctx->coords = calloc(sizeof(tCoord_t), T->order);
+	ctx->coords = calloc(sizeof(tCoord_t), T->order + 1);
 	if (!ctx->coords) {
 		free(ctx);
 		return 0;
@@ -190,27 +465,47 @@ void htIteratorCleanup(void * context) {
 	free(ctx);
 }
 
+// Walks the new table, then the unmigrated part of the old one, then the
+// side slot. Inserting while iterating isn't supported.
 tensorEntry htIteratorNext(Tensor * T, void * context) {
 	if (!T || !T->values)
 		return (tensorEntry){0};
 	Hashtable * ht = T->values;
-	if (!ht->table)
+	if (!ht->table.keys)
 		return (tensorEntry){0};
 	htContext * ctx = context;
+	size_t end = ht->table.capacity + ht->old.capacity;
 
-	statsGlobal.cmp++;
-	for (; ctx->i < ht->capacity; (ctx->i)++) {
-		statsGlobal.mem++;
-		if (!ht->table[ctx->i].valid) {
-			statsGlobal.cmp++; // loop condition
+	STATS_COUNT(cmp, 1);
+	for (; ctx->i < end; (ctx->i)++) {
+		htSlots * t = &ht->table;
+		size_t slot = ctx->i;
+		if (slot >= ht->table.capacity) {
+			t = &ht->old;
+			slot -= ht->table.capacity;
+			if (slot < ht->migrated) {
+				slot = ht->migrated;
+				ctx->i = ht->table.capacity + slot;
+			}
+		}
+		STATS_COUNT(mem, 1);
+		if (t->keys[slot] == HT_EMPTY_KEY || t->values[slot] == 0) {
+			STATS_COUNT(cmp, 1); // loop condition
 			continue;
 		}
 
-		htEntry * hte = &ht->table[ctx->i];
-		statsGlobal.add++;
+		STATS_COUNT(add, 1);
+		(ctx->i)++;
+		tensorKey2Coords(T, ctx->coords, t->keys[slot]);
+		return (tensorEntry){.coords = ctx->coords, .value = t->values[slot]};
+	}
+
+	STATS_COUNT(cmp, 1);
+	if (ctx->i == end && ht->hasEmptyKey) {
 		(ctx->i)++;
-		_Key2Coords(T, ctx->coords, hte->key);
-		return (tensorEntry){.coords = ctx->coords, .value = hte->value};
+		tensorKey2Coords(T, ctx->coords, HT_EMPTY_KEY);
+		return (tensorEntry){.coords = ctx->coords,
+		                     .value = ht->emptyKeyValue};
 	}
 	return (tensorEntry){0};
 }
@@ -3,23 +3,31 @@
 #include <stddef.h>
 
 #ifndef HT_OVERPROVISION
-#define HT_OVERPROVISION 1.5 // = capacity / nnz on file load
+#define HT_OVERPROVISION 1.5 // = minimum capacity / nnz, grows beyond that
 #endif
 
-#define HT_KEYGEN_FIELD_SIZE 16 // up to order-4 without conflict
-//#define HT_KEYGEN_FIELD_SIZE 8 // up to order-8, but each mode has max len 256
+#define HT_INITIAL_CAPACITY 16 // must be a power of two
+#define HT_MIGRATE_STEP 8 // old slots moved per insert or delete while resizing
+#define HT_SHRINK_RATIO 4 // halve when capacity is this many times minimum
+#define HT_BATCH 16 // lookups prefetched together by the batch functions
 
-extern size_t ht_capacity;
-// ht_capacity is only accessed in htNew
 void * htNew();
 void htFree(Tensor * T);
+// grow ahead of time to hold count entries without rehashing
+bool htReserve(Tensor * T, size_t count);
 
 bool htSet(Tensor * T, tCoord_t * key, float value);
 float htGet(Tensor * T, tCoord_t * key);
+bool htDelete(Tensor * T, tCoord_t * key);
+// n lookups at once, n * order coords like tensorBuild
+void htGetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values);
+bool htSetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values);
 
 void htPrintAll(void * ht); // only for debug
 
 size_t htSize(Tensor * T);
+// slots in the table new entries go into, so entryCount / this is the load
+size_t htCapacity(Tensor * T);
 
 void * htIteratorInit(Tensor * T);
 void htIteratorCleanup(void * context);
@@ -1,14 +1,469 @@
 #include "bpTree.h"
 #include "hashtable.h"
 #include "stats.h"
+#include "swisstable.h"
 #include "tensor.h"
 #include "tensorMath.h"
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOOKUP_SLOTS (1 << 22) // per hash table, tens of MB, beyond cache
+#define LOOKUP_SIDE 4096        // of each mode, LOOKUP_SIDE^3 == 2^36
+#define DEMO_THREADS 4
+#define STRESS_THREADS 8
+#define STRESS_ADDS 100000
+#define STREAM_BUDGET 65536
+#define READ_CHECK_ENTRIES 40000 // enough text for several read chunks
+#define SHRINK_CHECK_ENTRIES 20000
+#define SPLIT_CHECK_LENGTH 4096 // contracted length of the split-sum check
+
+// Entries of Y that differ from X's, and any count difference. Values are
+// compared exactly, since the checks below expect identical results.
+static size_t countDifferences(Tensor * X, Tensor * Y) {
+	if (!X || !Y)
+		return 1;
+	size_t differences = X->entryCount != Y->entryCount;
+	tensorIterator iter = tensorGetIterator(Y);
+	void * context = iter.init(Y);
+	for (tensorEntry item = iter.next(Y, context); item.coords;
+	     item = iter.next(Y, context))
+		differences += tensorGet(X, item.coords) != item.value;
+	iter.cleanup(context);
+	return differences;
+}
+
+// Spreads the first n and the next n numbers over a LOOKUP_SIDE^3 shape.
+// Multiplying by an odd number wraps around 2^36 without repeating, so the
+// hits all differ and none of the misses is among them.
+static void lookupKeys(tCoord_t * hits, tCoord_t * misses, size_t n) {
+	const unsigned long long mask = (1ULL << 36) - 1;
+	for (size_t i = 0; i < 2 * n; i++) {
+		unsigned long long key = i * 0x9e3779b97f4a7c15ULL & mask;
+		tCoord_t * coords = i < n ? &hits[3 * i] : &misses[3 * (i - n)];
+		coords[0] = key >> 24;
+		coords[1] = key >> 12 & (LOOKUP_SIDE - 1);
+		coords[2] = key & (LOOKUP_SIDE - 1);
+	}
+}
+
+// Looks up each of the n hits and misses in turn, returning the sum of
+// what it found
+static double lookupAll(Tensor * T, tCoord_t * hits, tCoord_t * misses,
+                        size_t n) {
+	double sum = 0;
+	for (size_t i = 0; i < n; i++) {
+		sum += tensorGet(T, &hits[3 * i]);
+		sum += tensorGet(T, &misses[3 * i]);
+	}
+	return sum;
+}
+
+// Times lookupAll and reports the cost per lookup at T's load factor
+static void benchLookups(Tensor * T, tCoord_t * hits, tCoord_t * misses,
+                         size_t n, double load) {
+	statsReset();
+	clock_t start = clock();
+	double sum = lookupAll(T, hits, misses, n);
+	double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	Stats stats = statsGet();
+	tensorPrintMetadata(T);
+	printf("  %lu lookups, half of them misses (checksum %.0f)\n", 2 * n, sum);
+	printf("  %.1f ns and %.2f RAM transactions per lookup at load %.3f\n",
+	       1e9 * seconds / (2 * n), (float)stats.mem / (2 * n), load);
+}
+
+// Fills a linear probing and a swiss table of LOOKUP_SLOTS slots each with
+// as many entries as they take before growing, and times lookups in both
+static void checkLookups() {
+	enum storageType types[2] = {probingHashtable, swissHashtable};
+	const char * names[2] = {"Linear probing", "Swiss"};
+	double maxLoads[2] = {1 / HT_OVERPROVISION, SW_MAX_LOAD};
+	size_t most = LOOKUP_SLOTS * (maxLoads[0] > maxLoads[1] ? maxLoads[0]
+	                                                         : maxLoads[1]);
+	tCoord_t shape[3] = {LOOKUP_SIDE, LOOKUP_SIDE, LOOKUP_SIDE};
+	tCoord_t * hits = malloc(3 * most * sizeof(tCoord_t));
+	tCoord_t * misses = malloc(3 * most * sizeof(tCoord_t));
+	float * values = malloc(most * sizeof(float));
+	if (!hits || !misses || !values) {
+		printf("  allocation error\n");
+		free(hits);
+		free(misses);
+		free(values);
+		return;
+	}
+	lookupKeys(hits, misses, most);
+	for (size_t i = 0; i < most; i++)
+		values[i] = i % 50 + 1;
+
+	for (int t = 0; t < 2; t++) {
+		size_t n = LOOKUP_SLOTS * maxLoads[t];
+		printf("\n%s (max load %.3f):\n", names[t], maxLoads[t]);
+		Tensor * T = tensorNew(types[t], 3, shape);
+		if (!T || !tensorBuild(T, n, hits, values)) {
+			printf("  failed to fill the table\n");
+			tensorFree(T);
+			continue;
+		}
+		size_t capacity = t ? swCapacity(T) : htCapacity(T);
+		benchLookups(T, hits, misses, n, (double)T->entryCount / capacity);
+
+		// Charging the table's own stats adds work to every lookup, so
+		// it's an untimed pass of its own
+		Stats work = {0};
+		T->stats = &work;
+		lookupAll(T, hits, misses, n);
+		T->stats = 0;
+		printf("  %.2f RAM transactions per lookup charged to the table "
+		       "itself\n",
+		       (float)work.mem / (2 * n));
+		tensorFree(T);
+	}
+	free(hits);
+	free(misses);
+	free(values);
+}
+
+// Contracts T with itself over the same mode of both, keeping the output
+// in T's storage type, and reports what it cost.
+static void benchContraction(Tensor * T, tMode_t mode) {
+	statsReset();
+	clock_t start = clock();
+	Tensor * C = tensorContract(T->type, T, T, mode, mode);
+	double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	Stats stats = statsGet();
+	printf("  mode %u: %lu RAM transactions, %lu node changes, %.1f ms, "
+	       "%lu nnz out\n",
+	       mode, stats.mem, stats.nodeChanges, 1e3 * seconds,
+	       C ? C->entryCount : 0);
+	tensorFree(C);
+}
+
+// Slices the last index of mode 0 out of an order-dimensional tensor of
+// length per mode, with keys that may use every bit so the slice ends at
+// the largest key there is. Two of the three entries are in the slice.
+static void checkLastSlice(tMode_t order, tCoord_t length) {
+	enum storageType types[] = {BPlusTree, sortedCOO, compressedSparseFiber,
+	                            probingHashtable};
+	const char * names[] = {"B+ tree", "sorted COO", "CSF", "hash table"};
+	tCoord_t shape[order];
+	tCoord_t coords[3 * order];
+	float values[3] = {1, 2, 3};
+	for (tMode_t m = 0; m < order; m++) {
+		shape[m] = length;
+		coords[m] = 0;
+		coords[order + m] = length - 1;
+		coords[2 * order + m] = m ? m % length : length - 1;
+	}
+	tCoord_t prefix[1] = {length - 1};
+	printf("  order %u, length %u:", order, length);
+	for (int i = 0; i < 4; i++) {
+		Tensor * T = tensorNew(types[i], order, shape);
+		Tensor * S = 0;
+		if (T && tensorBuild(T, 3, coords, values))
+			S = tensorSlice(types[i], T, prefix, 1);
+		printf("%s %s %lu", i ? "," : "", names[i], S ? S->entryCount : 0);
+		tensorFree(S);
+		tensorFree(T);
+	}
+	printf(" of 2 entries\n");
+}
+
+// Writes text to C.coo and reads it into every storage type, printing
+// how many entries each holds and what their values add up to
+static void checkTextRead(const char * text) {
+	const char * names[] = {"hash table", "B+ tree", "CSF", "sorted COO",
+	                        "swiss table", "Morton B+ tree", "concurrent"};
+	FILE * fp = fopen("C.coo", "w");
+	if (!fp || fputs(text, fp) < 0 || fclose(fp)) {
+		printf("  failed to write C.coo\n");
+		return;
+	}
+	for (int i = 0; i <= concurrentHashtable; i++) {
+		Tensor * T = tensorRead(i, "C.coo");
+		float sum = 0;
+		if (T) {
+			tensorIterator iter = tensorGetIterator(T);
+			void * context = iter.init(T);
+			for (tensorEntry item = iter.next(T, context); item.coords;
+			     item = iter.next(T, context))
+				sum += item.value;
+			iter.cleanup(context);
+		}
+		printf("  %s: %lu entries adding up to %g\n", names[i],
+		       T ? T->entryCount : 0, sum);
+		tensorFree(T);
+	}
+}
+
+// Writes infinities and a NaN between ordinary values as text and reads
+// them back, counting the entries that didn't come back the same
+static void checkSpecialValues() {
+	tCoord_t shape[1] = {5};
+	float values[5] = {1.5, INFINITY, -INFINITY, NAN, -2};
+	Tensor * T = tensorNew(sortedCOO, 1, shape);
+	Tensor * R = 0;
+	if (T) {
+		for (tCoord_t i = 0; i < 5; i++)
+			tensorSet(T, &i, values[i]);
+		if (tensorWrite(T, "C.coo", true))
+			R = tensorRead(sortedCOO, "C.coo");
+	}
+	size_t differ = 5;
+	if (R) {
+		differ = 0;
+		for (tCoord_t i = 0; i < 5; i++) {
+			float value = tensorGet(R, &i);
+			differ += value != values[i] && !(isnan(value) && isnan(values[i]));
+		}
+	}
+	printf("  %lu entries read back, %lu of 5 differ\n", R ? R->entryCount : 0,
+	       differ);
+	tensorFree(T);
+	tensorFree(R);
+}
+
+// Writes a tensor big enough to split into several read chunks, then
+// reads it back in parallel and serially and compares the two
+static void checkParallelRead() {
+	tCoord_t shape[3] = {200, 300, 400};
+	Tensor * T = tensorNew(probingHashtable, 3, shape);
+	if (!T)
+		return;
+	for (unsigned long i = 0; i < READ_CHECK_ENTRIES; i++) {
+		tCoord_t coords[3] = {i % 200, i / 200 % 300, i * 7919 % 400};
+		tensorSet(T, coords, (float)(i * 7919 % 100003 + 1) / 97);
+	}
+	bool written = tensorWrite(T, "C.coo", false);
+	tensorFree(T);
+	Tensor * P = written ? tensorReadParallel(BPlusTree, "C.coo", DEMO_THREADS)
+	                    : 0;
+	Tensor * R = written ? tensorRead(BPlusTree, "C.coo") : 0;
+	if (P && R) {
+		long size = 0;
+		FILE * fp = fopen("C.coo", "r");
+		if (fp && !fseek(fp, 0, SEEK_END))
+			size = ftell(fp);
+		if (fp)
+			fclose(fp);
+		size_t mismatches = P->entryCount != R->entryCount;
+		tensorIterator iter = tensorGetIterator(R);
+		void * context = iter.init(R);
+		for (tensorEntry item = iter.next(R, context); item.coords;
+		     item = iter.next(R, context))
+			mismatches += tensorGet(P, item.coords) != item.value;
+		iter.cleanup(context);
+		printf("  %li bytes, %lu entries, %lu differ from a serial read\n",
+		       size, P->entryCount, mismatches);
+	}
+	tensorFree(P);
+	tensorFree(R);
+}
+
+// Fills a tree one entry at a time, then deletes every entry and reports
+// what the tree holds on to
+static void checkDeleteShrinks(enum storageType type) {
+	tCoord_t shape[2] = {200, 300};
+	Tensor * T = tensorNew(type, 2, shape);
+	if (!T)
+		return;
+	for (unsigned long i = 0; i < SHRINK_CHECK_ENTRIES; i++) {
+		tCoord_t coords[2] = {i % 200, i / 200 % 300};
+		tensorSet(T, coords, 1);
+	}
+	size_t full = tensorSize(T);
+	size_t entries = T->entryCount;
+	for (unsigned long i = 0; i < SHRINK_CHECK_ENTRIES; i++) {
+		tCoord_t coords[2] = {i % 200, i / 200 % 300};
+		tensorDelete(T, coords);
+	}
+	bptPoolStats pool = bptGetPoolStats(T);
+	printf("  %lu B with %lu entries, %lu B and %lu B of pool slack with %lu\n",
+	       full, entries, tensorSize(T), pool.slack, T->entryCount);
+	tensorFree(T);
+}
+
+// Contracts T with itself on a, b serially and with threads threads, and
+// reports how many entries differ
+static void checkParallelContraction(Tensor * T, tMode_t a, tMode_t b,
+                                     unsigned int threads, bool deterministic) {
+	Tensor * R = tensorContract(T->type, T, T, a, b);
+	Tensor * P =
+	    tensorContractParallel(T->type, T, T, a, b, threads, deterministic);
+	printf("  %lu entries, %lu differ from tensorContract\n",
+	       P ? P->entryCount : 0, countDifferences(R, P));
+	tensorFree(R);
+	tensorFree(P);
+}
+
+// Contracts a 2 by SPLIT_CHECK_LENGTH matrix of integers with itself over
+// its long mode. The 2 by 2 output is smaller than the thread count, so
+// the threads split the contracted index and their partial sums are added
+// afterwards, which is exact for integers.
+static void checkSplitSum(unsigned int threads) {
+	tCoord_t shape[2] = {2, SPLIT_CHECK_LENGTH};
+	Tensor * M = tensorNew(BPlusTree, 2, shape);
+	if (!M)
+		return;
+	for (tCoord_t i = 0; i < 2 * SPLIT_CHECK_LENGTH; i++) {
+		tCoord_t coords[2] = {i % 2, i / 2};
+		tensorSet(M, coords, (i * 7919 % 13) - 6.0f);
+	}
+	checkParallelContraction(M, 1, 1, threads, false);
+	tensorFree(M);
+}
+
+// Traces T over every pair of modes with both tensorTrace and
+// tensorTraceSparse and prints the entries compared and how many differ.
+static void checkSparseTrace(enum storageType type, Tensor * T) {
+	if (!T) {
+		printf("no tensor\n");
+		return;
+	}
+	size_t entries = 0, differences = 0;
+	for (tMode_t a = 0; a < T->order; a++)
+		for (tMode_t b = a + 1; b < T->order; b++) {
+			Tensor * R = tensorTrace(type, T, a, b);
+			Tensor * S = tensorTraceSparse(type, T, a, b);
+			entries += S ? S->entryCount : 0;
+			differences += countDifferences(R, S);
+			tensorFree(R);
+			tensorFree(S);
+		}
+	printf("%lu entries, %lu differ\n", entries, differences);
+}
+
+// Fills a cube of the given order and side length with integer values at
+// roughly a third of the coordinates, scattered like generator.py does.
+static Tensor * generateCube(enum storageType type, tMode_t order,
+                             tCoord_t length) {
+	tCoord_t shape[4] = {length, length, length, length};
+	Tensor * T = tensorNew(type, order, shape);
+	if (!T)
+		return 0;
+	size_t volume = 1;
+	for (tMode_t m = 0; m < order; m++)
+		volume *= length;
+	tCoord_t coords[4];
+	for (size_t i = 0; i < volume; i++) {
+		if (i * 7919 % 3)
+			continue;
+		size_t rest = i;
+		for (tMode_t m = order; m-- > 0; rest /= length)
+			coords[m] = rest % length;
+		tensorSet(T, coords, i * 31 % 50 + 1);
+	}
+	return T;
+}
+
+// Checks "ijk,jkl->il" on X against contracting j and then tracing out
+// the two k modes of the result. Integer values keep every order of
+// summing exact.
+static void checkEinsum(Tensor * X) {
+	if (X->order != 3)
+		return;
+	tCoord_t shape[3] = {X->shape[1], X->shape[2], 7};
+	Tensor * Y = tensorNew(probingHashtable, 3, shape);
+	if (!Y)
+		return;
+	tCoord_t c[3];
+	for (c[0] = 0; c[0] < shape[0]; c[0]++)
+		for (c[1] = 0; c[1] < shape[1]; c[1]++)
+			for (c[2] = 0; c[2] < shape[2]; c[2]++)
+				if ((c[0] * 7 + c[1] * 3 + c[2]) % 4 == 0)
+					tensorSet(Y, c, (c[0] + c[1] + c[2]) % 9 + 1);
+
+	Tensor * XY = tensorContract(probingHashtable, X, Y, 1, 0); // i k k l
+	Tensor * R = XY ? tensorTrace(probingHashtable, XY, 1, 2) : 0;
+	tMode_t aModes[2] = {1, 2};
+	tMode_t bModes[2] = {0, 1};
+	Tensor * results[3] = {
+	    tensorEinsum(probingHashtable, "ijk,jkl->il", X, Y),
+	    tensorEinsum(probingHashtable, "ijk,jkl", X, Y),
+	    tensorContractModes(probingHashtable, X, Y, 2, aModes, bModes),
+	};
+	const char * names[3] = {"einsum ijk,jkl->il", "einsum ijk,jkl",
+	                         "contract modes 1, 2 with 0, 1"};
+	for (int i = 0; i < 3; i++) {
+		printf("  %s: %lu entries, %lu differ\n", names[i],
+		       results[i] ? results[i]->entryCount : 0,
+		       countDifferences(R, results[i]));
+		tensorFree(results[i]);
+	}
+	tensorFree(XY);
+	tensorFree(R);
+	tensorFree(Y);
+}
+
+typedef struct stressJob {
+	Tensor * T;
+	unsigned long offset;
+} stressJob;
+
+// the i-th coordinates of the sequence every stress thread adds 1 to
+static void stressCoords(Tensor * T, unsigned long i, tCoord_t * coords) {
+	coords[0] = (i * 7919) % T->shape[0];
+	coords[1] = (i * 104729) % T->shape[1];
+}
+
+// Each thread adds the whole sequence, starting at its own offset, so
+// they keep colliding on the same entries and growing the table at once.
+static void * stressWork(void * arg) {
+	stressJob * job = arg;
+	tCoord_t coords[2];
+	for (unsigned long i = 0; i < STRESS_ADDS; i++) {
+		stressCoords(job->T, (job->offset + i) % STRESS_ADDS, coords);
+		tensorAdd(job->T, coords, 1);
+	}
+	return 0;
+}
+
+// Checks every entry of the concurrent table against a serial count
+static void stressConcurrent() {
+	tCoord_t shape[2] = {97, 89};
+	Tensor * T = tensorNew(concurrentHashtable, 2, shape);
+	Tensor * R = tensorNew(probingHashtable, 2, shape);
+	if (!T || !R) {
+		tensorFree(T);
+		tensorFree(R);
+		return;
+	}
+	pthread_t ids[STRESS_THREADS];
+	stressJob jobs[STRESS_THREADS];
+	for (int t = 0; t < STRESS_THREADS; t++) {
+		jobs[t] = (stressJob){.T = T, .offset = t * STRESS_ADDS / STRESS_THREADS};
+		pthread_create(&ids[t], 0, stressWork, &jobs[t]);
+	}
+	for (int t = 0; t < STRESS_THREADS; t++)
+		pthread_join(ids[t], 0);
+
+	tCoord_t coords[2];
+	for (unsigned long i = 0; i < STRESS_ADDS; i++) {
+		stressCoords(R, i, coords);
+		tensorAdd(R, coords, STRESS_THREADS);
+	}
+	size_t mismatches = T->entryCount != R->entryCount;
+	tensorIterator iter = tensorGetIterator(R);
+	void * context = iter.init(R);
+	tensorEntry item = iter.next(R, context);
+	while (item.coords != 0) {
+		if (tensorGet(T, item.coords) != item.value)
+			mismatches++;
+		item = iter.next(R, context);
+	}
+	iter.cleanup(context);
+	printf("  %i threads, %i adds each, %lu entries, %lu mismatches\n",
+	       STRESS_THREADS, STRESS_ADDS, T->entryCount, mismatches);
+	tensorFree(T);
+	tensorFree(R);
+}
 
 int main(int argc, char ** argv) {
 	statsReset();
 	printf("Input tensor A:\n");
-	Tensor * A = tensorRead(BPlusTree, "../B.coo");
+	Tensor * A = tensorReadParallel(BPlusTree, "../B.coo", DEMO_THREADS);
 	tensorPrintMetadata(A);
 	statsPrint(statsGet());
 
@@ -18,10 +473,31 @@ int main(int argc, char ** argv) {
 	tensorPrintMetadata(B);
 	statsPrint(statsGet());
 
-	if (!A || !B) {
+	statsReset();
+	printf("\nInput tensor F:\n");
+	Tensor * F = tensorRead(compressedSparseFiber, "../B.coo");
+	tensorPrintMetadata(F);
+	statsPrint(statsGet());
+
+	statsReset();
+	printf("\nInput tensor S:\n");
+	Tensor * S = tensorRead(sortedCOO, "../B.coo");
+	tensorPrintMetadata(S);
+	statsPrint(statsGet());
+
+	statsReset();
+	printf("\nInput tensor W:\n");
+	Tensor * W = tensorRead(swissHashtable, "../B.coo");
+	tensorPrintMetadata(W);
+	statsPrint(statsGet());
+
+	if (!A || !B || !F || !S || !W) {
 		printf("Error. Exiting.\n");
 		tensorFree(A);
 		tensorFree(B);
+		tensorFree(F);
+		tensorFree(S);
+		tensorFree(W);
 		return 1;
 	}
 	Tensor * C = {0};
@@ -55,7 +531,6 @@ int main(int argc, char ** argv) {
 	C = tensorTrace(BPlusTree, A, 0, 1);
 	tensorPrintMetadata(C);
 	statsPrint(statsGet());
-	ht_capacity = C->entryCount;
 	tensorFree(C);
 
 	printf("\nTrace B with 0, 1 yields\n");
@@ -77,8 +552,8 @@ int main(int argc, char ** argv) {
 	tensorPrintMetadata(C);
 	Stats bptStats = statsGet();
 	size_t bptSize = tensorSize(C);
+	size_t outputCount = C->entryCount;
 	statsPrint(bptStats);
-	ht_capacity = C->entryCount;
 	tensorFree(C);
 
 	printf("\nContraction on 0, 1 yields\n");
@@ -90,6 +565,234 @@ int main(int argc, char ** argv) {
 	statsPrint(htStats);
 	tensorFree(C);
 
+	printf("\nContraction on 0, 1 with %i threads yields\n", DEMO_THREADS);
+	statsReset();
+	C = tensorContractParallel(BPlusTree, A, A, 0, 1, DEMO_THREADS, true);
+	tensorPrintMetadata(C);
+	statsPrint(statsLastOperation);
+	tensorFree(C);
+	checkParallelContraction(A, 0, 1, DEMO_THREADS, true);
+
+	printf("\nContraction of a 2 by %i matrix over its long mode with %i "
+	       "threads\nsplitting the sum yields\n",
+	       SPLIT_CHECK_LENGTH, STRESS_THREADS);
+	checkSplitSum(STRESS_THREADS);
+
+	// every thread's lookups in A are charged to the same stats
+	printf("\nWork charged to A by contraction on 0, 1 with 1 and %i threads:\n",
+	       STRESS_THREADS);
+	Stats serialWork = {0};
+	Stats parallelWork = {0};
+	A->stats = &serialWork;
+	tensorFree(tensorContract(BPlusTree, A, A, 0, 1));
+	A->stats = &parallelWork;
+	tensorFree(
+	    tensorContractParallel(BPlusTree, A, A, 0, 1, STRESS_THREADS, true));
+	A->stats = 0;
+	printf("  %lu and %lu RAM transactions\n", serialWork.mem,
+	       parallelWork.mem);
+
+	printf("\nContraction on 0, 1 with %i threads into concurrent hash table "
+	       "yields\n", DEMO_THREADS);
+	statsReset();
+	C = tensorContractParallel(concurrentHashtable, B, B, 0, 1, DEMO_THREADS,
+	                           true);
+	tensorPrintMetadata(C);
+	statsPrint(statsGet());
+	tensorFree(C);
+
+	printf("\nSparse trace against tensorTrace over every pair of modes:\n");
+	enum storageType traceTypes[2] = {BPlusTree, probingHashtable};
+	const char * traceNames[2] = {"B+ tree", "hashtable"};
+	for (int t = 0; t < 2; t++) {
+		Tensor * T = tensorRead(traceTypes[t], "../T.coo");
+		printf("  %s, T.coo: ", traceNames[t]);
+		checkSparseTrace(traceTypes[t], T);
+		tensorFree(T);
+		for (tMode_t order = 2; order <= 4; order++) {
+			T = generateCube(traceTypes[t], order, 9);
+			printf("  %s, order %u cube: ", traceNames[t], (unsigned)order);
+			checkSparseTrace(traceTypes[t], T);
+			tensorFree(T);
+		}
+	}
+
+	printf("\nTwo-pair contractions of A with a 20x15x7 tensor checked against "
+	       "contraction\nthen trace:\n");
+	checkEinsum(A);
+
+	printf("\nSparse-driven contraction on 0, 1 yields\n");
+	statsReset();
+	C = tensorContractSparse(BPlusTree, A, A, 0, 1);
+	tensorPrintMetadata(C);
+	statsPrint(statsGet());
+	tensorFree(C);
+
+	printf("\nSparse-driven contraction on 0, 1 yields\n");
+	statsReset();
+	C = tensorContractSparse(probingHashtable, B, B, 0, 1);
+	tensorPrintMetadata(C);
+	statsPrint(statsGet());
+	tensorFree(C);
+
+	printf("\nSparse-driven contraction of CSF input on 0, 1 yields\n");
+	statsReset();
+	C = tensorContractSparse(probingHashtable, F, F, 0, 1);
+	tensorPrintMetadata(C);
+	statsPrint(statsGet());
+	tensorFree(C);
+
+	printf("\nSparse-driven contraction of sorted COO input on 0, 1 yields\n");
+	statsReset();
+	C = tensorContractSparse(probingHashtable, S, S, 0, 1);
+	tensorPrintMetadata(C);
+	statsPrint(statsGet());
+	tensorFree(C);
+
+	printf("\nSparse-driven contraction into swiss table on 0, 1 yields\n");
+	statsReset();
+	C = tensorContractSparse(swissHashtable, W, W, 0, 1);
+	tensorPrintMetadata(C);
+	statsPrint(statsGet());
+	tensorFree(C);
+
+	putchar('\n');
+	for (int i = 0; i < 80; i++)
+		putchar('-');
+	putchar('\n');
+
+	tCoord_t slicePrefix[1] = {0};
+	printf("\nSlice of B+ tree input at mode 0 = 0 yields\n");
+	statsReset();
+	C = tensorSlice(BPlusTree, A, slicePrefix, 1);
+	tensorPrintMetadata(C);
+	statsPrint(statsGet());
+	tensorFree(C);
+
+	printf("\nSlice of hash table input at mode 0 = 0 yields\n");
+	statsReset();
+	C = tensorSlice(probingHashtable, B, slicePrefix, 1);
+	tensorPrintMetadata(C);
+	statsPrint(statsGet());
+	tensorFree(C);
+
+	printf("\nSlice at the last index of mode 0 with every key bit used:\n");
+	checkLastSlice(4, 65536);
+	checkLastSlice(8, 256);
+
+	putchar('\n');
+	for (int i = 0; i < 80; i++)
+		putchar('-');
+	putchar('\n');
+
+	printf("\nText read with %i threads in chunks of at least %i bytes:\n",
+	       DEMO_THREADS, TENSOR_READ_MIN_CHUNK);
+	checkParallelRead();
+
+	printf("\nText without a newline after the last entry, 3 entries adding "
+	       "up to 6:\n");
+	checkTextRead("order: 2\nshape: 3, 3\nvalues:\n0, 0, 1.0\n1, 1, 2.0\n"
+	              "2, 2, 3.0");
+
+	printf("\nText with a malformed line between 3 entries adding up to 6:\n");
+	checkTextRead("order: 2\nshape: 3, 3\nvalues:\n0, 0, 1.0\n1, x, 2.0\n"
+	              "1, 1, 2.0\n2, 2, 3.0\n");
+
+	printf("\nText with a line outside the shape between 3 entries adding up "
+	       "to 6:\n");
+	checkTextRead("order: 2\nshape: 3, 3\nvalues:\n0, 0, 1.0\n1, 3, 2.0\n"
+	              "1, 1, 2.0\n2, 2, 3.0\n");
+
+	printf("\nInfinities and NaN written as text and read back:\n");
+	checkSpecialValues();
+
+	printf("\nSorted COO input written as binary and mapped back yields\n");
+	statsReset();
+	Tensor * M = 0;
+	bool written = tensorWriteBinary(S, "B.tns", true);
+	if (written)
+		M = tensorReadBinary(sortedCOO, "B.tns");
+	tensorPrintMetadata(M);
+	statsPrint(statsGet());
+	if (M) {
+		size_t mismatches = 0;
+		tensorIterator iter = tensorGetIterator(A);
+		void * context = iter.init(A);
+		for (tensorEntry item = iter.next(A, context); item.coords;
+		     item = iter.next(A, context))
+			mismatches += tensorGet(M, item.coords) != item.value;
+		iter.cleanup(context);
+		printf("  %lu of %lu entries differ from the text input\n", mismatches,
+		       A->entryCount);
+		tensorFree(M);
+	}
+
+	printf("\nStreaming contraction of B.tns on 0, 1 within %i bytes yields\n",
+	       STREAM_BUDGET);
+	statsReset();
+	C = 0;
+	if (written && tensorContractStream("C.tns", "B.tns", B, 0, 1, STREAM_BUDGET))
+		C = tensorReadBinary(sortedCOO, "C.tns");
+	tensorPrintMetadata(C);
+	statsPrint(statsGet());
+	if (C) {
+		Tensor * R = tensorContractSparse(probingHashtable, S, S, 0, 1);
+		size_t mismatches = R ? R->entryCount != C->entryCount : 1;
+		tensorIterator iter = tensorGetIterator(C);
+		void * context = iter.init(C);
+		for (tensorEntry item = iter.next(C, context); R && item.coords;
+		     item = iter.next(C, context))
+			mismatches += tensorGet(R, item.coords) != item.value;
+		iter.cleanup(context);
+		printf("  %lu differences from the in-memory contraction\n",
+		       mismatches);
+		tensorFree(R);
+		tensorFree(C);
+	}
+
+	putchar('\n');
+	for (int i = 0; i < 80; i++)
+		putchar('-');
+	putchar('\n');
+
+	Tensor * Z = tensorRead(mortonBPlusTree, "../B.coo");
+	if (Z) {
+		printf("\nContraction of B+ tree input over each mode:\n");
+		for (tMode_t mode = 0; mode < A->order; mode++)
+			benchContraction(A, mode);
+		printf("\nContraction of Morton B+ tree input over each mode:\n");
+		for (tMode_t mode = 0; mode < Z->order; mode++)
+			benchContraction(Z, mode);
+		tensorFree(Z);
+
+		putchar('\n');
+		for (int i = 0; i < 80; i++)
+			putchar('-');
+		putchar('\n');
+	}
+
+	printf("\nB+ tree emptied by deleting every entry:\n");
+	checkDeleteShrinks(BPlusTree);
+	printf("\nMorton B+ tree emptied by deleting every entry:\n");
+	checkDeleteShrinks(mortonBPlusTree);
+
+	putchar('\n');
+	for (int i = 0; i < 80; i++)
+		putchar('-');
+	putchar('\n');
+
+	printf("\nConcurrent hash table stress test:\n");
+	stressConcurrent();
+
+	putchar('\n');
+	for (int i = 0; i < 80; i++)
+		putchar('-');
+	putchar('\n');
+
+	printf("\nLookups in hash tables of %i slots, each filled to its max load:\n",
+	       LOOKUP_SLOTS);
+	checkLookups();
+
 	putchar('\n');
 	for (int i = 0; i < 80; i++)
 		putchar('-');
@@ -99,7 +802,7 @@ int main(int argc, char ** argv) {
 	printf("  B+ tree branching factor: %i\n", BPT_ORDER);
 	printf("  Hash table overprovision factor: %0.2f\n", HT_OVERPROVISION);
 	printf("  Input tensor size: %lu nnz\n", A->entryCount);
-	printf("  Output tensor size: %lu nnz\n\n", ht_capacity);
+	printf("  Output tensor size: %lu nnz\n\n", outputCount);
 
 	puts("B+ Tree performance compared to hash table:");
 	printf("  RAM transactions: %0.2f%%\n",
@@ -111,5 +814,8 @@ int main(int argc, char ** argv) {
 
 	tensorFree(A);
 	tensorFree(B);
+	tensorFree(F);
+	tensorFree(S);
+	tensorFree(W);
 	return 0;
 }
@@ -1,6 +1,7 @@
 #!/usr/bin/env python3
 import subprocess
 import os
+import json
 import matplotlib.pyplot as plt
 
 # branching factor, overprovision factor, RAM portion, storage portion
@@ -16,7 +17,6 @@ os.system("../generator.py .5 10 10 10 10 > ../B.coo")
 print("running tests...")
 
 comment = ""
-lines = []
 runs = []
 # with open("test-data.pyobj", "r") as f:
 #     comment = str(f.readline())
@@ -24,23 +24,28 @@ runs = []
 if not runs:
     for order in orders:
         for overprov in overprovs:
-            cmd = f"gcc -DBPT_ORDER={order} -DHT_OVERPROVISION={overprov} *.c"
-            print(cmd[4:-4])
-            os.system(cmd)
-            output = subprocess.check_output("./a.out", shell=True)
-            lines = output.split(b'\n')
+            flags = f"-DBPT_ORDER={order} -DHT_OVERPROVISION={overprov}"
+            print(flags)
+            os.system(f"make -B bench CFLAGS='{flags} -pthread'")
+            output = subprocess.check_output(
+                "./bench -i ../B.coo -t bptree,hashtable -o contract -m 0:1"
+                " -r 1 -w 0", shell=True)
+            report = json.loads(output)
+            results = {r["storage"]: r for r in report["results"]}
+            bpt, ht = results["bptree"], results["hashtable"]
             runs.append({
-                "branching": int(lines[-10].split(b' ')[-1]),
-                "overprovision": float(lines[-9].split(b' ')[-1]),
-                "RAM": float(lines[-4].split(b' ')[-1][:-1])/100.0,
-                "size": float(lines[-2].split(b' ')[-1][:-1])/100.0
+                "branching": report["config"]["bpt_order"],
+                "overprovision": report["config"]["ht_overprovision"],
+                "RAM": bpt["stats"]["mem"] / ht["stats"]["mem"],
+                "size": bpt["output_bytes"] / ht["output_bytes"]
             })
             if runs[-1]["branching"] != order:
                 print("what1")
             if runs[-1]["overprovision"] != overprov:
                 print("what2")
-    os.system("rm a.out")
-    comment = ", ".join([x.decode().strip() for x in lines[-8:-6]])
+    os.system("rm bench")
+    comment = (f"Input tensor size: {report['input']['nnz']} nnz, "
+               f"Output tensor size: {bpt['output_nnz']} nnz")
 with open("test-data.pyobj", "w") as f:
     f.write(comment+"\n")
     f.write(str(runs))
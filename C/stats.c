@@ -1,21 +1,124 @@
 #include "stats.h"
+#include <stdbool.h>
 #include <stdio.h>
+#include <time.h>
+#if defined(STATS_PERF) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
-Stats statsGlobal = {0};
+_Thread_local Stats statsGlobal = {0};
+_Thread_local Stats statsLastOperation = {0};
 
 void statsReset() {
-	statsGlobal.mem = 0;
-	statsGlobal.add = 0;
-	statsGlobal.mul = 0;
-	statsGlobal.cmp = 0;
+	statsGlobal = (Stats){0};
 }
 
 Stats statsGet() {
 	// just copy the global stats so they can be reset
-	return (Stats){.mem = statsGlobal.mem,
-	               .add = statsGlobal.add,
-	               .mul = statsGlobal.mul,
-	               .cmp = statsGlobal.cmp};
+	return statsGlobal;
+}
+
+void statsAdd(Stats stats) {
+	statsAccumulate(&statsGlobal, stats);
+}
+
+void statsAccumulate(Stats * into, Stats stats) {
+	into->mem += stats.mem;
+	into->add += stats.add;
+	into->mul += stats.mul;
+	into->cmp += stats.cmp;
+	into->nodeChanges += stats.nodeChanges;
+	into->seconds += stats.seconds;
+	into->instructions += stats.instructions;
+	into->cacheMisses += stats.cacheMisses;
+}
+
+void statsAccumulateShared(Stats * into, Stats stats) {
+	__atomic_fetch_add(&into->mem, stats.mem, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&into->add, stats.add, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&into->mul, stats.mul, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&into->cmp, stats.cmp, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&into->nodeChanges, stats.nodeChanges,
+	                   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&into->instructions, stats.instructions,
+	                   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&into->cacheMisses, stats.cacheMisses,
+	                   __ATOMIC_RELAXED);
+	// no atomic add for doubles, so swap in the sum until nobody else has
+	double old;
+	__atomic_load(&into->seconds, &old, __ATOMIC_RELAXED);
+	double new;
+	do {
+		new = old + stats.seconds;
+	} while (!__atomic_compare_exchange(&into->seconds, &old, &new, true,
+	                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+Stats statsSince(Stats start) {
+	Stats stats = statsGlobal;
+	stats.mem -= start.mem;
+	stats.add -= start.add;
+	stats.mul -= start.mul;
+	stats.cmp -= start.cmp;
+	stats.nodeChanges -= start.nodeChanges;
+	stats.seconds -= start.seconds;
+	stats.instructions -= start.instructions;
+	stats.cacheMisses -= start.cacheMisses;
+	return stats;
+}
+
+#if defined(STATS_PERF) && defined(__linux__)
+// Counts one hardware event for this thread in user space, including
+// threads it creates while open. Returns -1 if the kernel won't allow it.
+static int _perfOpen(unsigned long long config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// closes the event and returns its count, or 0 if it never opened
+static unsigned long _perfClose(int fd) {
+	unsigned long long count = 0;
+	if (fd < 0)
+		return 0;
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		count = 0;
+	close(fd);
+	return count;
+}
+#endif
+
+void statsBegin(statsProbe * probe) {
+	probe->start = statsGet();
+	probe->instructions = -1;
+	probe->cacheMisses = -1;
+#if defined(STATS_PERF) && defined(__linux__)
+	probe->instructions = _perfOpen(PERF_COUNT_HW_INSTRUCTIONS);
+	probe->cacheMisses = _perfOpen(PERF_COUNT_HW_CACHE_MISSES);
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &probe->time);
+}
+
+Stats statsEnd(statsProbe * probe) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	Stats stats = statsSince(probe->start);
+	stats.seconds = (now.tv_sec - probe->time.tv_sec) +
+	                (now.tv_nsec - probe->time.tv_nsec) / 1e9;
+#if defined(STATS_PERF) && defined(__linux__)
+	stats.instructions = _perfClose(probe->instructions);
+	stats.cacheMisses = _perfClose(probe->cacheMisses);
+#endif
+	return stats;
 }
 
 void statsPrint(Stats stats) {
@@ -26,4 +129,12 @@ void statsPrint(Stats stats) {
 	printf("        - ADD: %lu\n", stats.add);
 	printf("        - MUL: %lu\n", stats.mul);
 	printf("        - CMP: %lu\n", stats.cmp);
+	if (stats.nodeChanges)
+		printf("    Node changes:     %lu\n", stats.nodeChanges);
+	if (stats.seconds)
+		printf("    Wall time:        %.3f ms\n", stats.seconds * 1e3);
+	if (stats.instructions)
+		printf("    Instructions:     %lu\n", stats.instructions);
+	if (stats.cacheMisses)
+		printf("    Cache misses:     %lu\n", stats.cacheMisses);
 }
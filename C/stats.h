@@ -1,14 +1,52 @@
 #pragma once
+#include <time.h>
 
+// Counts of the work a cost model charges, and what a statsProbe measured
+// around it. Time and hardware counters stay 0 where nothing measured them.
 typedef struct Stats {
 	unsigned long mem;
 	unsigned long add;
 	unsigned long mul;
 	unsigned long cmp;
+	// fetches of a different node than the last lookup on the thread
+	// reached at that depth, which a cache of that path would miss
+	unsigned long nodeChanges;
+	double seconds;
+	unsigned long instructions;
+	unsigned long cacheMisses;
 } Stats;
 
-extern Stats statsGlobal;
+// each thread counts its own work, see statsAdd for merging it
+extern _Thread_local Stats statsGlobal;
+
+// Building with -DTENSOR_NO_STATS compiles every count away
+#ifdef TENSOR_NO_STATS
+#define STATS_COUNT(field, n) ((void)0)
+#else
+#define STATS_COUNT(field, n) (statsGlobal.field += (n))
+#endif
 
 void statsReset();
 Stats statsGet();
+void statsAdd(Stats stats); // fold in counts from another thread
+void statsAccumulate(Stats * into, Stats stats);
+// statsAccumulate for Stats that many threads add to at once
+void statsAccumulateShared(Stats * into, Stats stats);
+Stats statsSince(Stats start); // what this thread counted after start
 void statsPrint(Stats stats);
+
+// Measures the work between statsBegin and statsEnd on this thread, with
+// the wall-clock time. Built with -DSTATS_PERF on Linux it also reads
+// perf_event_open counters, which include threads started in between.
+typedef struct statsProbe {
+	Stats start;
+	struct timespec time;
+	int instructions; // perf event descriptors, -1 if not open
+	int cacheMisses;
+} statsProbe;
+
+void statsBegin(statsProbe * probe);
+Stats statsEnd(statsProbe * probe);
+
+// what the last trace or contraction on this thread measured
+extern _Thread_local Stats statsLastOperation;
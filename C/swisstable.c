@@ -0,0 +1,434 @@
+#include "swisstable.h"
+#include "stats.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef tKey_t swKey_t;
+typedef signed char swCtrl_t;
+typedef unsigned int swMask_t; // bit i set = slot i of the group matched
+
+const size_t _sweSize = sizeof(float) + sizeof(swKey_t) + sizeof(swCtrl_t);
+
+// A full slot's control byte is the low 7 bits of its hash, so the sign
+// bit alone tells full from free. Deleted slots keep probes going past
+// them, where an empty slot would stop them.
+#define SW_EMPTY ((swCtrl_t)-128)
+#define SW_DELETED ((swCtrl_t)-2)
+
+// Slots are split into groups of SW_GROUP_WIDTH. A key hashes to a home
+// group and probes whole groups from there, and its control byte lets
+// the probe skip every slot whose fingerprint differs without touching
+// the keys array.
+typedef struct Swisstable {
+	size_t capacity;
+	size_t tombstones; // deleted slots, which count toward the load
+	swCtrl_t * ctrl;
+	swKey_t * keys;
+	float * values;
+} Swisstable;
+
+#ifdef __SSE2__
+// SSE2 is part of x86-64, so this path needs no runtime check
+#include <emmintrin.h>
+static swMask_t _match(const swCtrl_t * group, swCtrl_t byte) {
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(byte)));
+}
+
+// slots that are empty or deleted, i.e. have the sign bit set
+static swMask_t _matchFree(const swCtrl_t * group) {
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+	return _mm_movemask_epi8(ctrl);
+}
+#else
+// Portable fallback: compare 8 control bytes at a time inside a word.
+static swMask_t _match(const swCtrl_t * group, swCtrl_t byte) {
+	swMask_t mask = 0;
+	for (int half = 0; half < SW_GROUP_WIDTH / 8; half++) {
+		uint64_t word = 0;
+		for (int i = 0; i < 8; i++)
+			word |= (uint64_t)(unsigned char)group[half * 8 + i] << (i * 8);
+		uint64_t x = word ^ (0x0101010101010101ULL * (unsigned char)byte);
+		// high bit of each byte set where that byte of x is zero
+		x = ~((((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | x) |
+		      0x7f7f7f7f7f7f7f7fULL);
+		for (int i = 0; i < 8; i++)
+			if (x >> (i * 8 + 7) & 1)
+				mask |= 1u << (half * 8 + i);
+	}
+	return mask;
+}
+
+static swMask_t _matchFree(const swCtrl_t * group) {
+	swMask_t mask = 0;
+	for (int i = 0; i < SW_GROUP_WIDTH; i++)
+		if (group[i] < 0)
+			mask |= 1u << i;
+	return mask;
+}
+#endif
+
+// Murmur3 finalizer, same as the probing hashtable. The low 7 bits become
+// the fingerprint and the rest pick the home group.
+static size_t _hash(swKey_t key) {
+	STATS_COUNT(mul, 2); // counting hash as MUL
+	unsigned long long h = key;
+#ifdef TENSOR_WIDE_KEYS
+	h ^= key >> 64;
+#endif
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static bool _slotsNew(Swisstable * st, size_t capacity) {
+	st->ctrl = malloc(capacity * sizeof(swCtrl_t));
+	st->keys = malloc(capacity * sizeof(swKey_t));
+	st->values = malloc(capacity * sizeof(float));
+	if (!st->ctrl || !st->keys || !st->values) {
+		free(st->ctrl);
+		free(st->keys);
+		free(st->values);
+		*st = (Swisstable){0};
+		return false;
+	}
+	for (size_t i = 0; i < capacity; i++)
+		st->ctrl[i] = SW_EMPTY;
+	st->capacity = capacity;
+	st->tombstones = 0;
+	return true;
+}
+
+static void _slotsFree(Swisstable * st) {
+	free(st->ctrl);
+	free(st->keys);
+	free(st->values);
+	*st = (Swisstable){0};
+}
+
+void * swNew() {
+	Swisstable * st = calloc(1, sizeof(Swisstable));
+	if (!st)
+		return 0;
+	if (!_slotsNew(st, SW_INITIAL_CAPACITY)) {
+		free(st);
+		return 0;
+	}
+	return st;
+}
+
+void swFree(Tensor * T) {
+	if (!T || !T->values)
+		return;
+	Swisstable * st = T->values;
+	_slotsFree(st);
+	T->values = 0;
+	free(st);
+}
+
+// Groups are visited at triangular offsets from home, which reaches every
+// group once when the group count is a power of two.
+// Returns the slot holding key, or the capacity if it's absent.
+static size_t _find(Swisstable * st, swKey_t key, size_t hash) {
+	swCtrl_t fingerprint = hash & 0x7f;
+	size_t groupMask = st->capacity / SW_GROUP_WIDTH - 1;
+	size_t g = (hash >> 7) & groupMask;
+	for (size_t step = 1;; step++) {
+		swCtrl_t * group = &st->ctrl[g * SW_GROUP_WIDTH];
+		STATS_COUNT(mem, 1); // one load covers the whole group
+		STATS_COUNT(cmp, 1);
+		for (swMask_t m = _match(group, fingerprint); m; m &= m - 1) {
+			size_t i = g * SW_GROUP_WIDTH + __builtin_ctz(m);
+			STATS_COUNT(mem, 1);
+			STATS_COUNT(cmp, 1);
+			if (st->keys[i] == key)
+				return i;
+		}
+		// an empty slot means the key would have been placed here
+		STATS_COUNT(cmp, 1);
+		if (_match(group, SW_EMPTY))
+			return st->capacity;
+		STATS_COUNT(add, 1);
+		g = (g + step) & groupMask;
+	}
+}
+
+// insertion of a key that isn't in the table yet, into the first free
+// slot along its probe sequence
+static void _insert(Swisstable * st, swKey_t key, float value) {
+	size_t hash = _hash(key);
+	size_t groupMask = st->capacity / SW_GROUP_WIDTH - 1;
+	size_t g = (hash >> 7) & groupMask;
+	for (size_t step = 1;; step++) {
+		STATS_COUNT(mem, 1);
+		STATS_COUNT(cmp, 1);
+		swMask_t avail = _matchFree(&st->ctrl[g * SW_GROUP_WIDTH]);
+		if (avail) {
+			size_t i = g * SW_GROUP_WIDTH + __builtin_ctz(avail);
+			if (st->ctrl[i] == SW_DELETED)
+				st->tombstones--;
+			st->ctrl[i] = hash & 0x7f;
+			st->keys[i] = key;
+			st->values[i] = value;
+			STATS_COUNT(mem, 1);
+			return;
+		}
+		STATS_COUNT(add, 1);
+		g = (g + step) & groupMask;
+	}
+}
+
+// Rehash everything into `capacity` slots at once, dropping tombstones.
+// The load limit keeps this rare enough that it isn't spread out like
+// the probing hashtable's.
+static bool _rehash(Swisstable * st, size_t capacity) {
+	Swisstable old = *st;
+	if (!_slotsNew(st, capacity)) {
+		*st = old;
+		return false;
+	}
+	for (size_t i = 0; i < old.capacity; i++) {
+		STATS_COUNT(mem, 1);
+		if (old.ctrl[i] >= 0)
+			_insert(st, old.keys[i], old.values[i]);
+	}
+	_slotsFree(&old);
+	return true;
+}
+
+bool swReserve(Tensor * T, size_t count) {
+	if (!T || !T->values)
+		return false;
+	Swisstable * st = T->values;
+	size_t capacity = st->capacity;
+	while (count > capacity * SW_MAX_LOAD)
+		capacity *= 2;
+	if (capacity == st->capacity)
+		return true;
+	return _rehash(st, capacity);
+}
+
+// swSet for a key whose hash is already known
+static bool _set(Tensor * T, swKey_t key, size_t hash, float value) {
+	Swisstable * st = T->values;
+	size_t i = _find(st, key, hash);
+	if (i != st->capacity) {
+		st->values[i] = value;
+		STATS_COUNT(mem, 1); // store new value
+		return true;
+	}
+
+	// it's a new key, so make sure the load factor stays in bounds.
+	// If it's mostly tombstones, clearing them out is enough.
+	STATS_COUNT(mul, 1);
+	STATS_COUNT(cmp, 1);
+	if (T->entryCount + st->tombstones + 1 > st->capacity * SW_MAX_LOAD) {
+		size_t capacity = st->capacity;
+		STATS_COUNT(cmp, 1);
+		if (2 * (T->entryCount + 1) > capacity * SW_MAX_LOAD)
+			capacity *= 2;
+		if (!_rehash(st, capacity))
+			return false;
+	}
+	_insert(st, key, value);
+	T->entryCount++;
+	return true;
+}
+
+// Removes key if it's there. A slot only has to become a tombstone if
+// its group is full: a group with an empty slot already stops every
+// probe that reaches it, so the slot can go straight back to empty.
+static bool _delete(Tensor * T, swKey_t key, size_t hash) {
+	Swisstable * st = T->values;
+	size_t i = _find(st, key, hash);
+	if (i == st->capacity)
+		return true;
+	STATS_COUNT(cmp, 1);
+	if (_match(&st->ctrl[i - i % SW_GROUP_WIDTH], SW_EMPTY)) {
+		st->ctrl[i] = SW_EMPTY;
+	} else {
+		st->ctrl[i] = SW_DELETED;
+		st->tombstones++;
+	}
+	STATS_COUNT(mem, 1);
+	T->entryCount--;
+
+	STATS_COUNT(mul, 1);
+	STATS_COUNT(cmp, 1);
+	if (st->capacity > SW_INITIAL_CAPACITY &&
+	    T->entryCount * SW_SHRINK_RATIO < st->capacity * SW_MAX_LOAD)
+		return _rehash(st, st->capacity / 2);
+	return true;
+}
+
+// swGet for a key whose hash is already known
+static float _get(Swisstable * st, swKey_t key, size_t hash) {
+	size_t i = _find(st, key, hash);
+	if (i == st->capacity)
+		return 0;
+	STATS_COUNT(mem, 1);
+	return st->values[i];
+}
+
+// makes a new entry or modifies existing one
+bool swSet(Tensor * T, tCoord_t * coords, float value) {
+	if (!T || !T->values || !coords)
+		return false;
+	Swisstable * st = T->values;
+	if (!st->ctrl)
+		return false;
+	swKey_t key = tensorCoords2Key(T, coords);
+	return _set(T, key, _hash(key), value);
+}
+
+bool swDelete(Tensor * T, tCoord_t * coords) {
+	if (!T || !T->values || !coords)
+		return false;
+	Swisstable * st = T->values;
+	if (!st->ctrl)
+		return false;
+	swKey_t key = tensorCoords2Key(T, coords);
+	return _delete(T, key, _hash(key));
+}
+
+float swGet(Tensor * T, tCoord_t * coords) {
+	if (!T || !T->values || !coords)
+		return 0;
+	Swisstable * st = T->values;
+	if (!st->ctrl)
+		return 0;
+	swKey_t key = tensorCoords2Key(T, coords);
+	return _get(st, key, _hash(key));
+}
+
+// Hash a block of keys and prefetch the control bytes of their home
+// groups before resolving any of them.
+static void _prefetchBlock(Tensor * T, tCoord_t * coords, size_t n,
+                           swKey_t * keys, size_t * hashes) {
+	Swisstable * st = T->values;
+	size_t groupMask = st->capacity / SW_GROUP_WIDTH - 1;
+	for (size_t i = 0; i < n; i++) {
+		keys[i] = tensorCoords2Key(T, &coords[i * T->order]);
+		hashes[i] = _hash(keys[i]);
+		size_t g = (hashes[i] >> 7) & groupMask;
+		__builtin_prefetch(&st->ctrl[g * SW_GROUP_WIDTH]);
+		__builtin_prefetch(&st->keys[g * SW_GROUP_WIDTH]);
+	}
+}
+
+void swGetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values) {
+	if (!T || !T->values || !coords || !values)
+		return;
+	Swisstable * st = T->values;
+	swKey_t keys[SW_BATCH];
+	size_t hashes[SW_BATCH];
+	for (size_t start = 0; start < n; start += SW_BATCH) {
+		size_t count = n - start < SW_BATCH ? n - start : SW_BATCH;
+		_prefetchBlock(T, &coords[start * T->order], count, keys, hashes);
+		for (size_t i = 0; i < count; i++)
+			values[start + i] = _get(st, keys[i], hashes[i]);
+	}
+}
+
+bool swSetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values) {
+	if (!T || !T->values || (n && (!coords || !values)))
+		return false;
+	swKey_t keys[SW_BATCH];
+	size_t hashes[SW_BATCH];
+	for (size_t start = 0; start < n; start += SW_BATCH) {
+		size_t count = n - start < SW_BATCH ? n - start : SW_BATCH;
+		_prefetchBlock(T, &coords[start * T->order], count, keys, hashes);
+		for (size_t i = 0; i < count; i++) {
+			float value = values[start + i];
+			if (value == 0 ? !_delete(T, keys[i], hashes[i])
+			               : !_set(T, keys[i], hashes[i], value))
+				return false;
+		}
+	}
+	return true;
+}
+
+void swPrintAll(Tensor * T) {
+	Swisstable * st = T->values;
+	printf("Swiss table:\n");
+	if (!st || !st->ctrl) {
+		printf("  <invalid>\n");
+		return;
+	}
+	for (size_t i = 0; i < st->capacity; i++) {
+		printf("  [%lu] ", i);
+		if (st->ctrl[i] == SW_EMPTY)
+			printf("<invalid>\n");
+		else if (st->ctrl[i] == SW_DELETED)
+			printf("<deleted>\n");
+		else
+			printf("%02x %llu: %f\n", st->ctrl[i],
+			       (unsigned long long)st->keys[i], st->values[i]);
+	}
+}
+
+size_t swSize(Tensor * T) {
+	Swisstable * st = T->values;
+	return _sweSize * st->capacity;
+}
+
+size_t swCapacity(Tensor * T) {
+	Swisstable * st = T->values;
+	return st->capacity;
+}
+
+typedef struct swContext {
+	size_t i;
+	tCoord_t * coords;
+} swContext;
+
+void * swIteratorInit(Tensor * T) {
+	swContext * ctx = calloc(sizeof(swContext), 1);
+	if (!ctx)
+		return 0;
+	ctx->coords = calloc(sizeof(tCoord_t), T->order + 1);
+	if (!ctx->coords) {
+		free(ctx);
+		return 0;
+	}
+	return ctx;
+}
+
+void swIteratorCleanup(void * context) {
+	swContext * ctx = context;
+	if (ctx)
+		free(ctx->coords);
+	free(ctx);
+}
+
+// walks the control bytes in slot order, a group at a time
+tensorEntry swIteratorNext(Tensor * T, void * context) {
+	if (!T || !T->values || !context)
+		return (tensorEntry){0};
+	Swisstable * st = T->values;
+	swContext * ctx = context;
+
+	while (ctx->i < st->capacity) {
+		size_t g = ctx->i / SW_GROUP_WIDTH;
+		size_t offset = ctx->i % SW_GROUP_WIDTH;
+		STATS_COUNT(mem, 1);
+		STATS_COUNT(cmp, 1);
+		swMask_t full = ~_matchFree(&st->ctrl[g * SW_GROUP_WIDTH]);
+		full &= ((1u << SW_GROUP_WIDTH) - 1) & ~((1u << offset) - 1);
+		if (!full) {
+			ctx->i = (g + 1) * SW_GROUP_WIDTH;
+			continue;
+		}
+		size_t i = g * SW_GROUP_WIDTH + __builtin_ctz(full);
+		ctx->i = i + 1;
+		STATS_COUNT(mem, 1);
+		STATS_COUNT(add, 1);
+		tensorKey2Coords(T, ctx->coords, st->keys[i]);
+		return (tensorEntry){.coords = ctx->coords, .value = st->values[i]};
+	}
+	return (tensorEntry){0};
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "tensor.h"
+#include <stddef.h>
+
+// Swiss-table-style hashtable: one control byte per slot holding 7 bits
+// of the key's hash, scanned a group at a time with SIMD so most lookups
+// resolve with a single vector compare.
+
+#define SW_GROUP_WIDTH 16 // slots per group, one SSE2 register of control
+#define SW_INITIAL_CAPACITY 16 // must be a power of two >= SW_GROUP_WIDTH
+#ifndef SW_MAX_LOAD
+#define SW_MAX_LOAD 0.875 // grow when more than this fraction is full
+#endif
+#define SW_SHRINK_RATIO 4 // halve when the load falls to 1/4 of the maximum
+#define SW_BATCH 16 // lookups prefetched together by the batch functions
+
+void * swNew();
+void swFree(Tensor * T);
+// grow ahead of time to hold count entries without rehashing
+bool swReserve(Tensor * T, size_t count);
+
+bool swSet(Tensor * T, tCoord_t * coords, float value);
+float swGet(Tensor * T, tCoord_t * coords);
+bool swDelete(Tensor * T, tCoord_t * coords);
+// n lookups at once, n * order coords like tensorBuild
+void swGetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values);
+bool swSetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values);
+
+void swPrintAll(Tensor * T); // only for debug
+
+size_t swSize(Tensor * T);
+// slots in the table, so entryCount / this is the load
+size_t swCapacity(Tensor * T);
+
+void * swIteratorInit(Tensor * T);
+void swIteratorCleanup(void * context);
+tensorEntry swIteratorNext(Tensor * T, void * context);
+
+const static tensorIterator swIterator = {.init = swIteratorInit,
+                                          .next = swIteratorNext,
+                                          .cleanup = swIteratorCleanup};
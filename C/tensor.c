@@ -1,11 +1,23 @@
 #include "tensor.h"
 #include "bpTree.h"
+#include "chashtable.h"
+#include "coo.h"
+#include "csf.h"
 #include "hashtable.h"
+#include "stats.h"
+#include "swisstable.h"
+#include <fcntl.h>
+#include <float.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /*
 enum storage_type {
@@ -22,6 +34,8 @@ typedef struct Tensor {
   enum storageType type;
   unsigned long long entryCount;
   void * values; // null means whole structure invalid
+  unsigned char * keyBits;
+  unsigned short keyWidth;
 } Tensor;
 */
 
@@ -40,17 +54,56 @@ Tensor * tensorNew(enum storageType type, tMode_t order, tCoord_t * shape) {
 	for (tMode_t mode = 0; mode < order; mode++)
 		T->shape[mode] = shape[mode];
 
+	// at least one bit per mode, so a prefix's span always fits in a key
+	T->keyBits = malloc(order + 1);
+	if (!T->keyBits) {
+		free(T->shape);
+		free(T);
+		return 0;
+	}
+	unsigned int width = 0;
+	for (tMode_t mode = 0; mode < order; mode++) {
+		unsigned char bits = 1;
+		while (bits < sizeof(tCoord_t) * 8 && (1ULL << bits) < shape[mode])
+			bits++;
+		T->keyBits[mode] = bits;
+		width += bits;
+	}
+	if (width > TENSOR_KEY_BITS) {
+		printf("shape needs %u key bits, but keys only have %lu\n", width,
+		       TENSOR_KEY_BITS);
+		free(T->keyBits);
+		free(T->shape);
+		free(T);
+		return 0;
+	}
+	T->keyWidth = width;
+
 	T->type = type;
 	switch (type) {
 		case probingHashtable:
 			T->values = htNew();
 			break;
 		case BPlusTree:
+		case mortonBPlusTree:
 			T->values = bptNew();
 			break;
+		case compressedSparseFiber:
+			T->values = csfNew(order);
+			break;
+		case sortedCOO:
+			T->values = cooNew();
+			break;
+		case swissHashtable:
+			T->values = swNew();
+			break;
+		case concurrentHashtable:
+			T->values = chtNew();
+			break;
 	}
 
 	if (!T->values) {
+		free(T->keyBits);
 		free(T->shape);
 		free(T);
 		return 0;
@@ -68,13 +121,28 @@ void tensorFree(Tensor * T) {
 				htFree(T);
 				break;
 			case BPlusTree:
+			case mortonBPlusTree:
 				bptFree(T);
 				break;
+			case compressedSparseFiber:
+				csfFree(T);
+				break;
+			case sortedCOO:
+				cooFree(T);
+				break;
+			case swissHashtable:
+				swFree(T);
+				break;
+			case concurrentHashtable:
+				chtFree(T);
+				break;
 		}
 	}
 	T->order = 0;
 	free(T->shape);
 	T->shape = 0;
+	free(T->keyBits);
+	T->keyBits = 0;
 	free(T);
 }
 
@@ -88,20 +156,147 @@ bool tensorBoundsCheck(Tensor * T, tCoord_t * coords) {
 	return true;
 }
 
-bool tensorSet(Tensor * T, tCoord_t * coords, float value) {
+#ifndef TENSOR_NO_STATS
+// Calls on a tensor nest, like tensorAdd calling tensorGet and tensorSet,
+// so only the outermost one charges the tensor's stats.
+static _Thread_local unsigned int _chargeDepth = 0;
+#endif
+
+// Public calls on T add the work they count to T->stats, if it's set.
+// Threads working on the same tensor share it, so the adds are atomic.
+static Stats _chargeStart(Tensor * T) {
+#ifndef TENSOR_NO_STATS
+	if (T && T->stats) {
+		_chargeDepth++;
+		return statsGet();
+	}
+#endif
+	return (Stats){0};
+}
+
+static void _chargeEnd(Tensor * T, Stats start) {
+#ifndef TENSOR_NO_STATS
+	if (T && T->stats && --_chargeDepth == 0)
+		statsAccumulateShared(T->stats, statsSince(start));
+#endif
+}
+
+static bool _delete(Tensor * T, tCoord_t * coords) {
 	if (!tensorBoundsCheck(T, coords))
 		return false;
 
+	switch (T->type) {
+		case probingHashtable:
+			return htDelete(T, coords);
+		case BPlusTree:
+		case mortonBPlusTree:
+			return bptDelete(T, coords);
+		case compressedSparseFiber:
+			return csfDelete(T, coords);
+		case sortedCOO:
+			return cooDelete(T, coords);
+		case swissHashtable:
+			return swDelete(T, coords);
+		case concurrentHashtable:
+			return chtDelete(T, coords);
+	}
+	return false;
+}
+
+bool tensorDelete(Tensor * T, tCoord_t * coords) {
+	Stats start = _chargeStart(T);
+	bool success = _delete(T, coords);
+	_chargeEnd(T, start);
+	return success;
+}
+
+static bool _set(Tensor * T, tCoord_t * coords, float value) {
+	if (!tensorBoundsCheck(T, coords))
+		return false;
+	// every missing entry reads as zero, so storing one is a deletion
+	if (value == 0)
+		return tensorDelete(T, coords);
+
 	switch (T->type) {
 		case probingHashtable:
 			return htSet(T, coords, value);
 		case BPlusTree:
+		case mortonBPlusTree:
 			return bptSet(T, coords, value);
+		case compressedSparseFiber:
+			return csfSet(T, coords, value);
+		case sortedCOO:
+			return cooSet(T, coords, value);
+		case swissHashtable:
+			return swSet(T, coords, value);
+		case concurrentHashtable:
+			return chtSet(T, coords, value);
 	}
 	return false;
 }
 
-float tensorGet(Tensor * T, tCoord_t * coords) {
+bool tensorSet(Tensor * T, tCoord_t * coords, float value) {
+	Stats start = _chargeStart(T);
+	bool success = _set(T, coords, value);
+	_chargeEnd(T, start);
+	return success;
+}
+
+static bool _add(Tensor * T, tCoord_t * coords, float value) {
+	if (!tensorBoundsCheck(T, coords))
+		return false;
+	if (T->type == concurrentHashtable)
+		return chtAdd(T, coords, value);
+	if (value == 0)
+		return true;
+	return tensorSet(T, coords, tensorGet(T, coords) + value);
+}
+
+bool tensorAdd(Tensor * T, tCoord_t * coords, float value) {
+	Stats start = _chargeStart(T);
+	bool success = _add(T, coords, value);
+	_chargeEnd(T, start);
+	return success;
+}
+
+static bool _build(Tensor * T, size_t n, tCoord_t * coords, float * values) {
+	if (!T || !T->values)
+		return false;
+	for (size_t i = 0; i < n; i++)
+		if (!tensorBoundsCheck(T, &coords[i * T->order]))
+			return false;
+
+	// bulk builders expect to start from nothing
+	if (!T->entryCount) {
+		switch (T->type) {
+			case BPlusTree:
+			case mortonBPlusTree:
+				return bptBuild(T, n, coords, values);
+			case compressedSparseFiber:
+				return csfBuild(T, n, coords, values);
+			case sortedCOO:
+				return cooBuild(T, n, coords, values);
+			default:
+				break;
+		}
+	}
+	if (T->type == probingHashtable)
+		htReserve(T, T->entryCount + n);
+	else if (T->type == swissHashtable)
+		swReserve(T, T->entryCount + n);
+	else if (T->type == concurrentHashtable)
+		chtReserve(T, T->entryCount + n);
+	return tensorSetBatch(T, coords, n, values);
+}
+
+bool tensorBuild(Tensor * T, size_t n, tCoord_t * coords, float * values) {
+	Stats start = _chargeStart(T);
+	bool success = _build(T, n, coords, values);
+	_chargeEnd(T, start);
+	return success;
+}
+
+static float _get(Tensor * T, tCoord_t * coords) {
 	if (!tensorBoundsCheck(T, coords))
 		return 0;
 
@@ -109,11 +304,89 @@ float tensorGet(Tensor * T, tCoord_t * coords) {
 		case probingHashtable:
 			return htGet(T, coords);
 		case BPlusTree:
+		case mortonBPlusTree:
 			return bptGet(T, coords);
+		case compressedSparseFiber:
+			return csfGet(T, coords);
+		case sortedCOO:
+			return cooGet(T, coords);
+		case swissHashtable:
+			return swGet(T, coords);
+		case concurrentHashtable:
+			return chtGet(T, coords);
 	}
 	return 0;
 }
 
+float tensorGet(Tensor * T, tCoord_t * coords) {
+	Stats start = _chargeStart(T);
+	float value = _get(T, coords);
+	_chargeEnd(T, start);
+	return value;
+}
+
+static void _getBatch(Tensor * T, tCoord_t * coords, size_t n, float * values) {
+	if (!T || !T->values || !n || !coords || !values)
+		return;
+	bool inBounds = true;
+	for (size_t i = 0; i < n && inBounds; i++)
+		inBounds = tensorBoundsCheck(T, &coords[i * T->order]);
+
+	// out of bounds coordinates read as 0, which tensorGet handles
+	if (inBounds) {
+		switch (T->type) {
+			case probingHashtable:
+				htGetBatch(T, coords, n, values);
+				return;
+			case swissHashtable:
+				swGetBatch(T, coords, n, values);
+				return;
+			case BPlusTree:
+			case mortonBPlusTree:
+				bptGetBatch(T, coords, n, values);
+				return;
+			default:
+				break;
+		}
+	}
+	for (size_t i = 0; i < n; i++)
+		values[i] = tensorGet(T, &coords[i * T->order]);
+}
+
+void tensorGetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values) {
+	Stats start = _chargeStart(T);
+	_getBatch(T, coords, n, values);
+	_chargeEnd(T, start);
+}
+
+static bool _setBatch(Tensor * T, tCoord_t * coords, size_t n, float * values) {
+	if (!T || !T->values || (n && (!coords || !values)))
+		return false;
+	for (size_t i = 0; i < n; i++)
+		if (!tensorBoundsCheck(T, &coords[i * T->order]))
+			return false;
+
+	switch (T->type) {
+		case probingHashtable:
+			return htSetBatch(T, coords, n, values);
+		case swissHashtable:
+			return swSetBatch(T, coords, n, values);
+		default:
+			break;
+	}
+	for (size_t i = 0; i < n; i++)
+		if (!tensorSet(T, &coords[i * T->order], values[i]))
+			return false;
+	return true;
+}
+
+bool tensorSetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values) {
+	Stats start = _chargeStart(T);
+	bool success = _setBatch(T, coords, n, values);
+	_chargeEnd(T, start);
+	return success;
+}
+
 bool tensorPrintMetadata(Tensor * T) {
 	printf("Tensor:\n");
 	if (!T) {
@@ -128,6 +401,21 @@ bool tensorPrintMetadata(Tensor * T) {
 		case BPlusTree:
 			puts("B+ tree");
 			break;
+		case mortonBPlusTree:
+			puts("B+ tree with Morton keys");
+			break;
+		case compressedSparseFiber:
+			puts("compressed sparse fiber");
+			break;
+		case sortedCOO:
+			puts(cooIsMapped(T) ? "sorted COO, mapped read-only" : "sorted COO");
+			break;
+		case swissHashtable:
+			puts("swiss hash table");
+			break;
+		case concurrentHashtable:
+			puts("concurrent hash table");
+			break;
 	}
 	if (!T->values) {
 		printf("  <invalid>\n");
@@ -143,6 +431,19 @@ bool tensorPrintMetadata(Tensor * T) {
 	size_t theoreticalSize = (sizeof(float)+8) * T->entryCount;
 	printf("  size overhead: %.2fx\n",
 	    (float)actualSize/theoreticalSize);
+	if (T->type == BPlusTree || T->type == mortonBPlusTree) {
+		bptPoolStats pool = bptGetPoolStats(T);
+		printf("  node pool: %lu live, %lu free, %lu unused in %lu chunks\n",
+		       pool.live, pool.free, pool.capacity - pool.live - pool.free,
+		       pool.chunks);
+		printf("  pool slack: %lu B\n", pool.slack);
+	}
+	if (T->type == probingHashtable)
+		printf("  load factor: %.3f of %lu slots\n",
+		       (double)T->entryCount / htCapacity(T), htCapacity(T));
+	if (T->type == swissHashtable)
+		printf("  load factor: %.3f of %lu slots\n",
+		       (double)T->entryCount / swCapacity(T), swCapacity(T));
 	/*
 	Hashtable * ht = T->values;
 	printf("  capacity: %lu\n", ht->capacity);
@@ -160,6 +461,59 @@ void tensorPrintRaw(Tensor * T) {
 		htPrintAll(T->values);
 }
 
+tKey_t tensorCoords2Key(Tensor * T, tCoord_t * coords) {
+	tKey_t key = 0;
+	for (tMode_t mode = 0; mode < T->order; mode++)
+		key = (key << T->keyBits[mode]) | coords[mode];
+	return key;
+}
+
+void tensorKey2Coords(Tensor * T, tCoord_t * coords, tKey_t key) {
+	for (tMode_t mode = T->order; mode-- > 0;) {
+		coords[mode] = key & (((tKey_t)1 << T->keyBits[mode]) - 1);
+		key >>= T->keyBits[mode];
+	}
+}
+
+// Walks the bit levels from the top, taking one bit from every mode that
+// still has bits at that level, so short modes just drop out early.
+tKey_t tensorCoords2Morton(Tensor * T, tCoord_t * coords) {
+	unsigned char levels = 0;
+	for (tMode_t mode = 0; mode < T->order; mode++)
+		if (T->keyBits[mode] > levels)
+			levels = T->keyBits[mode];
+	tKey_t key = 0;
+	for (unsigned char bit = levels; bit-- > 0;)
+		for (tMode_t mode = 0; mode < T->order; mode++)
+			if (bit < T->keyBits[mode])
+				key = (key << 1) | ((coords[mode] >> bit) & 1);
+	return key;
+}
+
+void tensorMorton2Coords(Tensor * T, tCoord_t * coords, tKey_t key) {
+	unsigned char levels = 0;
+	for (tMode_t mode = 0; mode < T->order; mode++) {
+		coords[mode] = 0;
+		if (T->keyBits[mode] > levels)
+			levels = T->keyBits[mode];
+	}
+	for (unsigned char bit = 0; bit < levels; bit++)
+		for (tMode_t mode = T->order; mode-- > 0;)
+			if (bit < T->keyBits[mode]) {
+				coords[mode] |= (tCoord_t)(key & 1) << bit;
+				key >>= 1;
+			}
+}
+
+tKey_t tensorKeyMask(Tensor * T, tMode_t p) {
+	unsigned int bits = 0;
+	for (tMode_t mode = p; mode < T->order; mode++)
+		bits += T->keyBits[mode];
+	if (bits >= TENSOR_KEY_BITS)
+		return ~(tKey_t)0;
+	return ((tKey_t)1 << bits) - 1;
+}
+
 void coordsPrint(Tensor * T, tCoord_t * coords) {
 	putchar('[');
 	for (tMode_t mode = 0; mode < T->order; mode++) {
@@ -180,16 +534,7 @@ void tensorPrint(Tensor * T) {
 		return;
 	}
 
-	tensorIterator iter = {0};
-	switch (T->type) {
-		case probingHashtable:
-			iter = htIterator;
-			break;
-		case BPlusTree:
-			iter = bptIterator;
-			break;
-	}
-
+	tensorIterator iter = tensorGetIterator(T);
 	void * context = iter.init(T);
 	tensorEntry item = iter.next(T, context);
 	while (item.coords != 0) {
@@ -201,20 +546,278 @@ void tensorPrint(Tensor * T) {
 	iter.cleanup(context);
 }
 
+tensorIterator tensorGetIterator(Tensor * T) {
+	switch (T->type) {
+		case probingHashtable:
+			return htIterator;
+		case BPlusTree:
+		case mortonBPlusTree:
+			return bptIterator;
+		case compressedSparseFiber:
+			return csfIterator;
+		case sortedCOO:
+			return cooIterator;
+		case swissHashtable:
+			return swIterator;
+		case concurrentHashtable:
+			return chtIterator;
+	}
+	return (tensorIterator){0};
+}
+
+tensorRange * tensorRangeNew(Tensor * T, tCoord_t * prefix, tMode_t p) {
+	if (!T || !T->values || p > T->order || (p && !prefix))
+		return 0;
+	tensorRange * range = calloc(1, sizeof(tensorRange));
+	if (!range)
+		return 0;
+	range->prefix = calloc(p + 1, sizeof(tCoord_t));
+	if (!range->prefix) {
+		free(range);
+		return 0;
+	}
+	// a prefix outside the shape has no key range to seek to
+	bool inBounds = true;
+	for (tMode_t m = 0; m < p; m++) {
+		range->prefix[m] = prefix[m];
+		if (prefix[m] >= T->shape[m])
+			inBounds = false;
+	}
+	range->T = T;
+	range->prefixLength = p;
+	range->iter = tensorGetIterator(T);
+
+	switch (inBounds ? T->type : probingHashtable) {
+		case BPlusTree:
+			range->context = bptIteratorInitPrefix(T, prefix, p);
+			break;
+		case compressedSparseFiber:
+			range->context = csfIteratorInitPrefix(T, prefix, p);
+			break;
+		case sortedCOO:
+			range->context = cooIteratorInitPrefix(T, prefix, p);
+			break;
+		default:
+			range->filter = p > 0;
+			range->context = range->iter.init(T);
+			break;
+	}
+	if (!range->context) {
+		free(range->prefix);
+		free(range);
+		return 0;
+	}
+	return range;
+}
+
+tensorEntry tensorRangeNext(tensorRange * range) {
+	if (!range)
+		return (tensorEntry){0};
+	tensorEntry item = range->iter.next(range->T, range->context);
+	while (range->filter && item.coords) {
+		bool match = true;
+		for (tMode_t m = 0; m < range->prefixLength && match; m++)
+			match = item.coords[m] == range->prefix[m];
+		if (match)
+			break;
+		item = range->iter.next(range->T, range->context);
+	}
+	return item;
+}
+
+void tensorRangeFree(tensorRange * range) {
+	if (!range)
+		return;
+	range->iter.cleanup(range->context);
+	free(range->prefix);
+	free(range);
+}
+
 size_t tensorSize(Tensor * T) {
 	switch (T->type) {
 		case probingHashtable:
 			return htSize(T);
 		case BPlusTree:
+		case mortonBPlusTree:
 			return bptSize(T);
+		case compressedSparseFiber:
+			return csfSize(T);
+		case sortedCOO:
+			return cooSize(T);
+		case swissHashtable:
+			return swSize(T);
+		case concurrentHashtable:
+			return chtSize(T);
 	}
 	return 0;
 }
 
-bool tensorWrite(Tensor * T, const char * filename) {
+typedef struct fileEntry {
+	tKey_t key;
+	float value;
+} fileEntry;
+
+static int _fileEntryCompare(const void * x, const void * y) {
+	const fileEntry * a = x;
+	const fileEntry * b = y;
+	return a->key < b->key ? -1 : a->key > b->key;
+}
+
+// Gathers every entry with its key, sorted by key if asked. Backends that
+// already iterate in key order skip the sort and report it in ordered.
+static fileEntry * _collectEntries(Tensor * T, bool sorted, size_t * count,
+                                   bool * ordered) {
+	fileEntry * entries = malloc((T->entryCount + 1) * sizeof(fileEntry));
+	tensorIterator iter = tensorGetIterator(T);
+	void * context = entries ? iter.init(T) : 0;
+	if (!context) {
+		free(entries);
+		return 0;
+	}
+	size_t n = 0;
+	*ordered = true;
+	for (tensorEntry item = iter.next(T, context);
+	     item.coords && n < T->entryCount; item = iter.next(T, context)) {
+		entries[n].key = tensorCoords2Key(T, item.coords);
+		entries[n].value = item.value;
+		if (n && entries[n].key <= entries[n - 1].key)
+			*ordered = false;
+		n++;
+	}
+	iter.cleanup(context);
+	if (sorted && !*ordered)
+		qsort(entries, n, sizeof(fileEntry), _fileEntryCompare);
+	*count = n;
+	return entries;
+}
+
+static char * _formatCoord(char * out, tCoord_t coord) {
+	char digits[16];
+	int n = 0;
+	do {
+		digits[n++] = '0' + coord % 10;
+		coord /= 10;
+	} while (coord);
+	while (n)
+		*out++ = digits[--n];
+	return out;
+}
+
+// exact in a double, and all a float's decimal digits can need
+static const double _pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                1e18, 1e19, 1e20, 1e21, 1e22};
+
+// Writes the fewest significant digits that read back as exactly value,
+// laid out like Python's repr: "3.0", "0.125", "1.5e-05", "1e+20". The
+// check divides by an exact power of ten in a double, which is also how
+// tensorRead parses, so tensorRead always gets the same float back.
+static char * _formatValue(char * out, float value) {
+	const char * special = 0;
+	if (value < 0) {
+		*out++ = '-';
+		value = -value;
+	}
+	if (value != value)
+		special = "nan";
+	else if (value > FLT_MAX)
+		special = "inf";
+	else if (value == 0)
+		special = "0.0";
+	if (special) {
+		memcpy(out, special, 3);
+		return out + 3;
+	}
+
+	// value = mantissa / 10^scale, with mantissa's digits as few as possible
+	int exponent = 0; // of the leading digit, maybe off by one
+	double v = value;
+	if (v >= 1) {
+		while (exponent < 22 && v >= _pow10[exponent + 1])
+			exponent++;
+	} else {
+		while (exponent > -22 && v < 1 / _pow10[-exponent])
+			exponent--;
+	}
+	unsigned long long mantissa = 0;
+	int scale = 0;
+	bool found = false;
+	for (int digits = 1; !found && digits <= 9; digits++) {
+		scale = digits - 1 - exponent;
+		if (exponent <= -22 || exponent >= 22 || scale > 22)
+			break;
+		double scaled = scale >= 0 ? v * _pow10[scale] : v / _pow10[-scale];
+		mantissa = scaled + 0.5;
+		double back = scale >= 0 ? mantissa / _pow10[scale]
+		                         : mantissa * _pow10[-scale];
+		found = (float)back == value;
+	}
+	if (!found) {
+		// too far from 1 for the table, so take the slow way
+		char text[32];
+		for (int digits = 1; digits <= 9; digits++) {
+			snprintf(text, sizeof(text), "%.*g", digits, value);
+			if (strtof(text, 0) == value)
+				break;
+		}
+		size_t length = strlen(text);
+		memcpy(out, text, length);
+		return out + length;
+	}
+	while (mantissa >= 10 && mantissa % 10 == 0) {
+		mantissa /= 10;
+		scale--;
+	}
+
+	char digits[24];
+	int n = 0;
+	for (unsigned long long m = mantissa; m; m /= 10)
+		digits[n++] = '0' + m % 10; // backwards
+	exponent = n - 1 - scale;
+	if (exponent >= 16 || exponent < -4) {
+		*out++ = digits[--n];
+		if (n)
+			*out++ = '.';
+		while (n)
+			*out++ = digits[--n];
+		*out++ = 'e';
+		*out++ = exponent < 0 ? '-' : '+';
+		if (exponent < 0)
+			exponent = -exponent;
+		if (exponent < 10)
+			*out++ = '0';
+		return _formatCoord(out, exponent);
+	}
+	if (exponent < 0) {
+		*out++ = '0';
+		*out++ = '.';
+		for (int i = -1; i > exponent; i--)
+			*out++ = '0';
+		while (n)
+			*out++ = digits[--n];
+		return out;
+	}
+	for (int i = 0; i <= exponent; i++)
+		*out++ = n ? digits[--n] : '0';
+	*out++ = '.';
+	if (!n)
+		*out++ = '0';
+	while (n)
+		*out++ = digits[--n];
+	return out;
+}
+
+// Lines are formatted into one big buffer that goes out in whole blocks,
+// instead of a printf per field.
+bool tensorWrite(Tensor * T, const char * filename, bool sorted) {
 	FILE * fp = fopen(filename, "w");
+	if (!fp) {
+		printf("failed to open \"%s\" for writing\n", filename);
+		return false;
+	}
 
-	if (!T->values) {
+	if (!T || !T->values) {
 		fputs("<invalid>\n", fp);
 		fclose(fp);
 		return false;
@@ -229,100 +832,690 @@ bool tensorWrite(Tensor * T, const char * filename) {
 	}
 	fputs("\nvalues:\n", fp);
 
-	tensorIterator iter = {0};
-	switch (T->type) {
-		case probingHashtable:
-			iter = htIterator;
-			break;
-		case BPlusTree:
-			iter = bptIterator;
-			break;
-	}
-	void * context = iter.init(T);
-	tensorEntry item = iter.next(T, context);
-	if (item.coords == 0) {
-		iter.cleanup(context);
+	// sorted output goes through keys, the rest straight off the iterator
+	size_t count = 0;
+	bool ordered;
+	fileEntry * entries = 0;
+	tensorIterator iter = tensorGetIterator(T);
+	void * context = 0;
+	tCoord_t * coords = malloc((T->order + 1) * sizeof(tCoord_t));
+	size_t lineMax = T->order * 12 + 32;
+	size_t size = TENSOR_WRITE_BUFFER > 2 * lineMax ? TENSOR_WRITE_BUFFER
+	                                                 : 2 * lineMax;
+	char * buffer = malloc(size);
+	if (sorted)
+		entries = _collectEntries(T, true, &count, &ordered);
+	else
+		context = iter.init(T);
+	if (!coords || !buffer || (sorted ? !entries : !context)) {
+		if (context)
+			iter.cleanup(context);
+		free(entries);
+		free(coords);
+		free(buffer);
 		fclose(fp);
 		printf("failed to allocate\n");
 		return false;
 	}
 
-	while (item.coords != 0) {
+	bool success = true;
+	char * p = buffer;
+	for (size_t i = 0; success; i++) {
+		tensorEntry item;
+		if (sorted && i < count) {
+			tensorKey2Coords(T, coords, entries[i].key);
+			item = (tensorEntry){.coords = coords, .value = entries[i].value};
+		} else {
+			item = sorted ? (tensorEntry){0} : iter.next(T, context);
+		}
+		if (!item.coords || p + lineMax > buffer + size) {
+			success = fwrite(buffer, 1, p - buffer, fp) == (size_t)(p - buffer);
+			p = buffer;
+		}
+		if (!item.coords)
+			break;
 		for (tMode_t mode = 0; mode < T->order; mode++) {
-			fprintf(fp, "%u, ", item.coords[mode]);
+			p = _formatCoord(p, item.coords[mode]);
+			*p++ = ',';
+			*p++ = ' ';
+		}
+		p = _formatValue(p, item.value);
+		*p++ = '\n';
+	}
+	if (context)
+		iter.cleanup(context);
+	free(entries);
+	free(coords);
+	free(buffer);
+	success = !fclose(fp) && success;
+	if (!success)
+		printf("failed to write \"%s\"\n", filename);
+	return success;
+}
+
+// Skips spaces and tabs, but not newlines
+static const char * _skipBlanks(const char * p, const char * end) {
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	return p;
+}
+
+// Parses an unsigned coordinate, or returns 0 if there are no digits or
+// it doesn't fit in a tCoord_t.
+static const char * _parseCoord(const char * p, const char * end,
+                                tCoord_t * coord) {
+	p = _skipBlanks(p, end);
+	if (p == end || *p < '0' || *p > '9')
+		return 0;
+	unsigned long long value = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		value = value * 10 + (*p++ - '0');
+		if (value > (tCoord_t)~0)
+			return 0;
+	}
+	*coord = value;
+	return p;
+}
+
+// Parses a decimal float like "-12.5e3". Up to 15 significant digits and
+// a small exponent are computed exactly in a double, and anything longer
+// goes through strtod, which stops at the separator after the number.
+// So do words like "inf" and "nan", which tensorWrite writes too.
+static const char * _parseValue(const char * p, const char * end,
+                                float * value) {
+	static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+	                               1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	                               1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+	                               1e18, 1e19, 1e20, 1e21, 1e22};
+	p = _skipBlanks(p, end);
+	const char * start = p;
+	bool negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+'))
+		p++;
+
+	unsigned long long mantissa = 0;
+	int digits = 0;   // significant digits in mantissa
+	int exponent = 0; // decimal exponent of mantissa's last digit
+	bool any = false;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			digits += mantissa != 0;
+		} else {
+			exponent++;
+			digits++;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				digits += mantissa != 0;
+				exponent--;
+			}
+		}
+	}
+	if (!any) {
+		char * stop;
+		*value = strtod(start, &stop);
+		return stop > start && stop <= end ? stop : 0;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char * q = p + 1;
+		bool negativeExp = q < end && *q == '-';
+		if (q < end && (*q == '-' || *q == '+'))
+			q++;
+		if (q < end && *q >= '0' && *q <= '9') {
+			int e = 0;
+			for (; q < end && *q >= '0' && *q <= '9'; q++)
+				if (e < 10000)
+					e = e * 10 + (*q - '0');
+			exponent += negativeExp ? -e : e;
+			p = q;
+		}
+	}
+
+	if (digits <= 15 && exponent >= -22 && exponent <= 22) {
+		double result = mantissa;
+		result = exponent < 0 ? result / pow10[-exponent]
+		                      : result * pow10[exponent];
+		*value = negative ? -result : result;
+		return p;
+	}
+	char * stop;
+	*value = strtod(start, &stop);
+	return stop == p ? p : 0;
+}
+
+// Parses the "order: " and "shape: " lines and the "values:" after them,
+// returning where the values start.
+static const char * _parseHeader(const char * p, const char * end,
+                                 tMode_t * order, tCoord_t ** shape) {
+	tCoord_t parsed;
+	p = _skipBlanks(p, end);
+	if (end - p < 6 || strncmp(p, "order:", 6))
+		return 0;
+	p = _parseCoord(p + 6, end, &parsed);
+	if (!p || parsed > (tMode_t)~0)
+		return 0;
+	*order = parsed;
+
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+	if (end - p < 6 || strncmp(p, "shape:", 6))
+		return 0;
+	p += 6;
+	*shape = malloc((*order + 1) * sizeof(tCoord_t));
+	if (!*shape)
+		return 0;
+	for (tMode_t m = 0; m < *order; m++) {
+		if (m) {
+			p = _skipBlanks(p, end);
+			if (p == end || *p++ != ',')
+				p = 0;
+		}
+		if (p)
+			p = _parseCoord(p, end, &(*shape)[m]);
+		if (!p) {
+			free(*shape);
+			return 0;
+		}
+	}
+
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+	if (end - p < 7 || strncmp(p, "values:", 7)) {
+		free(*shape);
+		return 0;
+	}
+	p = memchr(p, '\n', end - p);
+	return p ? p + 1 : end;
+}
+
+// One chunk of the values section, from the start of a line to just
+// after a newline (or the end of the file)
+typedef struct readJob {
+	const char * start;
+	const char * end;
+	tMode_t order;
+	const tCoord_t * shape;
+	size_t lines;     // upper bound on its entries
+	tCoord_t * coords; // where its entries go in the shared arrays
+	float * values;
+	size_t count;   // entries parsed
+	size_t skipped; // malformed or out of range lines
+	bool threaded;
+} readJob;
+
+static void * _countLines(void * arg) {
+	readJob * job = arg;
+	job->lines = 0;
+	for (const char * p = job->start; p < job->end; job->lines++) {
+		p = memchr(p, '\n', job->end - p);
+		p = p ? p + 1 : job->end; // the last line may have no newline
+	}
+	return 0;
+}
+
+// Lines look like "c0, c1, ..., value". Blank lines are skipped, and so
+// are malformed ones and ones with coordinates outside the shape, which
+// would make tensorBuild reject every entry.
+static void * _parseLines(void * arg) {
+	readJob * job = arg;
+	const char * p = job->start;
+	while (p < job->end) {
+		const char * line = _skipBlanks(p, job->end);
+		if (line < job->end && (*line == '\n' || *line == '\r')) {
+			p = memchr(line, '\n', job->end - line);
+			p = p ? p + 1 : job->end;
+			continue;
+		}
+		if (line == job->end)
+			break;
+
+		p = line;
+		tCoord_t * coords = &job->coords[job->count * job->order];
+		for (tMode_t m = 0; p && m < job->order; m++) {
+			p = _parseCoord(p, job->end, &coords[m]);
+			if (p && coords[m] >= job->shape[m])
+				p = 0;
+			if (p)
+				p = _skipBlanks(p, job->end);
+			if (p && (p == job->end || *p++ != ','))
+				p = 0;
+		}
+		if (p)
+			p = _parseValue(p, job->end, &job->values[job->count]);
+		if (p) {
+			p = _skipBlanks(p, job->end);
+			if (p < job->end && *p == '\r')
+				p++;
+			if (p < job->end && *p++ != '\n')
+				p = 0;
+		}
+		if (!p) {
+			job->skipped++;
+			p = memchr(line, '\n', job->end - line);
+			p = p ? p + 1 : job->end;
+			continue;
+		}
+		job->count++;
+	}
+	return 0;
+}
+
+// Runs fn on every job, the first and any that fail to start on the
+// calling thread
+static void _runJobs(readJob * jobs, pthread_t * ids, unsigned int threads,
+                     void * (*fn)(void *)) {
+	for (unsigned int t = 1; t < threads; t++)
+		jobs[t].threaded = !pthread_create(&ids[t], 0, fn, &jobs[t]);
+	fn(&jobs[0]);
+	for (unsigned int t = 1; t < threads; t++)
+		if (!jobs[t].threaded)
+			fn(&jobs[t]);
+	for (unsigned int t = 1; t < threads; t++)
+		if (jobs[t].threaded)
+			pthread_join(ids[t], 0);
+}
+
+static char * _readFile(const char * filename, size_t * size) {
+	FILE * fp = fopen(filename, "rb");
+	if (!fp)
+		return 0;
+	char * buffer = 0;
+	if (!fseek(fp, 0, SEEK_END)) {
+		long length = ftell(fp);
+		rewind(fp);
+		if (length >= 0)
+			buffer = malloc(length + 1);
+		if (buffer && fread(buffer, 1, length, fp) != (size_t)length) {
+			free(buffer);
+			buffer = 0;
+		}
+		if (buffer) {
+			buffer[length] = 0; // so strtod can't run off the end
+			*size = length;
 		}
-		fprintf(fp, "%f\n", item.value);
-		item = iter.next(T, context);
 	}
-	iter.cleanup(context);
 	fclose(fp);
-	return true;
+	return buffer;
 }
 
 Tensor * tensorRead(enum storageType type, const char * filename) {
-	FILE * fp = fopen(filename, "r");
-	if (!fp) {
+	return tensorReadParallel(type, filename, 1);
+}
+
+// The whole file is read into memory and the values section split into
+// one chunk per thread at line boundaries. Each thread first counts the
+// lines in its chunk, which places its entries in one shared pair of
+// arrays, then parses straight into them. Entries stay in file order, so
+// later duplicates still win in tensorBuild. Malformed lines and ones
+// outside the shape are skipped with a note of how many there were.
+Tensor * tensorReadParallel(enum storageType type, const char * filename,
+                            unsigned int threads) {
+	size_t size = 0;
+	char * buffer = _readFile(filename, &size);
+	if (!buffer) {
 		printf("failed to read file \"%s\"\n", filename);
 		return 0;
 	}
-	size_t linecount = 0;
-	char c;
-	while ((c = fgetc(fp)) != EOF)
-		if (c == '\n')
-			linecount++;
-	rewind(fp);
+	const char * end = buffer + size;
 
-	Tensor * T;
 	tMode_t order;
+	tCoord_t * shape = 0;
+	const char * values = _parseHeader(buffer, end, &order, &shape);
+	if (!values) {
+		printf("failed to parse header of \"%s\"\n", filename);
+		free(buffer);
+		return 0;
+	}
 
-	fscanf(fp, "order: %hu\n", &order);
+	Tensor * T = tensorNew(type, order, shape);
+	free(shape);
+	if (!T || !T->values) {
+		printf("something is wrong\n");
+		free(buffer);
+		return 0;
+	}
 
-	tCoord_t * shape = malloc(order * sizeof(tCoord_t));
-	if (!shape) {
+	// small files aren't worth the threads
+	size_t chunks = (end - values) / TENSOR_READ_MIN_CHUNK;
+	if (threads > chunks)
+		threads = chunks;
+	if (!threads)
+		threads = 1;
+	readJob * jobs = calloc(threads, sizeof(readJob));
+	pthread_t * ids = calloc(threads, sizeof(pthread_t));
+	if (!jobs || !ids) {
 		printf("allocation error\n");
-		free(shape);
-		fclose(fp);
+		free(jobs);
+		free(ids);
+		free(buffer);
+		tensorFree(T);
 		return 0;
 	}
+	const char * start = values;
+	for (unsigned int t = 0; t < threads; t++) {
+		const char * stop = values + (end - values) * (t + 1) / threads;
+		if (stop < start)
+			stop = start;
+		if (stop < end) {
+			stop = memchr(stop, '\n', end - stop);
+			stop = stop ? stop + 1 : end;
+		}
+		jobs[t] = (readJob){
+		    .start = start, .end = stop, .order = order, .shape = T->shape};
+		start = stop;
+	}
 
-	fscanf(fp, "shape: ");
+	_runJobs(jobs, ids, threads, _countLines);
+	size_t lines = 0;
+	for (unsigned int t = 0; t < threads; t++)
+		lines += jobs[t].lines;
+	tCoord_t * coords = malloc((lines * order + 1) * sizeof(tCoord_t));
+	float * vals = malloc((lines + 1) * sizeof(float));
+	if (!coords || !vals) {
+		printf("allocation error\n");
+		free(coords);
+		free(vals);
+		free(jobs);
+		free(ids);
+		free(buffer);
+		tensorFree(T);
+		return 0;
+	}
+	lines = 0;
+	for (unsigned int t = 0; t < threads; t++) {
+		jobs[t].coords = &coords[lines * order];
+		jobs[t].values = &vals[lines];
+		lines += jobs[t].lines;
+	}
+	_runJobs(jobs, ids, threads, _parseLines);
+
+	// close the gaps left by blank and skipped lines
+	size_t count = 0, skipped = 0;
+	for (unsigned int t = 0; t < threads; t++) {
+		memmove(&coords[count * order], jobs[t].coords,
+		        jobs[t].count * order * sizeof(tCoord_t));
+		memmove(&vals[count], jobs[t].values, jobs[t].count * sizeof(float));
+		count += jobs[t].count;
+		skipped += jobs[t].skipped;
+	}
+	if (skipped)
+		printf("skipped %lu malformed or out of range lines in \"%s\"\n",
+		       skipped, filename);
+	free(jobs);
+	free(ids);
+	free(buffer);
 
-	for (tMode_t m = 0; m < order; m++) {
-		fscanf(fp, "%u", &shape[m]);
-		if (m != order - 1)
-			fscanf(fp, ", ");
+	if (!tensorBuild(T, count, coords, vals)) {
+		printf("failed to insert values from \"%s\"\n", filename);
+		tensorFree(T);
+		T = 0;
 	}
 
-	fscanf(fp, "\nvalues:\n");
+	free(coords);
+	free(vals);
+	return T;
+}
+
+// Binary files start with this header, then the shape, then nnz keys at
+// the next multiple of 16 bytes, then nnz values. Everything is in host
+// byte order and keys are packed the way tensorCoords2Key packs them, so
+// a sorted file is already a sorted COO.
+typedef struct tensorFileHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned short order;
+	unsigned char keyBytes; // sizeof(tKey_t) of the writer
+	unsigned char flags;
+	unsigned int storage; // storageType it was written from, as a hint
+	unsigned int reserved;
+	unsigned long long nnz;
+} tensorFileHeader;
 
-	if (type == probingHashtable)
-		ht_capacity = linecount - 3;
+static const char _fileMagic[8] = "TENSBIN";
+#define TENSOR_FILE_VERSION 1
+#define TENSOR_FILE_SORTED 1 // keys strictly ascending
 
-	T = tensorNew(type, order, shape);
+static size_t _fileKeysOffset(tMode_t order) {
+	size_t offset = sizeof(tensorFileHeader) + order * sizeof(tCoord_t);
+	return (offset + 15) & ~(size_t)15;
+}
+
+// checks that a file of size bytes starting with header holds all it says
+static bool _fileHeaderValid(tensorFileHeader * header, size_t size) {
+	if (size < sizeof(*header))
+		return false;
+	size_t keysOffset = _fileKeysOffset(header->order);
+	return keysOffset <= size && !memcmp(header->magic, _fileMagic, 8) &&
+	       header->version == TENSOR_FILE_VERSION &&
+	       header->keyBytes == sizeof(tKey_t) &&
+	       (size - keysOffset) / (sizeof(tKey_t) + sizeof(float)) >=
+	           header->nnz;
+}
+
+bool tensorWriteBinary(Tensor * T, const char * filename, bool sorted) {
+	if (!T || !T->values)
+		return false;
+	size_t nnz;
+	bool ordered;
+	fileEntry * entries = _collectEntries(T, sorted, &nnz, &ordered);
+	if (!entries) {
+		printf("allocation error\n");
+		return false;
+	}
+	tensorFile * f = tensorFileCreate(filename, T);
+	if (!f) {
+		free(entries);
+		return false;
+	}
+
+	// keys and values go out a block at a time
+	tKey_t keys[4096];
+	float values[4096];
+	bool success = true;
+	for (size_t i = 0; success && i < nnz; i += 4096) {
+		size_t n = nnz - i < 4096 ? nnz - i : 4096;
+		for (size_t j = 0; j < n; j++) {
+			keys[j] = entries[i + j].key;
+			values[j] = entries[i + j].value;
+		}
+		success = tensorFileAppend(f, n, keys, values);
+	}
+	free(entries);
+	return tensorFileClose(f) && success;
+}
+
+// A sorted file opened as a sorted COO is used straight from the mapping,
+// so only the pages that get touched are ever read. Anything else is
+// decoded and built like a text file.
+Tensor * tensorReadBinary(enum storageType type, const char * filename) {
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		if (fd >= 0)
+			close(fd);
+		printf("failed to read file \"%s\"\n", filename);
+		return 0;
+	}
+	size_t size = st.st_size;
+	void * map = size ? mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0)
+	                  : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("failed to map file \"%s\"\n", filename);
+		return 0;
+	}
+
+	tensorFileHeader * header = map;
+	if (!_fileHeaderValid(header, size)) {
+		printf("\"%s\" is not a tensor file this build can read\n", filename);
+		munmap(map, size);
+		return 0;
+	}
+	size_t nnz = header->nnz;
+	size_t keysOffset = _fileKeysOffset(header->order);
+	tCoord_t * shape = (tCoord_t *)(header + 1);
+	tKey_t * keys = (tKey_t *)((char *)map + keysOffset);
+	float * values = (float *)(keys + nnz);
+
+	Tensor * T = tensorNew(type, header->order, shape);
 	if (!T || !T->values) {
 		printf("something is wrong\n");
-		free(shape);
+		tensorFree(T);
+		munmap(map, size);
+		return 0;
+	}
+	if (type == sortedCOO && header->flags & TENSOR_FILE_SORTED) {
+		cooAttach(T, nnz, keys, values, map, size);
+		return T;
+	}
+
+	tCoord_t * coords = malloc((nnz * T->order + 1) * sizeof(tCoord_t));
+	if (!coords) {
+		printf("allocation error\n");
+		tensorFree(T);
+		munmap(map, size);
+		return 0;
+	}
+	for (size_t i = 0; i < nnz; i++)
+		tensorKey2Coords(T, &coords[i * T->order], keys[i]);
+	if (!tensorBuild(T, nnz, coords, values)) {
+		printf("failed to insert values from \"%s\"\n", filename);
+		tensorFree(T);
+		T = 0;
+	}
+	free(coords);
+	munmap(map, size);
+	return T;
+}
+
+tensorFile * tensorFileOpen(const char * filename) {
+	tensorFile * f = calloc(1, sizeof(tensorFile));
+	FILE * fp = fopen(filename, "rb");
+	struct stat st;
+	tensorFileHeader header;
+	if (!f || !fp || fstat(fileno(fp), &st) ||
+	    fread(&header, sizeof(header), 1, fp) != 1 ||
+	    !_fileHeaderValid(&header, st.st_size)) {
+		printf("failed to open \"%s\" as a tensor file\n", filename);
+		if (fp)
+			fclose(fp);
+		free(f);
+		return 0;
+	}
+	tCoord_t * shape = malloc((header.order + 1) * sizeof(tCoord_t));
+	if (shape && fread(shape, sizeof(tCoord_t), header.order, fp) ==
+	                 header.order)
+		f->T = tensorNew(sortedCOO, header.order, shape);
+	free(shape);
+	if (!f->T) {
+		printf("failed to read the shape of \"%s\"\n", filename);
 		fclose(fp);
+		free(f);
 		return 0;
 	}
+	f->fp = fp;
+	f->nnz = header.nnz;
+	f->sorted = header.flags & TENSOR_FILE_SORTED;
+	return f;
+}
 
-	tCoord_t * coords = shape;
-	int scanned;
-	float value;
-	while (true) {
-		scanned = 0;
-		for (tMode_t m = 0; m < order; m++) {
-			scanned += fscanf(fp, "%u, ", &coords[m]);
+size_t tensorFileRead(tensorFile * f, size_t first, size_t n, tKey_t * keys,
+                      float * values) {
+	if (!f || f->spill || first >= f->nnz)
+		return 0;
+	if (n > f->nnz - first)
+		n = f->nnz - first;
+	off_t keysOffset = _fileKeysOffset(f->T->order);
+	off_t valuesOffset = keysOffset + f->nnz * sizeof(tKey_t);
+	if (fseeko(f->fp, keysOffset + first * sizeof(tKey_t), SEEK_SET) ||
+	    fread(keys, sizeof(tKey_t), n, f->fp) != n ||
+	    fseeko(f->fp, valuesOffset + first * sizeof(float), SEEK_SET) ||
+	    fread(values, sizeof(float), n, f->fp) != n)
+		return 0;
+	return n;
+}
+
+// The keys are written in place as they come, but the values have to
+// follow all of them, so they wait in a temporary file until closing.
+tensorFile * tensorFileCreate(const char * filename, Tensor * T) {
+	tensorFile * f = calloc(1, sizeof(tensorFile));
+	if (f) {
+		f->T = tensorNew(sortedCOO, T->order, T->shape);
+		f->fp = fopen(filename, "wb");
+		f->spill = tmpfile();
+		f->sorted = true;
+		f->storage = T->type;
+	}
+	static const char padding[16] = {0};
+	size_t shapeEnd = sizeof(tensorFileHeader) + T->order * sizeof(tCoord_t);
+	size_t padded = _fileKeysOffset(T->order) - shapeEnd;
+	tensorFileHeader header = {0}; // filled in on closing
+	if (!f || !f->T || !f->fp || !f->spill ||
+	    fwrite(&header, sizeof(header), 1, f->fp) != 1 ||
+	    fwrite(T->shape, sizeof(tCoord_t), T->order, f->fp) != T->order ||
+	    fwrite(padding, 1, padded, f->fp) != padded) {
+		printf("failed to open \"%s\" for writing\n", filename);
+		if (f) {
+			tensorFree(f->T);
+			if (f->fp)
+				fclose(f->fp);
+			if (f->spill)
+				fclose(f->spill);
 		}
-		scanned += fscanf(fp, "%f\n", &value);
+		free(f);
+		return 0;
+	}
+	return f;
+}
 
-		if (scanned == order + 1)
-			tensorSet(T, coords, value);
-		else
-			break;
+bool tensorFileAppend(tensorFile * f, size_t n, tKey_t * keys,
+                      float * values) {
+	if (!f || !f->spill)
+		return false;
+	for (size_t i = 0; i < n && f->sorted; i++) {
+		if (f->nnz + i && keys[i] <= f->lastKey)
+			f->sorted = false;
+		f->lastKey = keys[i];
 	}
+	if (fwrite(keys, sizeof(tKey_t), n, f->fp) != n ||
+	    fwrite(values, sizeof(float), n, f->spill) != n)
+		return false;
+	f->nnz += n;
+	return true;
+}
 
-	free(coords);
-	fclose(fp);
-	return T;
+bool tensorFileClose(tensorFile * f) {
+	if (!f)
+		return false;
+	bool success = true;
+	if (f->spill) {
+		float values[4096];
+		rewind(f->spill);
+		for (size_t i = 0; success && i < f->nnz; i += 4096) {
+			size_t n = f->nnz - i < 4096 ? f->nnz - i : 4096;
+			success = fread(values, sizeof(float), n, f->spill) == n &&
+			          fwrite(values, sizeof(float), n, f->fp) == n;
+		}
+		fclose(f->spill);
+
+		tensorFileHeader header = {.version = TENSOR_FILE_VERSION,
+		                           .order = f->T->order,
+		                           .keyBytes = sizeof(tKey_t),
+		                           .flags = f->sorted ? TENSOR_FILE_SORTED : 0,
+		                           .storage = f->storage,
+		                           .nnz = f->nnz};
+		memcpy(header.magic, _fileMagic, sizeof(header.magic));
+		success = success && !fseeko(f->fp, 0, SEEK_SET) &&
+		          fwrite(&header, sizeof(header), 1, f->fp) == 1;
+		if (!success)
+			printf("failed to write a tensor file\n");
+	}
+	success = !fclose(f->fp) && success;
+	tensorFree(f->T);
+	free(f);
+	return success;
 }
@@ -1,15 +1,36 @@
 #pragma once
+#include "stats.h"
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 enum storageType {
 	probingHashtable,
 	BPlusTree,
+	compressedSparseFiber,
+	sortedCOO,
+	swissHashtable,
+	mortonBPlusTree, // B+ tree keyed in Z-order, no fast prefix ranges
+	concurrentHashtable, // safe for many threads to write at once
 };
 
 typedef unsigned short tMode_t;
 typedef unsigned int tCoord_t;
 
+// Coordinates packed into one integer, mode 0 in the highest bits so keys
+// sort like coordinates. Each mode gets just enough bits for its length.
+#ifdef TENSOR_WIDE_KEYS
+typedef unsigned __int128 tKey_t; // for shapes that don't fit in 64 bits
+#else
+typedef unsigned long long tKey_t;
+#endif
+#define TENSOR_KEY_BITS (sizeof(tKey_t) * 8)
+
+#ifndef TENSOR_READ_MIN_CHUNK
+#define TENSOR_READ_MIN_CHUNK (1 << 16) // bytes
+#endif
+#define TENSOR_WRITE_BUFFER (1 << 20) // bytes
+
 typedef struct tensorEntry {
 	tCoord_t * coords;
 	float value;
@@ -21,6 +42,9 @@ typedef struct Tensor {
 	enum storageType type;
 	size_t entryCount;
 	void * values;
+	unsigned char * keyBits; // width of each mode's field in a key
+	unsigned short keyWidth; // sum of keyBits
+	Stats * stats; // if set, the work of calls on this tensor is added here
 } Tensor;
 
 typedef struct tensorIterator {
@@ -29,16 +53,83 @@ typedef struct tensorIterator {
 	void (*cleanup)(void *);
 } tensorIterator;
 
-// remember to set ht_capacity for probing hashtable
+// Iterates the entries whose first prefixLength coordinates equal prefix.
+// Sorted backends seek straight to them; hashtables scan and filter.
+typedef struct tensorRange {
+	Tensor * T;
+	tensorIterator iter;
+	void * context;
+	tCoord_t * prefix;
+	tMode_t prefixLength;
+	bool filter; // true if next has to skip entries outside the prefix
+} tensorRange;
+
+// fails if the shape needs more than TENSOR_KEY_BITS to pack a key
 Tensor * tensorNew(enum storageType type, tMode_t order, tCoord_t * shape);
 void tensorFree(Tensor * T);
-bool tensorSet(Tensor * T, tCoord_t * coords, float value);
+bool tensorSet(Tensor * T, tCoord_t * coords, float value); // 0 deletes
+bool tensorDelete(Tensor * T, tCoord_t * coords);
+// adds value to an entry, atomically for the concurrent hashtable
+bool tensorAdd(Tensor * T, tCoord_t * coords, float value);
+// bulk insert n entries (n * order coords), faster than tensorSet for
+// the B+ tree, CSF and sorted COO. Inserts nothing and fails if any
+// coords are out of range.
+bool tensorBuild(Tensor * T, size_t n, tCoord_t * coords, float * values);
 float tensorGet(Tensor * T, tCoord_t * coords);
+// n lookups or updates at once (n * order coords, applied in order), so
+// the backend can overlap their cache misses
+void tensorGetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values);
+bool tensorSetBatch(Tensor * T, tCoord_t * coords, size_t n, float * values);
+tKey_t tensorCoords2Key(Tensor * T, tCoord_t * coords);
+void tensorKey2Coords(Tensor * T, tCoord_t * coords, tKey_t key);
+// Z-order key with the modes' bits interleaved, mode 0 highest
+tKey_t tensorCoords2Morton(Tensor * T, tCoord_t * coords);
+void tensorMorton2Coords(Tensor * T, tCoord_t * coords, tKey_t key);
+// The low key bits left to the modes after the first p. Row-major keys
+// sharing their first p coordinates run from the key with the rest zeroed
+// to that key | mask, which can be the largest key there is.
+tKey_t tensorKeyMask(Tensor * T, tMode_t p);
 void coordsPrint(Tensor * T, tCoord_t * coords);
 bool tensorPrintMetadata(Tensor * T);
 void tensorPrint(Tensor * T);
 size_t tensorSize(Tensor * T);
+tensorIterator tensorGetIterator(Tensor * T);
+tensorRange * tensorRangeNew(Tensor * T, tCoord_t * prefix, tMode_t p);
+tensorEntry tensorRangeNext(tensorRange * range);
+void tensorRangeFree(tensorRange * range);
 
-// tensorRead automatically sets ht_capacity based on file length
-bool tensorWrite(Tensor * T, const char * filename);
+// sorted writes the entries in key order, otherwise in iteration order
+bool tensorWrite(Tensor * T, const char * filename, bool sorted);
 Tensor * tensorRead(enum storageType type, const char * filename);
+// parses the values with up to threads threads, each taking at least
+// TENSOR_READ_MIN_CHUNK bytes of them
+Tensor * tensorReadParallel(enum storageType type, const char * filename,
+                            unsigned int threads);
+// Binary files hold the packed keys and values, optionally sorted by key.
+// A sorted one read as a sorted COO is memory-mapped and used in place,
+// read-only, instead of being parsed.
+bool tensorWriteBinary(Tensor * T, const char * filename, bool sorted);
+Tensor * tensorReadBinary(enum storageType type, const char * filename);
+
+// A binary file streamed a chunk at a time, for tensors too big to load.
+// T is an empty tensor of the file's shape, for packing and unpacking
+// keys. Files are either opened for reading or created for appending.
+typedef struct tensorFile {
+	Tensor * T;
+	FILE * fp;
+	FILE * spill; // values waiting for the keys to end, if writing
+	size_t nnz;
+	bool sorted; // keys strictly ascending
+	tKey_t lastKey;
+	enum storageType storage;
+} tensorFile;
+
+tensorFile * tensorFileOpen(const char * filename);
+// reads up to n entries from entry first on, returning how many it did
+size_t tensorFileRead(tensorFile * f, size_t first, size_t n, tKey_t * keys,
+                      float * values);
+// a file with T's shape, marked as written from T's storage type
+tensorFile * tensorFileCreate(const char * filename, Tensor * T);
+bool tensorFileAppend(tensorFile * f, size_t n, tKey_t * keys, float * values);
+// finishes writing, if created, and frees f either way
+bool tensorFileClose(tensorFile * f);
@@ -1,11 +1,294 @@
 #include "tensorMath.h"
 #include "stats.h"
 #include "tensor.h"
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#define MATH_BATCH 64 // coordinates per tensorGetBatch in the dense loops
+
+// Output entries collected as the dense loops produce them, then loaded
+// with one tensorBuild so the B+ tree can be built bottom-up.
+typedef struct outputBuffer {
+	size_t count;
+	size_t capacity;
+	tCoord_t * coords; // order coords per entry
+	float * values;
+} outputBuffer;
+
+static bool _outputAppend(outputBuffer * out, tMode_t order,
+                          tCoord_t * coords, float value) {
+	if (out->count == out->capacity) {
+		size_t capacity = out->capacity ? 2 * out->capacity : 1024;
+		tCoord_t * newCoords =
+		    realloc(out->coords, capacity * (order + 1) * sizeof(tCoord_t));
+		if (!newCoords)
+			return false;
+		out->coords = newCoords;
+		float * newValues = realloc(out->values, capacity * sizeof(float));
+		if (!newValues)
+			return false;
+		out->values = newValues;
+		out->capacity = capacity;
+	}
+	for (tMode_t m = 0; m < order; m++)
+		out->coords[out->count * order + m] = coords[m];
+	out->values[out->count] = value;
+	out->count++;
+	return true;
+}
+
+static void _outputFree(outputBuffer * out) {
+	free(out->coords);
+	free(out->values);
+	*out = (outputBuffer){0};
+}
+
+// Copies coords into n rows of batch, with modes a and b of row i both
+// set to k + i, so a run of the inner k loop becomes one batched lookup.
+static void _fillBatch(tCoord_t * batch, tCoord_t * coords, tMode_t order,
+                       tMode_t a, tMode_t b, tCoord_t k, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		tCoord_t * row = &batch[i * order];
+		for (tMode_t m = 0; m < order; m++)
+			row[m] = coords[m];
+		row[a] = k + i;
+		row[b] = k + i;
+	}
+}
+
+// One thread's share of a dense trace or contraction: output coordinates
+// first to last in the order the serial loop visits them (mode 0
+// fastest), each summed over contracted indices kFirst to kLast.
+typedef struct denseJob {
+	Tensor * A;
+	Tensor * B; // NULL for a trace, which reads modes a and b of A
+	tMode_t a;
+	tMode_t b;
+	Tensor * C;
+	size_t first;
+	size_t last;
+	tCoord_t kFirst;
+	tCoord_t kLast;
+	outputBuffer out;
+	bool direct; // add straight into C, which takes concurrent writers
+	Stats stats; // counted on this job's thread
+	bool threaded;
+	bool failed;
+} denseJob;
+
+static void _linearToCoords(size_t i, Tensor * C, tCoord_t * coords) {
+	for (tMode_t m = 0; m < C->order; m++) {
+		coords[m] = i % C->shape[m];
+		i /= C->shape[m];
+	}
+}
+
+static size_t _coordsToLinear(tCoord_t * coords, Tensor * C) {
+	size_t i = 0;
+	for (tMode_t m = C->order; m-- > 0;)
+		i = i * C->shape[m] + coords[m];
+	return i;
+}
+
+// Spreads output coordinates over the free modes of the inputs. The
+// contracted modes are filled in later by _fillBatch.
+static void _splitCoords(denseJob * job, tCoord_t * CCoords,
+                         tCoord_t * ACoords, tCoord_t * BCoords) {
+	tMode_t CMode = 0;
+	for (tMode_t m = 0; m < job->A->order; m++)
+		if (m != job->a && (job->B || m != job->b))
+			ACoords[m] = CCoords[CMode++];
+	if (job->B)
+		for (tMode_t m = 0; m < job->B->order; m++)
+			if (m != job->b)
+				BCoords[m] = CCoords[CMode++];
+}
+
+static void * _denseWork(void * arg) {
+	denseJob * job = arg;
+	Tensor * A = job->A;
+	Tensor * B = job->B;
+	tMode_t BOrder = B ? B->order : 1;
+	Stats before = statsGet();
+	tCoord_t * CCoords = calloc(job->C->order + 1, sizeof(tCoord_t));
+	tCoord_t * ACoords = calloc(A->order, sizeof(tCoord_t));
+	tCoord_t * BCoords = calloc(BOrder, sizeof(tCoord_t));
+	tCoord_t * ABatch = calloc(MATH_BATCH * A->order, sizeof(tCoord_t));
+	tCoord_t * BBatch = calloc(MATH_BATCH * BOrder, sizeof(tCoord_t));
+	float AValues[MATH_BATCH];
+	float BValues[MATH_BATCH];
+	job->failed = !CCoords || !ACoords || !BCoords || !ABatch || !BBatch;
+
+	if (!job->failed)
+		_linearToCoords(job->first, job->C, CCoords);
+	for (size_t i = job->first; i < job->last && !job->failed; i++) {
+		_splitCoords(job, CCoords, ACoords, BCoords);
+		float accumulator = 0;
+		for (tCoord_t k = job->kFirst; k < job->kLast; k += MATH_BATCH) {
+			size_t n = job->kLast - k;
+			if (n > MATH_BATCH)
+				n = MATH_BATCH;
+			if (B) {
+				_fillBatch(ABatch, ACoords, A->order, job->a, job->a, k, n);
+				_fillBatch(BBatch, BCoords, B->order, job->b, job->b, k, n);
+				tensorGetBatch(A, ABatch, n, AValues);
+				tensorGetBatch(B, BBatch, n, BValues);
+				for (size_t j = 0; j < n; j++) {
+					float val = AValues[j] * BValues[j];
+					if (val) {
+						STATS_COUNT(add, 1);
+						STATS_COUNT(mul, 1);
+						accumulator += val;
+					}
+				}
+			} else {
+				_fillBatch(ABatch, ACoords, A->order, job->a, job->b, k, n);
+				tensorGetBatch(A, ABatch, n, AValues);
+				for (size_t j = 0; j < n; j++) {
+					if (AValues[j]) {
+						STATS_COUNT(add, 1);
+						accumulator += AValues[j];
+					}
+				}
+			}
+		}
+		if (accumulator && job->direct)
+			job->failed = !tensorAdd(job->C, CCoords, accumulator);
+		else if (accumulator)
+			job->failed =
+			    !_outputAppend(&job->out, job->C->order, CCoords, accumulator);
+
+		// get next coordinates
+		STATS_COUNT(add, 1);
+		STATS_COUNT(cmp, 1);
+		for (tMode_t m = 0; m < job->C->order; m++) {
+			if (++CCoords[m] < job->C->shape[m])
+				break;
+			CCoords[m] = 0;
+		}
+	}
+
+	free(CCoords);
+	free(ACoords);
+	free(BCoords);
+	free(ABatch);
+	free(BBatch);
+	job->stats = statsSince(before);
+	return 0;
+}
+
+// Adds the partial sums in from into into. Both are in output order, as
+// every job walks the whole output range when the sum is split.
+static bool _mergePartials(outputBuffer * into, outputBuffer * from,
+                           Tensor * C) {
+	outputBuffer merged = {0};
+	size_t i = 0;
+	size_t j = 0;
+	bool success = true;
+	while (success && (i < into->count || j < from->count)) {
+		tCoord_t * x = i < into->count ? &into->coords[i * C->order] : 0;
+		tCoord_t * y = j < from->count ? &from->coords[j * C->order] : 0;
+		size_t xi = x ? _coordsToLinear(x, C) : SIZE_MAX;
+		size_t yi = y ? _coordsToLinear(y, C) : SIZE_MAX;
+		STATS_COUNT(cmp, 1);
+		if (xi < yi) {
+			success = _outputAppend(&merged, C->order, x, into->values[i++]);
+		} else if (yi < xi) {
+			success = _outputAppend(&merged, C->order, y, from->values[j++]);
+		} else {
+			STATS_COUNT(add, 1);
+			float sum = into->values[i++] + from->values[j++];
+			if (sum)
+				success = _outputAppend(&merged, C->order, x, sum);
+		}
+	}
+	_outputFree(into);
+	*into = merged;
+	return success;
+}
+
+// Fills C, which has the free modes of A and then of B (or of A alone for
+// a trace), splitting the work over up to threads threads.
+// Each thread takes a contiguous run of output coordinates and sums them
+// exactly like the serial loop, so the result is bit-identical. With
+// fewer output coordinates than threads, and only if deterministic is
+// false, each thread instead sums a slice of the contracted index for
+// every output and the partial sums are added up afterwards, which can
+// round differently.
+// A concurrent hashtable output is written by the threads directly, with
+// partial sums added atomically, so their buffers stay empty.
+static bool _denseFill(Tensor * C, Tensor * A, Tensor * B, tMode_t a,
+                       tMode_t b, unsigned int threads, bool deterministic) {
+	size_t volume = 1;
+	for (tMode_t m = 0; m < C->order; m++)
+		volume *= C->shape[m];
+	tCoord_t kCount = A->shape[a];
+	bool splitSum = !deterministic && volume < threads;
+	size_t parts = splitSum ? kCount : volume;
+	if (threads > parts)
+		threads = parts;
+	if (!threads)
+		threads = 1;
+
+	denseJob * jobs = calloc(threads, sizeof(denseJob));
+	pthread_t * ids = calloc(threads, sizeof(pthread_t));
+	if (!jobs || !ids) {
+		free(jobs);
+		free(ids);
+		return false;
+	}
+	for (unsigned int t = 0; t < threads; t++) {
+		jobs[t] = (denseJob){.A = A, .B = B, .a = a, .b = b, .C = C};
+		jobs[t].direct = C->type == concurrentHashtable;
+		jobs[t].first = splitSum ? 0 : volume * t / threads;
+		jobs[t].last = splitSum ? volume : volume * (t + 1) / threads;
+		jobs[t].kFirst = splitSum ? (size_t)kCount * t / threads : 0;
+		jobs[t].kLast = splitSum ? (size_t)kCount * (t + 1) / threads : kCount;
+	}
+	// the calling thread takes the first job, and any that fail to start
+	for (unsigned int t = 1; t < threads; t++)
+		jobs[t].threaded = !pthread_create(&ids[t], 0, _denseWork, &jobs[t]);
+	_denseWork(&jobs[0]);
+	for (unsigned int t = 1; t < threads; t++)
+		if (!jobs[t].threaded)
+			_denseWork(&jobs[t]);
+	for (unsigned int t = 1; t < threads; t++) {
+		if (!jobs[t].threaded)
+			continue;
+		pthread_join(ids[t], 0);
+		statsAdd(jobs[t].stats);
+	}
+
+	// stitch the per-thread outputs together in output order
+	bool success = !jobs[0].failed;
+	outputBuffer out = jobs[0].out;
+	for (unsigned int t = 1; t < threads; t++) {
+		success = success && !jobs[t].failed;
+		if (success && splitSum)
+			success = _mergePartials(&out, &jobs[t].out, C);
+		for (size_t i = 0; success && !splitSum && i < jobs[t].out.count; i++)
+			success = _outputAppend(&out, C->order,
+			                        &jobs[t].out.coords[i * C->order],
+			                        jobs[t].out.values[i]);
+		_outputFree(&jobs[t].out);
+	}
+	free(jobs);
+	free(ids);
+	success = success && tensorBuild(C, out.count, out.coords, out.values);
+	_outputFree(&out);
+	return success;
+}
+
 Tensor * tensorTrace(enum storageType type, Tensor * T, tMode_t a, tMode_t b) {
+	return tensorTraceParallel(type, T, a, b, 1, true);
+}
+
+static Tensor * _traceParallel(enum storageType type, Tensor * T, tMode_t a,
+                               tMode_t b, unsigned int threads,
+                               bool deterministic) {
 	if (!T || !T->values) {
 		printf("Tried to calculate trace of invalid tensor\n");
 		return 0;
@@ -20,10 +303,9 @@ Tensor * tensorTrace(enum storageType type, Tensor * T, tMode_t a, tMode_t b) {
 	}
 
 	// contsruct shape of result tensor
-	tCoord_t * CShape = calloc(T->order - 2, sizeof(tCoord_t));
+	tCoord_t * CShape = calloc(T->order - 1, sizeof(tCoord_t));
 	if (!CShape) {
 		printf("failed to allocate\n");
-		free(CShape);
 		return 0;
 	}
 	tMode_t CMode = 0;
@@ -34,85 +316,134 @@ Tensor * tensorTrace(enum storageType type, Tensor * T, tMode_t a, tMode_t b) {
 		CMode++;
 	}
 
-	// allocate tensors and iteration coordinates
-	Tensor * C =
-	    tensorNew(type, T->order - 2, CShape);
-	tCoord_t * CCoords = calloc(C->order, sizeof(tCoord_t));
-	tCoord_t * TCoords = calloc(T->order, sizeof(tCoord_t));
+	Tensor * C = tensorNew(type, T->order - 2, CShape);
 	free(CShape);
-	if (!TCoords || !CCoords || !C) {
+	if (!C) {
+		printf("failed to allocate\n");
+		return 0;
+	}
+	if (!_denseFill(C, T, 0, a, b, threads, deterministic)) {
+		printf("failed to insert value\n");
+		tensorFree(C);
+		return 0;
+	}
+	return C;
+}
+
+Tensor * tensorTraceParallel(enum storageType type, Tensor * T, tMode_t a,
+                             tMode_t b, unsigned int threads,
+                             bool deterministic) {
+	statsProbe probe;
+	statsBegin(&probe);
+	Tensor * C = _traceParallel(type, T, a, b, threads, deterministic);
+	statsLastOperation = statsEnd(&probe);
+	return C;
+}
+
+// Same result as tensorTrace, but in a single pass over T's nonzeros.
+// Only entries on the diagonal of modes a and b contribute, so work is
+// proportional to nnz(T) instead of the volume of the output.
+static Tensor * _traceSparse(enum storageType type, Tensor * T, tMode_t a,
+                             tMode_t b) {
+	if (!T || !T->values) {
+		printf("Tried to calculate trace of invalid tensor\n");
+		return 0;
+	}
+	if (T->order < 2 || a >= T->order || b >= T->order) {
+		printf("Trace modes out of range\n");
+		return 0;
+	}
+	if (a == b || T->shape[a] != T->shape[b]) {
+		printf("Tried to trace incompatible modes\n");
+		return 0;
+	}
+
+	// construct shape of result tensor
+	tCoord_t * CShape = calloc(T->order - 1, sizeof(tCoord_t));
+	if (!CShape) {
+		printf("failed to allocate\n");
+		return 0;
+	}
+	tMode_t CMode = 0;
+	for (tMode_t m = 0; m < T->order; m++) {
+		if (m == a || m == b)
+			continue;
+		CShape[CMode] = T->shape[m];
+		CMode++;
+	}
+
+	Tensor * C = tensorNew(type, T->order - 2, CShape);
+	tCoord_t * CCoords = calloc(T->order - 1, sizeof(tCoord_t));
+	free(CShape);
+	if (!C || !CCoords) {
 		printf("failed to allocate\n");
 		tensorFree(C);
 		free(CCoords);
-		free(TCoords);
 		return 0;
 	}
 
-	// iterate through all the coordinates
-	bool done = (C->order == 0);
-	while (true) {
-		float accumulator = 0;
-		// actual trace logic
-		for (tCoord_t k = 0; k < T->shape[a]; k++) {
-			TCoords[a] = k;
-			TCoords[b] = k;
-			float val = tensorGet(T, TCoords);
-			if (val) {
-				statsGlobal.add++;
-				accumulator += val;
-			}
-		}
-		if (accumulator) {
-			bool success = tensorSet(C, CCoords, accumulator);
-			if (!success) {
-				printf("failed to insert value\n");
-				tensorFree(C);
-				free(CCoords);
-				free(TCoords);
-				return 0;
-			}
+	tensorIterator iter = tensorGetIterator(T);
+	void * context = iter.init(T);
+	tensorEntry item = iter.next(T, context);
+	while (item.coords != 0) {
+		STATS_COUNT(cmp, 1);
+		if (item.coords[a] != item.coords[b] || !item.value) {
+			item = iter.next(T, context);
+			continue;
 		}
 
-		// get next coordinates or finish
-		statsGlobal.add++;
-		statsGlobal.cmp++;
 		CMode = 0;
-		for (tMode_t mode = 0; CMode < C->order; mode++) {
-			if (mode == a || mode == b)
-				continue;
-			CCoords[CMode]++;
-			TCoords[mode]++;
-			if (TCoords[mode] == T->shape[mode]) {
-				if (CMode == C->order - 1) {
-					done = true;
-					break;
-				}
-				TCoords[mode] = 0;
-				CCoords[CMode] = 0;
-				CMode++;
-				continue;
-			}
-			break;
+		for (tMode_t m = 0; m < T->order; m++)
+			if (m != a && m != b)
+				CCoords[CMode++] = item.coords[m];
+
+		STATS_COUNT(add, 1);
+		float accumulator = tensorGet(C, CCoords) + item.value;
+		if (!tensorSet(C, CCoords, accumulator)) {
+			printf("failed to insert value\n");
+			iter.cleanup(context);
+			tensorFree(C);
+			free(CCoords);
+			return 0;
 		}
-		if (done)
-			break;
+		item = iter.next(T, context);
 	}
-	free(TCoords);
+	iter.cleanup(context);
+
 	free(CCoords);
 	return C;
 }
 
+Tensor * tensorTraceSparse(enum storageType type, Tensor * T, tMode_t a,
+                           tMode_t b) {
+	statsProbe probe;
+	statsBegin(&probe);
+	Tensor * C = _traceSparse(type, T, a, b);
+	statsLastOperation = statsEnd(&probe);
+	return C;
+}
+
 Tensor * tensorContract(enum storageType type, Tensor * A, Tensor * B,
                         tMode_t a, tMode_t b) {
+	return tensorContractParallel(type, A, B, a, b, 1, true);
+}
+
+static Tensor * _contractParallel(enum storageType type, Tensor * A, Tensor * B,
+                                  tMode_t a, tMode_t b, unsigned int threads,
+                                  bool deterministic) {
 	if (!A || !A->values || !B || !B->values)
 		return 0;
-	if (a > A->order || b > B->order)
+	if (a >= A->order || b >= B->order)
 		return 0;
 	if (A->shape[a] != B->shape[b])
 		return 0;
 
 	// construct shape of result tensor
-	tCoord_t * CShape = calloc(A->order + B->order - 2, sizeof(tCoord_t));
+	tCoord_t * CShape = calloc(A->order + B->order - 1, sizeof(tCoord_t));
+	if (!CShape) {
+		printf("failed to allocate\n");
+		return 0;
+	}
 	tMode_t CMode = 0;
 	for (tMode_t m = 0; m < A->order; m++) {
 		if (m == a)
@@ -127,90 +458,791 @@ Tensor * tensorContract(enum storageType type, Tensor * A, Tensor * B,
 		CMode++;
 	}
 
-	// allocate tensor and iteration coordinates
 	Tensor * C = tensorNew(type, A->order + B->order - 2, CShape);
-	tCoord_t * ACoords = calloc(A->order, sizeof(tCoord_t));
-	tCoord_t * BCoords = calloc(B->order, sizeof(tCoord_t));
-	tCoord_t * CCoords = calloc(C->order, sizeof(tCoord_t));
 	free(CShape);
-	if (!ACoords || !BCoords || !CCoords || !C || !C->values) {
+	if (!C || !C->values) {
 		printf("failed to allocate\n");
 		tensorFree(C);
-		free(ACoords);
-		free(BCoords);
+		return 0;
+	}
+	if (!_denseFill(C, A, B, a, b, threads, deterministic)) {
+		printf("failed to insert value\n");
+		tensorFree(C);
+		return 0;
+	}
+	return C;
+}
+
+Tensor * tensorContractParallel(enum storageType type, Tensor * A, Tensor * B,
+                                tMode_t a, tMode_t b, unsigned int threads,
+                                bool deterministic) {
+	statsProbe probe;
+	statsBegin(&probe);
+	Tensor * C = _contractParallel(type, A, B, a, b, threads, deterministic);
+	statsLastOperation = statsEnd(&probe);
+	return C;
+}
+
+typedef unsigned long long fiberKey_t;
+
+// Entries of a tensor grouped by their indices along a set of modes, so
+// every entry sharing those indices is contiguous (like CSR, but for any
+// modes). The grouped modes are dropped from the stored coordinates.
+typedef struct fiberIndex {
+	tMode_t order;      // coordinates stored per entry
+	size_t fiberCount;  // number of fibers (key space if keys is NULL)
+	fiberKey_t * keys;  // sorted fiber keys, or NULL if indexed by key
+	size_t * offsets;   // fiber f is in [offsets[f], offsets[f+1])
+	tCoord_t * coords;  // order coordinates per entry
+	float * values;
+} fiberIndex;
+
+typedef struct fiberSortItem {
+	fiberKey_t key;
+	size_t pos;
+} fiberSortItem;
+
+// mixed-radix index of the given modes, so equal indices give equal keys
+static fiberKey_t _fiberKey(tCoord_t * coords, tCoord_t * shape, tMode_t n,
+                            tMode_t * modes) {
+	fiberKey_t key = 0;
+	for (tMode_t i = 0; i < n; i++) {
+		STATS_COUNT(mul, 1);
+		STATS_COUNT(add, 1);
+		key = key * shape[modes[i]] + coords[modes[i]];
+	}
+	return key;
+}
+
+static int _fiberSortCompare(const void * x, const void * y) {
+	const fiberSortItem * a = x;
+	const fiberSortItem * b = y;
+	STATS_COUNT(cmp, 1);
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+	return a->pos < b->pos ? -1 : a->pos > b->pos;
+}
+
+static void _fiberIndexFree(fiberIndex * idx) {
+	free(idx->keys);
+	free(idx->offsets);
+	free(idx->coords);
+	free(idx->values);
+}
+
+// Groups T's nonzeros by their coordinates along `modes`. Small key spaces
+// are counting-sorted and indexed directly by key; large ones are sorted
+// and the distinct keys are binary searched by _fiberFind. Either way,
+// entries keep their iteration order within a fiber.
+static bool _fiberIndexBuild(fiberIndex * idx, Tensor * T, tMode_t n,
+                             tMode_t * modes) {
+	tensorIterator iter = tensorGetIterator(T);
+	size_t count = T->entryCount;
+	idx->order = T->order - n;
+	idx->coords = malloc((count * idx->order + 1) * sizeof(tCoord_t));
+	idx->values = malloc((count + 1) * sizeof(float));
+	fiberSortItem * items = malloc((count + 1) * sizeof(fiberSortItem));
+	tCoord_t * staged = malloc((count * idx->order + 1) * sizeof(tCoord_t));
+	float * stagedValues = malloc((count + 1) * sizeof(float));
+	bool * grouped = calloc(T->order, sizeof(bool));
+	if (!idx->coords || !idx->values || !items || !staged || !stagedValues ||
+	    !grouped) {
+		_fiberIndexFree(idx);
+		free(items);
+		free(staged);
+		free(stagedValues);
+		free(grouped);
+		return false;
+	}
+	fiberKey_t volume = 1;
+	for (tMode_t i = 0; i < n; i++) {
+		grouped[modes[i]] = true;
+		volume *= T->shape[modes[i]];
+	}
+
+	// stage entries in iteration order alongside their fiber keys
+	size_t pos = 0;
+	void * context = iter.init(T);
+	tensorEntry item = iter.next(T, context);
+	while (item.coords != 0 && pos < count) {
+		items[pos].key = _fiberKey(item.coords, T->shape, n, modes);
+		items[pos].pos = pos;
+		tCoord_t * dst = &staged[pos * idx->order];
+		for (tMode_t m = 0; m < T->order; m++)
+			if (!grouped[m])
+				*dst++ = item.coords[m];
+		stagedValues[pos] = item.value;
+		STATS_COUNT(mem, 1);
+		pos++;
+		item = iter.next(T, context);
+	}
+	iter.cleanup(context);
+	count = pos;
+	free(grouped);
+
+	STATS_COUNT(cmp, 1);
+	if (volume <= 2 * count + 1024) {
+		// counting sort, fibers are addressed by key directly
+		idx->fiberCount = volume;
+		idx->offsets = calloc(volume + 1, sizeof(size_t));
+		size_t * cursor = malloc((volume + 1) * sizeof(size_t));
+		fiberSortItem * sorted = malloc((count + 1) * sizeof(fiberSortItem));
+		if (!idx->offsets || !cursor || !sorted) {
+			_fiberIndexFree(idx);
+			free(cursor);
+			free(sorted);
+			free(items);
+			free(staged);
+			free(stagedValues);
+			return false;
+		}
+		for (size_t i = 0; i < count; i++)
+			idx->offsets[items[i].key + 1]++;
+		for (fiberKey_t k = 0; k < volume; k++) {
+			STATS_COUNT(add, 1);
+			idx->offsets[k + 1] += idx->offsets[k];
+			cursor[k] = idx->offsets[k];
+		}
+		for (size_t i = 0; i < count; i++)
+			sorted[cursor[items[i].key]++] = items[i];
+		free(cursor);
+		free(items);
+		items = sorted;
+	} else {
+		qsort(items, count, sizeof(fiberSortItem), _fiberSortCompare);
+		idx->keys = malloc((count + 1) * sizeof(fiberKey_t));
+		idx->offsets = malloc((count + 1) * sizeof(size_t));
+		if (!idx->keys || !idx->offsets) {
+			_fiberIndexFree(idx);
+			free(items);
+			free(staged);
+			free(stagedValues);
+			return false;
+		}
+		size_t fibers = 0;
+		for (size_t i = 0; i < count; i++) {
+			STATS_COUNT(cmp, 1);
+			if (i && items[i].key == items[i - 1].key)
+				continue;
+			idx->keys[fibers] = items[i].key;
+			idx->offsets[fibers] = i;
+			fibers++;
+		}
+		idx->offsets[fibers] = count;
+		idx->fiberCount = fibers;
+	}
+
+	// gather staged entries into fiber order
+	for (size_t i = 0; i < count; i++) {
+		size_t src = items[i].pos;
+		for (tMode_t m = 0; m < idx->order; m++)
+			idx->coords[i * idx->order + m] = staged[src * idx->order + m];
+		idx->values[i] = stagedValues[src];
+		STATS_COUNT(mem, 1);
+	}
+	free(items);
+	free(staged);
+	free(stagedValues);
+	return true;
+}
+
+// Finds the range of entries whose grouped coordinates have this key.
+static bool _fiberFind(fiberIndex * idx, fiberKey_t key, size_t * begin,
+                       size_t * end) {
+	size_t f;
+	if (!idx->keys) {
+		STATS_COUNT(cmp, 1);
+		if (key >= idx->fiberCount)
+			return false;
+		f = key;
+	} else {
+		size_t lo = 0;
+		size_t hi = idx->fiberCount;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			STATS_COUNT(mem, 1);
+			STATS_COUNT(cmp, 1);
+			if (idx->keys[mid] < key)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		STATS_COUNT(cmp, 1);
+		if (lo == idx->fiberCount || idx->keys[lo] != key)
+			return false;
+		f = lo;
+	}
+	STATS_COUNT(mem, 1);
+	*begin = idx->offsets[f];
+	*end = idx->offsets[f + 1];
+	return *begin != *end;
+}
+
+// Checks that the mode pairs are in range, distinct and the same length,
+// and that their indices fit in a fiber key.
+static bool _checkModePairs(Tensor * A, Tensor * B, tMode_t n,
+                            tMode_t * aModes, tMode_t * bModes) {
+	if (n > A->order || n > B->order)
+		return false;
+	fiberKey_t volume = 1;
+	for (tMode_t i = 0; i < n; i++) {
+		if (aModes[i] >= A->order || bModes[i] >= B->order)
+			return false;
+		if (A->shape[aModes[i]] != B->shape[bModes[i]])
+			return false;
+		if (volume > ~0ULL / A->shape[aModes[i]])
+			return false;
+		volume *= A->shape[aModes[i]];
+		for (tMode_t j = 0; j < i; j++)
+			if (aModes[i] == aModes[j] || bModes[i] == bModes[j])
+				return false;
+	}
+	return true;
+}
+
+// Contracts every pair (aModes[i], bModes[i]) at once, driven by the
+// nonzeros of A. B is grouped by all of its contracted modes, so each
+// nonzero of A visits exactly the B entries that agree on every pair and
+// no intermediate tensor is built. The free modes of A followed by those
+// of B are permuted into the output by perm (identity if NULL).
+static Tensor * _contractFused(enum storageType type, Tensor * A, Tensor * B,
+                               tMode_t n, tMode_t * aModes, tMode_t * bModes,
+                               tMode_t * perm) {
+	tMode_t COrder = A->order + B->order - 2 * n;
+	tMode_t AFreeCount = A->order - n;
+	bool * contracted = calloc(A->order + B->order, sizeof(bool));
+	tCoord_t * freeShape = calloc(COrder + 1, sizeof(tCoord_t));
+	tCoord_t * CShape = calloc(COrder + 1, sizeof(tCoord_t));
+	if (!contracted || !freeShape || !CShape) {
+		printf("failed to allocate\n");
+		free(contracted);
+		free(freeShape);
+		free(CShape);
+		return 0;
+	}
+	for (tMode_t i = 0; i < n; i++) {
+		contracted[aModes[i]] = true;
+		contracted[A->order + bModes[i]] = true;
+	}
+
+	// construct shape of result tensor
+	tMode_t CMode = 0;
+	for (tMode_t m = 0; m < A->order; m++)
+		if (!contracted[m])
+			freeShape[CMode++] = A->shape[m];
+	for (tMode_t m = 0; m < B->order; m++)
+		if (!contracted[A->order + m])
+			freeShape[CMode++] = B->shape[m];
+	for (tMode_t m = 0; m < COrder; m++)
+		CShape[m] = freeShape[perm ? perm[m] : m];
+	free(freeShape);
+
+	Tensor * C = tensorNew(type, COrder, CShape);
+	tCoord_t * freeCoords = calloc(COrder + 1, sizeof(tCoord_t));
+	tCoord_t * CCoords = calloc(COrder + 1, sizeof(tCoord_t));
+	free(CShape);
+	fiberIndex BFibers = {0};
+	if (!C || !C->values || !freeCoords || !CCoords ||
+	    !_fiberIndexBuild(&BFibers, B, n, bModes)) {
+		printf("failed to allocate\n");
+		tensorFree(C);
+		free(contracted);
+		free(freeCoords);
 		free(CCoords);
 		return 0;
 	}
 
-	// iterate through all the coordinates
-	bool done = (C->order == 0);
-	while (true) {
-		float accumulator = 0;
-		// actual contraction logic
-		for (tCoord_t k = 0; k < A->shape[a]; k++) {
-			ACoords[a] = k;
-			BCoords[b] = k;
-			float val = tensorGet(A, ACoords) * tensorGet(B, BCoords);
-			if (val) {
-				statsGlobal.add++;
-				statsGlobal.mul++;
-				accumulator += val;
-			}
+	tensorIterator iter = tensorGetIterator(A);
+	void * context = iter.init(A);
+	tensorEntry item = iter.next(A, context);
+	while (item.coords != 0) {
+		size_t begin, end;
+		STATS_COUNT(cmp, 1);
+		if (!item.value ||
+		    !_fiberFind(&BFibers, _fiberKey(item.coords, A->shape, n, aModes),
+		                &begin, &end)) {
+			item = iter.next(A, context);
+			continue;
 		}
-		if (accumulator != 0) {
-			bool success = tensorSet(C, CCoords, accumulator);
-			if (!success) {
+
+		// A part of the output coordinates is fixed for this entry
+		CMode = 0;
+		for (tMode_t m = 0; m < A->order; m++)
+			if (!contracted[m])
+				freeCoords[CMode++] = item.coords[m];
+
+		for (size_t j = begin; j < end; j++) {
+			STATS_COUNT(mem, 1); // fetch B entry
+			for (tMode_t m = 0; m < BFibers.order; m++)
+				freeCoords[AFreeCount + m] =
+				    BFibers.coords[j * BFibers.order + m];
+			for (tMode_t m = 0; m < COrder; m++)
+				CCoords[m] = freeCoords[perm ? perm[m] : m];
+
+			STATS_COUNT(mul, 1);
+			STATS_COUNT(add, 1);
+			float val = item.value * BFibers.values[j];
+			float accumulator = tensorGet(C, CCoords) + val;
+			if (!tensorSet(C, CCoords, accumulator)) {
 				printf("failed to insert value\n");
+				iter.cleanup(context);
+				_fiberIndexFree(&BFibers);
 				tensorFree(C);
-				free(ACoords);
-				free(BCoords);
+				free(contracted);
+				free(freeCoords);
 				free(CCoords);
 				return 0;
 			}
 		}
+		item = iter.next(A, context);
+	}
+	iter.cleanup(context);
 
-		// get next coordinates or finish
-		statsGlobal.add++;
-		statsGlobal.cmp++;
-		CMode = 0;
-		tMode_t BMode;
-		for (tMode_t mode = 0; CMode < C->order; mode++) {
-			BMode = mode - (A->order);
-			if (mode == a || BMode == b)
+	_fiberIndexFree(&BFibers);
+	free(contracted);
+	free(freeCoords);
+	free(CCoords);
+	return C;
+}
+
+// Same result as tensorContract, but driven by the nonzeros of A.
+// B is grouped by mode b once, then each nonzero of A only visits the
+// B fiber with the matching index, so work is nnz(A) * avg fiber length
+// instead of the volume of the output times the contracted dimension.
+Tensor * tensorContractSparse(enum storageType type, Tensor * A, Tensor * B,
+                              tMode_t a, tMode_t b) {
+	return tensorContractModes(type, A, B, 1, &a, &b);
+}
+
+// Contracts n mode pairs in one pass. The output has the free modes of A
+// followed by the free modes of B, each in their original order.
+static Tensor * _contractModes(enum storageType type, Tensor * A, Tensor * B,
+                               tMode_t n, tMode_t * aModes, tMode_t * bModes) {
+	if (!A || !A->values || !B || !B->values)
+		return 0;
+	if (!_checkModePairs(A, B, n, aModes, bModes)) {
+		printf("Tried to contract incompatible modes\n");
+		return 0;
+	}
+	return _contractFused(type, A, B, n, aModes, bModes, NULL);
+}
+
+Tensor * tensorContractModes(enum storageType type, Tensor * A, Tensor * B,
+                             tMode_t n, tMode_t * aModes, tMode_t * bModes) {
+	statsProbe probe;
+	statsBegin(&probe);
+	Tensor * C = _contractModes(type, A, B, n, aModes, bModes);
+	statsLastOperation = statsEnd(&probe);
+	return C;
+}
+
+#define EINSUM_LABELS 52 // a-z then A-Z
+
+static int _einsumLabel(char c) {
+	if (c >= 'a' && c <= 'z')
+		return c - 'a';
+	if (c >= 'A' && c <= 'Z')
+		return 26 + c - 'A';
+	return -1;
+}
+
+// Parses one operand's subscripts, one letter per mode. Returns a pointer
+// to the delimiter after them, or NULL if there are more than max.
+static const char * _einsumOperand(const char * spec, int * labels,
+                                   tMode_t * count, tMode_t max) {
+	*count = 0;
+	while (*spec == ' ')
+		spec++;
+	while (_einsumLabel(*spec) >= 0) {
+		if (*count == max)
+			return 0;
+		labels[(*count)++] = _einsumLabel(*spec);
+		spec++;
+	}
+	while (*spec == ' ')
+		spec++;
+	return spec;
+}
+
+// Einstein summation over two operands, e.g. "ijk,jkl->il". Letters that
+// appear in both inputs but not the output are contracted together in one
+// fused pass, and the output may list the free letters in any order.
+// Without "->" the output is the free letters in alphabetical order.
+// Repeated letters within an operand (traces) and letters kept from both
+// inputs (batch modes) aren't supported.
+static Tensor * _einsum(enum storageType type, const char * spec, Tensor * A,
+                        Tensor * B) {
+	if (!spec || !A || !A->values || !B || !B->values)
+		return 0;
+
+	int labels[2 * EINSUM_LABELS];
+	int outLabels[EINSUM_LABELS];
+	int * ALabels = labels;
+	int * BLabels = labels + A->order;
+	tMode_t ACount = 0, BCount = 0, outCount = 0;
+	bool explicitOutput = false;
+	if (A->order > EINSUM_LABELS || B->order > EINSUM_LABELS) {
+		printf("einsum: too many modes to label\n");
+		return 0;
+	}
+
+	const char * s = _einsumOperand(spec, ALabels, &ACount, A->order);
+	if (s && *s == ',')
+		s = _einsumOperand(s + 1, BLabels, &BCount, B->order);
+	else
+		s = 0;
+	if (s && s[0] == '-' && s[1] == '>') {
+		explicitOutput = true;
+		s = _einsumOperand(s + 2, outLabels, &outCount, EINSUM_LABELS);
+	}
+	if (!s || *s || ACount != A->order || BCount != B->order) {
+		printf("einsum: malformed spec \"%s\"\n", spec);
+		return 0;
+	}
+
+	// classify each letter by where it appears
+	int inA[EINSUM_LABELS] = {0};
+	int inB[EINSUM_LABELS] = {0};
+	int inOut[EINSUM_LABELS] = {0};
+	for (tMode_t m = 0; m < ACount; m++)
+		inA[ALabels[m]]++;
+	for (tMode_t m = 0; m < BCount; m++)
+		inB[BLabels[m]]++;
+	for (tMode_t m = 0; m < outCount; m++)
+		inOut[outLabels[m]]++;
+	for (int l = 0; l < EINSUM_LABELS; l++) {
+		bool isFree = inA[l] != inB[l];
+		if (inA[l] > 1 || inB[l] > 1 || inOut[l] > 1) {
+			printf("einsum: repeated subscript in one operand\n");
+			return 0;
+		}
+		if (inA[l] && inB[l] && inOut[l]) {
+			printf("einsum: batch subscripts aren't supported\n");
+			return 0;
+		}
+		if (inOut[l] && !isFree) {
+			printf("einsum: output subscript missing from inputs\n");
+			return 0;
+		}
+		if (explicitOutput && isFree && !inOut[l]) {
+			printf("einsum: free subscripts must appear in the output\n");
+			return 0;
+		}
+		if (!explicitOutput && isFree)
+			outLabels[outCount++] = l;
+	}
+
+	// pair up contracted modes and find where each free mode lands
+	tMode_t aModes[EINSUM_LABELS];
+	tMode_t bModes[EINSUM_LABELS];
+	tMode_t perm[2 * EINSUM_LABELS];
+	tMode_t n = 0;
+	for (tMode_t m = 0; m < ACount; m++) {
+		for (tMode_t j = 0; j < BCount; j++) {
+			if (ALabels[m] != BLabels[j])
 				continue;
-			CCoords[CMode]++;
-			if (CMode < A->order - 1) { // increment A part of C coord
-				ACoords[mode]++;
-				if (ACoords[mode] == A->shape[mode]) {
-					ACoords[mode] = 0;
-					CCoords[CMode] = 0;
-					CMode++;
-					continue;
-				}
-				break;
-			} else { // increment B part of C coord
-				BCoords[BMode]++;
-				if (BCoords[BMode] == B->shape[BMode]) {
-					if (CMode == C->order - 1) {
-						done = true;
+			aModes[n] = m;
+			bModes[n] = j;
+			n++;
+		}
+	}
+	if (!_checkModePairs(A, B, n, aModes, bModes)) {
+		printf("einsum: incompatible contracted modes\n");
+		return 0;
+	}
+	for (tMode_t c = 0; c < outCount; c++) {
+		tMode_t freePos = 0;
+		for (tMode_t m = 0; m < ACount + BCount; m++) {
+			int l = labels[m];
+			if (inA[l] && inB[l])
+				continue;
+			if (l == outLabels[c])
+				perm[c] = freePos;
+			freePos++;
+		}
+	}
+	return _contractFused(type, A, B, n, aModes, bModes, perm);
+}
+
+Tensor * tensorEinsum(enum storageType type, const char * spec, Tensor * A,
+                      Tensor * B) {
+	statsProbe probe;
+	statsBegin(&probe);
+	Tensor * C = _einsum(type, spec, A, B);
+	statsLastOperation = statsEnd(&probe);
+	return C;
+}
+
+// Built on a prefix range, so on the B+ tree, CSF and sorted COO the
+// work is proportional to the slice rather than to nnz(T).
+Tensor * tensorSlice(enum storageType type, Tensor * T, tCoord_t * prefix,
+                     tMode_t p) {
+	if (!T || !T->values) {
+		printf("Tried to slice invalid tensor\n");
+		return 0;
+	}
+	if (p > T->order || (p && !prefix)) {
+		printf("Slice prefix out of range\n");
+		return 0;
+	}
+	for (tMode_t m = 0; m < p; m++) {
+		if (prefix[m] >= T->shape[m]) {
+			printf("Slice prefix out of range\n");
+			return 0;
+		}
+	}
+
+	Tensor * C = tensorNew(type, T->order - p, &T->shape[p]);
+	tensorRange * range = tensorRangeNew(T, prefix, p);
+	if (!C || !range) {
+		printf("failed to allocate\n");
+		tensorFree(C);
+		tensorRangeFree(range);
+		return 0;
+	}
+
+	outputBuffer out = {0};
+	tensorEntry item = tensorRangeNext(range);
+	while (item.coords != 0) {
+		if (!_outputAppend(&out, C->order, &item.coords[p], item.value)) {
+			printf("failed to insert value\n");
+			tensorRangeFree(range);
+			tensorFree(C);
+			_outputFree(&out);
+			return 0;
+		}
+		item = tensorRangeNext(range);
+	}
+	tensorRangeFree(range);
+
+	if (!tensorBuild(C, out.count, out.coords, out.values)) {
+		printf("failed to insert value\n");
+		tensorFree(C);
+		C = 0;
+	}
+	_outputFree(&out);
+	return C;
+}
+
+typedef struct streamEntry {
+	tKey_t key;
+	float value;
+} streamEntry;
+
+static int _streamEntryCompare(const void * x, const void * y) {
+	const streamEntry * a = x;
+	const streamEntry * b = y;
+	STATS_COUNT(cmp, 1);
+	return a->key < b->key ? -1 : a->key > b->key;
+}
+
+// Appends part's entries to out in key order, block entries at a time
+// through keys and values.
+static bool _streamFlush(Tensor * part, tensorFile * out, tKey_t * keys,
+                         float * values, size_t block) {
+	streamEntry * entries = malloc((part->entryCount + 1) * sizeof(streamEntry));
+	if (!entries)
+		return false;
+	tensorIterator iter = tensorGetIterator(part);
+	void * context = iter.init(part);
+	size_t count = 0;
+	for (tensorEntry item = iter.next(part, context);
+	     item.coords && count < part->entryCount;
+	     item = iter.next(part, context)) {
+		entries[count].key = tensorCoords2Key(part, item.coords);
+		entries[count].value = item.value;
+		count++;
+	}
+	iter.cleanup(context);
+	qsort(entries, count, sizeof(streamEntry), _streamEntryCompare);
+
+	bool success = true;
+	for (size_t i = 0; success && i < count; i += block) {
+		size_t n = count - i < block ? count - i : block;
+		for (size_t j = 0; j < n; j++) {
+			keys[j] = entries[i + j].key;
+			values[j] = entries[i + j].value;
+		}
+		STATS_COUNT(mem, n);
+		success = tensorFileAppend(out, n, keys, values);
+	}
+	free(entries);
+	return success;
+}
+
+// bytes held by a fiber index
+static size_t _fiberIndexSize(fiberIndex * idx) {
+	size_t entries = idx->offsets[idx->fiberCount];
+	size_t bytes = entries * (idx->order * sizeof(tCoord_t) + sizeof(float));
+	bytes += (idx->fiberCount + 1) * sizeof(size_t);
+	if (idx->keys)
+		bytes += idx->fiberCount * sizeof(fiberKey_t);
+	return bytes;
+}
+
+// The output is made one partition at a time, each a range of its first
+// coordinate, summed in memory and appended to CFile in key order. Every
+// partition reads A from the file again, except that when A is sorted
+// and its mode 0 is the output's, a partition's entries are one run and
+// each is read once. A partition that outgrows the budget is abandoned
+// and redone at half the width, down to a single index.
+// B stays resident as a fiber index, counted against the budget along
+// with one chunk of A and the partition being summed.
+static bool _contractStream(const char * CFile, const char * AFile, Tensor * B,
+                            tMode_t a, tMode_t b, size_t budget) {
+	if (!B || !B->values || b >= B->order)
+		return false;
+	tensorFile * in = tensorFileOpen(AFile);
+	if (!in)
+		return false;
+	Tensor * A = in->T; // empty, only for its shape and keys
+	if (a >= A->order || A->shape[a] != B->shape[b]) {
+		printf("Tried to contract incompatible modes\n");
+		tensorFileClose(in);
+		return false;
+	}
+
+	// construct shape of result tensor
+	tMode_t COrder = A->order + B->order - 2;
+	tCoord_t * CShape = calloc(COrder + 1, sizeof(tCoord_t));
+	if (!CShape) {
+		printf("failed to allocate\n");
+		tensorFileClose(in);
+		return false;
+	}
+	tMode_t CMode = 0;
+	for (tMode_t m = 0; m < A->order; m++)
+		if (m != a)
+			CShape[CMode++] = A->shape[m];
+	for (tMode_t m = 0; m < B->order; m++)
+		if (m != b)
+			CShape[CMode++] = B->shape[m];
+
+	fiberIndex BFibers = {0};
+	Tensor * C = tensorNew(probingHashtable, COrder, CShape);
+	tCoord_t * ACoords = calloc(A->order + 1, sizeof(tCoord_t));
+	tCoord_t * CCoords = calloc(COrder + 1, sizeof(tCoord_t));
+	bool indexed = C && ACoords && CCoords &&
+	               _fiberIndexBuild(&BFibers, B, 1, &b);
+	free(CShape);
+	size_t BBytes = indexed ? _fiberIndexSize(&BFibers) : 0;
+	size_t spare = budget > BBytes ? budget - BBytes : 0;
+	size_t chunk = spare / 4 / (sizeof(tKey_t) + sizeof(float));
+	if (chunk < STREAM_MIN_CHUNK)
+		chunk = STREAM_MIN_CHUNK;
+	size_t chunkBytes = chunk * (sizeof(tKey_t) + sizeof(float));
+	tKey_t * keys = indexed ? malloc(chunk * sizeof(tKey_t)) : 0;
+	float * values = indexed ? malloc(chunk * sizeof(float)) : 0;
+	tensorFile * out = keys && values ? tensorFileCreate(CFile, C) : 0;
+	if (!out) {
+		printf("failed to allocate\n");
+		if (indexed)
+			_fiberIndexFree(&BFibers);
+		tensorFree(C);
+		free(ACoords);
+		free(CCoords);
+		free(keys);
+		free(values);
+		tensorFileClose(in);
+		return false;
+	}
+	if (BBytes + chunkBytes >= budget)
+		printf("B and one chunk of A take %lu bytes, over the budget of %lu\n",
+		       BBytes + chunkBytes, budget);
+	size_t partBudget =
+	    budget > BBytes + chunkBytes ? budget - BBytes - chunkBytes : 0;
+
+	// partitions split the first output mode, from A if it has free modes
+	bool fromA = A->order > 1;
+	tMode_t AFirst = a ? 0 : 1;
+	bool inOrder = fromA && in->sorted && AFirst == 0;
+	tCoord_t extent = COrder ? C->shape[0] : 1;
+	tCoord_t width = extent;
+	size_t resume = 0;
+	bool success = true;
+	for (tCoord_t lo = 0; success && lo < extent;) {
+		tCoord_t hi = extent - lo > width ? lo + width : extent;
+		bool over = false;
+		bool past = false;
+		size_t stop = in->nnz;
+		for (size_t first = inOrder ? resume : 0;
+		     success && !over && !past && first < in->nnz; first += chunk) {
+			size_t n = tensorFileRead(in, first, chunk, keys, values);
+			success = n > 0;
+			for (size_t i = 0; success && !over && i < n; i++) {
+				STATS_COUNT(mem, 1); // fetch A entry
+				tensorKey2Coords(A, ACoords, keys[i]);
+				STATS_COUNT(cmp, 1);
+				if (fromA && (ACoords[AFirst] < lo || ACoords[AFirst] >= hi)) {
+					if (inOrder && ACoords[AFirst] >= hi) {
+						stop = first + i;
+						past = true;
 						break;
 					}
-					BCoords[BMode] = 0;
-					CCoords[CMode] = 0;
-					CMode++;
-					//coordsPrint(C, CCoords);
-					//putchar('\n');
 					continue;
 				}
-				break;
+				size_t begin, end;
+				if (!values[i] ||
+				    !_fiberFind(&BFibers, _fiberKey(ACoords, A->shape, 1, &a),
+				                &begin, &end))
+					continue;
+
+				CMode = 0;
+				for (tMode_t m = 0; m < A->order; m++)
+					if (m != a)
+						CCoords[CMode++] = ACoords[m];
+				for (size_t j = begin; j < end; j++) {
+					STATS_COUNT(mem, 1); // fetch B entry
+					tCoord_t * BCoords = &BFibers.coords[j * BFibers.order];
+					STATS_COUNT(cmp, 1);
+					if (!fromA && COrder && (BCoords[0] < lo || BCoords[0] >= hi))
+						continue;
+					for (tMode_t m = 0; m < BFibers.order; m++)
+						CCoords[CMode + m] = BCoords[m];
+
+					STATS_COUNT(mul, 1);
+					STATS_COUNT(add, 1);
+					float val = values[i] * BFibers.values[j];
+					float accumulator = tensorGet(C, CCoords) + val;
+					success = success && tensorSet(C, CCoords, accumulator);
+				}
+				size_t partBytes =
+				    tensorSize(C) + C->entryCount * sizeof(streamEntry);
+				over = width > 1 && partBytes > partBudget;
 			}
 		}
-		if (done)
-			break;
+
+		if (success && !over)
+			success = _streamFlush(C, out, keys, values, chunk);
+		tensorFree(C);
+		C = tensorNew(probingHashtable, out->T->order, out->T->shape);
+		success = success && C;
+		if (over) {
+			width /= 2;
+			continue;
+		}
+		if (inOrder)
+			resume = stop;
+		lo = hi;
 	}
 
+	if (!success)
+		printf("failed to contract \"%s\" into \"%s\"\n", AFile, CFile);
+	_fiberIndexFree(&BFibers);
+	tensorFree(C);
 	free(ACoords);
-	free(BCoords);
 	free(CCoords);
-	return C;
+	free(keys);
+	free(values);
+	tensorFileClose(in);
+	return tensorFileClose(out) && success;
+}
+
+bool tensorContractStream(const char * CFile, const char * AFile, Tensor * B,
+                          tMode_t a, tMode_t b, size_t budget) {
+	statsProbe probe;
+	statsBegin(&probe);
+	bool success = _contractStream(CFile, AFile, B, a, b, budget);
+	statsLastOperation = statsEnd(&probe);
+	return success;
 }
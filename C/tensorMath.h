@@ -1,6 +1,36 @@
 #pragma once
 #include "tensor.h"
+#include <stdbool.h>
+
+#define STREAM_MIN_CHUNK 1024 // A entries read at once, at least
 
 Tensor * tensorTrace(enum storageType type, Tensor * T, tMode_t a, tMode_t b);
+Tensor * tensorTraceSparse(enum storageType type, Tensor * T, tMode_t a,
+                           tMode_t b);
 Tensor * tensorContract(enum storageType type, Tensor * A, Tensor * B,
                         tMode_t a, tMode_t b);
+// The dense loops above split over up to threads threads. Deterministic
+// output matches the serial functions bit for bit. Otherwise, a small
+// output may be computed from per-thread partial sums.
+Tensor * tensorTraceParallel(enum storageType type, Tensor * T, tMode_t a,
+                             tMode_t b, unsigned int threads,
+                             bool deterministic);
+Tensor * tensorContractParallel(enum storageType type, Tensor * A, Tensor * B,
+                                tMode_t a, tMode_t b, unsigned int threads,
+                                bool deterministic);
+Tensor * tensorContractSparse(enum storageType type, Tensor * A, Tensor * B,
+                              tMode_t a, tMode_t b);
+// Contracts the tensor in binary file AFile with B like tensorContract,
+// into binary file CFile, holding at most about budget bytes of A and
+// the output in memory. For a sorted A, the result is the same as
+// tensorContract's bit for bit.
+bool tensorContractStream(const char * CFile, const char * AFile, Tensor * B,
+                          tMode_t a, tMode_t b, size_t budget);
+Tensor * tensorContractModes(enum storageType type, Tensor * A, Tensor * B,
+                             tMode_t n, tMode_t * aModes, tMode_t * bModes);
+Tensor * tensorEinsum(enum storageType type, const char * spec, Tensor * A,
+                      Tensor * B);
+// the entries of T whose first p coordinates equal prefix, as a tensor
+// over the remaining order - p modes
+Tensor * tensorSlice(enum storageType type, Tensor * T, tCoord_t * prefix,
+                     tMode_t p);